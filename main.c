@@ -0,0 +1,713 @@
+/* main.c */
+/* command line interface of the planet generating program */
+/* Copyright 1988--2009 Torben AE. Mogensen */
+
+/* The generator itself is in planet.c, see planet.h for its interface */
+
+/* The primitive user interface is primarily a result of portability concerns */
+
+#ifdef THINK_C
+#define macintosh 1
+#endif
+
+#ifdef macintosh
+#include <console.h>
+#include <unix.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#if !defined(_WIN32) && !defined(macintosh)
+#include <sys/resource.h> /* for the peak memory use in --stats */
+#define RUSAGE
+#endif
+
+#include "planet.h"
+#include "options.h"
+
+char* file_ext(ftype file_type)
+{
+  switch (file_type)
+  {
+    case bmp:
+      return (".bmp");
+    case ppm:
+      return (".ppm");
+    case xpm:
+      return (".xpm");
+    case png:
+      return (".png");
+    case pgm:
+      return (".pgm");
+    case raw:
+      return (".raw");
+    case npy:
+      return (".npy");
+    default:
+      return ("");
+  }
+}
+
+/* read the argument of option av[i] */
+
+#define ARG(format, var)					\
+  if (i+1 < ac) sscanf(av[++i], format, var);			\
+  else { sprintf(msg, "Missing argument to %.200s", av[i]); return(-1); }
+
+void defaultoptions(options *o)
+{
+  strcpy(o->filename, "planet-map");
+  strcpy(o->colorsname, "Olsson.col");
+  o->do_file = 0;
+  o->nout = 0;
+  o->tiledir = 0;
+  o->zmin = o->zmax = 0;
+  o->serve = 0;
+  o->batch = 0;
+  o->frames = 0;
+  o->dlon = o->dlat = 0.0;
+  o->dzoom = 1.0;
+}
+
+/* Read the options in av[1..ac-1] into ctx and o.  Returns 0, or -1 */
+/* with a message in msg (which must have room for 256 characters) */
+
+int getoptions(planet_ctx *ctx, options *o, int ac, char **av, char *msg)
+{
+  int i;
+
+  for (i = 1; i<ac; i++) {
+    if (av[i][0] == '-') {
+      switch (av[i][1]) {
+	case 'X' : ctx->debug = 1;
+		   break;
+	case 'V' : ARG("%lf",&ctx->dd2);
+		   break;
+	case 'v' : ARG("%lf",&ctx->dd1);
+		   break;
+	case 's' : ARG("%lf",&ctx->rseed);
+		   break;
+	case 'w' : ARG("%d",&ctx->Width);
+		   break;
+	case 'h' : ARG("%d",&ctx->Height);
+		   break;
+	case 'm' : ARG("%lf",&ctx->scale);
+		   break;
+	case 'o' : ARG("%250s",o->filename);
+		   o->do_file = 1;
+		   if (o->nout == MAXOUTS) {
+		     sprintf(msg,"More than %d -o options",MAXOUTS);
+		     return(-1);
+		   }
+		   o->outarg[o->nout++] = i;
+		   break;
+	case 'x' : ctx->file_type =xpm;
+		   break;
+	case 'C' : ARG("%255s",o->colorsname);
+		   break;
+	case 'l' : ARG("%lf",&ctx->longitude);
+		   break;
+	case 'L' : ARG("%lf",&ctx->latitude);
+		   break;
+	case 'g' : ARG("%lf",&ctx->vgrid);
+		   break;
+	case 'G' : ARG("%lf",&ctx->hgrid);
+		   break;
+	case 'c' : ctx->latic = 1;
+		   break;
+	case 'O' : ctx->do_outline = 1;
+		   ctx->do_bw = 1;
+		   if (strlen(av[i])>2)
+		     sscanf(av[i],"-O%d",&ctx->contourstep);
+		   break;
+	case 'E' : ctx->do_outline = 1;
+		   if (strlen(av[i])>2)
+		     sscanf(av[i],"-E%d",&ctx->contourstep);
+		   break;
+	case 'B' : ctx->doshade = 1;
+		   break;
+	case 'b' : ctx->doshade = 2;
+		   break;
+	case 'd' : ctx->doshade = 3;
+		   break;
+	case 'P' : ctx->file_type = ppm;
+		   break;
+	case 'N' : ctx->file_type = png;
+		   break;
+	case 'a' : ARG("%lf",&ctx->shade_angle);
+		   break;
+	case 'A' : ARG("%lf",&ctx->shade_angle2);
+		   break;
+	case 'i' : ARG("%lf",&ctx->M);
+		   break;
+	case 't' : ARG("%d",&ctx->nthreads);
+		   break;
+	case 'R' : ctx->recursive = 1;
+		   break;
+	case 'p' : if (strlen(av[i])>2) ctx->view = av[i][2];
+	           else if (i+1<ac) ctx->view = av[++i][0];
+	           switch (ctx->view) {
+		     case 'm' : 
+		     case 'p' : 
+		     case 'q' : 
+		     case 's' :
+		     case 'o' :
+		     case 'g' :
+		     case 'a' :
+		     case 'c' :
+		     case 'M' : 
+		     case 'S' :
+		     case 'h' :
+		     case 'i' :
+		     case 'f' : break;
+		     default: sprintf(msg,"Unknown projection: %.200s",av[i]);
+			      return(-1);
+		   }
+		   break;
+	case '-' : if (strcmp(av[i],"--tree-cache-mb") == 0 && i+1<ac)
+		     sscanf(av[++i],"%lf",&ctx->tree_mb);
+		   else if (strcmp(av[i],"--tiles") == 0 && i+3<ac) {
+		     o->tiledir = av[++i];
+		     sscanf(av[++i],"%d",&o->zmin);
+		     sscanf(av[++i],"%d",&o->zmax);
+		   }
+		   else if (strcmp(av[i],"--adaptive") == 0 && i+1<ac) {
+		     ctx->adaptive = 1;
+		     sscanf(av[++i],"%d",&ctx->adapttol);
+		   }
+		   else if (strcmp(av[i],"--band") == 0 && i+1<ac)
+		     sscanf(av[++i],"%d",&ctx->band);
+		   else if (strcmp(av[i],"--pixel-depth") == 0)
+		     ctx->pixeldepth = 1;
+		   else if (strcmp(av[i],"--sphere-grid") == 0 && i+1<ac)
+		     sscanf(av[++i],"%d",&ctx->sphere_n);
+		   else if (strcmp(av[i],"--stats") == 0)
+		     ctx->stats = 1;
+		   else if (strcmp(av[i],"--serve") == 0 && i+1<ac)
+		     o->serve = av[++i];
+		   else if (strcmp(av[i],"--batch") == 0 && i+1<ac)
+		     o->batch = av[++i];
+		   else if (strcmp(av[i],"--frames") == 0 && i+1<ac)
+		     sscanf(av[++i],"%d",&o->frames);
+		   else if (strcmp(av[i],"--dlon") == 0 && i+1<ac)
+		     sscanf(av[++i],"%lf",&o->dlon);
+		   else if (strcmp(av[i],"--dlat") == 0 && i+1<ac)
+		     sscanf(av[++i],"%lf",&o->dlat);
+		   else if (strcmp(av[i],"--dzoom") == 0 && i+1<ac)
+		     sscanf(av[++i],"%lf",&o->dzoom);
+		   else if (strcmp(av[i],"--frame-reuse") == 0 && i+1<ac)
+		     sscanf(av[++i],"%lf",&ctx->reuse);
+		   else if (strcmp(av[i],"--search-seeds") == 0 && i+1<ac)
+		     sscanf(av[++i],"%ld",&ctx->maxseeds);
+		   else if (strcmp(av[i],"--search-time") == 0 && i+1<ac)
+		     sscanf(av[++i],"%lf",&ctx->maxsecs);
+		   else if (strcmp(av[i],"--search-goal") == 0 && i+1<ac)
+		     sscanf(av[++i],"%d",&ctx->goal);
+		   else if (strcmp(av[i],"--heights") == 0 && i+1<ac) {
+		     i++;
+		     if (strcmp(av[i],"pgm") == 0) ctx->file_type = pgm;
+		     else if (strcmp(av[i],"raw") == 0) ctx->file_type = raw;
+		     else if (strcmp(av[i],"npy") == 0) ctx->file_type = npy;
+		     else {
+		       sprintf(msg,"Unknown heightfield format: %.200s",av[i]);
+		       return(-1);
+		     }
+		   }
+		   else {
+		     sprintf(msg,"Unknown option: %.200s",av[i]);
+		     return(-1);
+		   }
+		   break;
+	default: sprintf(msg,"Unknown option: %.200s",av[i]);
+		 return(-1);
+      }
+    }
+    else {
+      sprintf(msg,"Unknown option: %.200s",av[i]);
+      return(-1);
+    }
+  }
+
+  return(0);
+}
+
+/* Write the world file of a heightfield (and the ENVI header of a */
+/* raw one) next to it, with its extension replaced */
+
+void sidecars(planet_ctx *ctx, char *filename)
+{
+  char name[260], *dot;
+  FILE *f;
+
+  if (ctx->file_type != pgm && ctx->file_type != raw &&
+      ctx->file_type != npy)
+    return;
+  strcpy(name, filename);
+  dot = strrchr(name, '.');
+  if (dot == 0 || strchr(dot, '/') != 0) dot = name+strlen(name);
+  if (ctx->view == 'm' || ctx->view == 'q') {
+    strcpy(dot, ".wld");
+    if ((f = fopen(name, "w")) != 0) {
+      planet_writeworld(ctx, f);
+      fclose(f);
+    }
+  }
+  if (ctx->file_type == raw) {
+    strcpy(dot, ".hdr");
+    if ((f = fopen(name, "w")) != 0) {
+      planet_writehdr(ctx, f);
+      fclose(f);
+    }
+  }
+}
+
+/* With --stats, print the statistics of the map just written to name */
+/* as a line of JSON on stderr */
+
+static void printstats(planet_ctx *ctx, char *name)
+{
+  static char *phases[PLANET_PHASES] = {
+    "colours", "setup", "render", "outline", "grid", "shades", "output"
+  };
+  long peak = -1;
+  int k, n;
+#ifdef RUSAGE
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) == 0) peak = ru.ru_maxrss;
+#endif
+
+  if (!ctx->stats) return;
+  fprintf(stderr, "{\"file\": \"%s\", \"view\": \"%c\", \"width\": %d, "
+	  "\"height\": %d, \"threads\": %d, \"phases\": {",
+	  name, ctx->view, ctx->Width, ctx->Height, ctx->nthreads);
+  for (k = 0; k < PLANET_PHASES; k++)
+    fprintf(stderr, "%s\"%s\": {\"wall\": %.4f, \"cpu\": %.4f}",
+	    k > 0 ? ", " : "", phases[k], ctx->wallsecs[k], ctx->cpusecs[k]);
+  fprintf(stderr, "}, \"points\": %ld, \"calls\": %ld, \"levels\": [",
+	  ctx->sspoints, ctx->calls);
+  for (n = PLANET_LEVELS; n > 0 && ctx->levels[n-1] == 0; n--);
+  for (k = 0; k < n; k++)
+    fprintf(stderr, "%s%ld", k > 0 ? ", " : "", ctx->levels[k]);
+  fprintf(stderr, "], \"cache_hits\": %ld, \"cache_hit_rate\": %.4f, "
+	  "\"background_pixels\": %ld, \"peak_rss_kb\": %ld}\n",
+	  ctx->sshits, ctx->sspoints > 0 ? (double)ctx->sshits/ctx->sspoints : 0.0,
+	  ctx->background, peak);
+}
+
+/* Write the o->frames frames of an animation to files numbered from 0, */
+/* each turned by dlon and dlat and magnified by dzoom from the one */
+/* before.  The frames are made with the same context, which keeps the */
+/* memory of the map, the subdivision tree (with --tree-cache-mb) and */
+/* the samples of an orthographic frame (with --frame-reuse) from one */
+/* to the next.  Returns 0, or -1 if a frame could not be written */
+
+int frames(planet_ctx *ctx, options *o)
+{
+  char name[300], base[260], num[16], *ext, *dot;
+  double lon = ctx->longitude, lat = ctx->latitude, scale = ctx->scale;
+  int f, k, digits;
+  FILE *outfile;
+
+  strcpy(base, o->filename);
+  dot = strrchr(base, '.');
+  if (dot != 0 && strchr(dot, '/') == 0) {
+    ext = o->filename+(dot-base);
+    *dot = 0;
+  }
+  else ext = file_ext(ctx->file_type);
+  for (digits = 4; o->frames > 1 && (int)log10(o->frames-1.0) >= digits;
+       digits++);
+
+  for (f = 0; f < o->frames; f++) {
+    ctx->longitude = fmod(lon+f*o->dlon, 360.0);
+    if (ctx->longitude < 0.0) ctx->longitude += 360.0;
+    ctx->latitude = lat+f*o->dlat;
+    ctx->scale = scale*pow(o->dzoom, f);
+    sprintf(num, "%d", f);
+    strcpy(name, base);
+    for (k = strlen(num); k < digits; k++) strcat(name, "0");
+    strcat(name, num);
+    strcat(name, ext);
+    if ((outfile = fopen(name, "wb")) == 0) {
+      fprintf(stderr, "Could not open output file %s, error code = %d\n",
+	      name, errno);
+      return(-1);
+    }
+    if (planet_setup(ctx) != 0) {
+      fclose(outfile);
+      fprintf(stderr, "Memory allocation failed.");
+      return(-1);
+    }
+    planet_stream(ctx, outfile);
+    if (fclose(outfile) != 0) {
+      fprintf(stderr, "Could not write %s\n", name);
+      return(-1);
+    }
+    sidecars(ctx, name);
+    printstats(ctx, name);
+    if (ctx->debug)
+      fprintf(stderr, "\nframe %d: %s, tree %ld nodes, %ld pixels reused\n",
+	      f, name, ctx->treenodes, ctx->reused);
+  }
+  return(0);
+}
+
+/* Make a map for each of the o->nout -o options on the command line, */
+/* each with the options up to its -o (the last with all of them).  The */
+/* maps are made one after the other with all the -t threads in one */
+/* context, which keeps the memory of the map, the subdivision tree */
+/* (--tree-cache-mb) and the sphere grid (--sphere-grid) for the next. */
+/* Rendering them side by side would not use the threads any better, */
+/* as each map already keeps all of them busy, and would lose that. */
+/* ctx holds the colours of o->colorsname, which are not read again. */
+/* Returns 0, or -1 if a map could not be made */
+
+int outputs(planet_ctx *ctx, options *o, int ac, char **av)
+{
+  planet_ctx *c, *defaults;
+  options oc;
+  FILE *outfile;
+  char msg[256];
+  int k, error = 0;
+
+  c = planet_new();
+  defaults = planet_new();
+  if (c == 0 || defaults == 0) {
+    fprintf(stderr, "Memory allocation failed.");
+    return(-1);
+  }
+  for (k = 0; k < o->nout && !error; k++) {
+    planet_copy(c, defaults);
+    defaultoptions(&oc);
+    if (getoptions(c, &oc, k < o->nout-1 ? o->outarg[k]+1 : ac, av, msg)
+	!= 0) {
+      fprintf(stderr, "%s\n", msg);
+      error = 1;
+      break;
+    }
+    if (strcmp(oc.colorsname, o->colorsname) == 0) {
+      c->nocols = ctx->nocols;
+      c->SEA = ctx->SEA; c->LAND = ctx->LAND; c->HIGHEST = ctx->HIGHEST;
+      memcpy(c->rtable, ctx->rtable, sizeof(ctx->rtable));
+      memcpy(c->gtable, ctx->gtable, sizeof(ctx->gtable));
+      memcpy(c->btable, ctx->btable, sizeof(ctx->btable));
+    }
+    else if (planet_readcolors(c, oc.colorsname) != 0) {
+      fprintf(stderr, "Cannot open %s\n", oc.colorsname);
+      error = 1;
+      break;
+    }
+    if (c->view == 'f' || oc.tiledir != 0) {
+      fprintf(stderr, "-pf and --tiles can not be used with several -o\n");
+      error = 1;
+      break;
+    }
+    if (oc.frames > 0) {
+      error = frames(c, &oc) != 0;
+      continue;
+    }
+    if (strchr(oc.filename, '.') == 0)
+      strcat(oc.filename, file_ext(c->file_type));
+    if ((outfile = fopen(oc.filename, "wb")) == 0) {
+      fprintf(stderr, "Could not open output file %s, error code = %d\n",
+	      oc.filename, errno);
+      error = 1;
+    }
+    else if (planet_setup(c) != 0) {
+      fclose(outfile);
+      fprintf(stderr, "Memory allocation failed.");
+      error = 1;
+    }
+    else {
+      planet_stream(c, outfile);
+      if (fclose(outfile) != 0) {
+	fprintf(stderr, "Could not write %s\n", oc.filename);
+	error = 1;
+      }
+      else sidecars(c, oc.filename);
+      printstats(c, oc.filename);
+      if (c->view == 'p')
+	fprintf(stderr,"%swater percentage: %d\n", c->debug ? "\n" : "",
+		(int)(100*c->water/(c->water+c->land)));
+      if (c->debug)
+	fprintf(stderr, "\nmap %d: %s\n", k+1, oc.filename);
+    }
+  }
+  planet_free(defaults);
+  planet_free(c);
+  return(error ? -1 : 0);
+}
+
+int main(ac,av)
+int ac;
+char **av;
+{
+  void print_error();
+  planet_ctx *ctx;
+  FILE *outfile;
+  options o;
+  char msg[256];
+
+  ctx = planet_new();
+  if (ctx == 0) {
+    fprintf(stderr, "Memory allocation failed.");
+    exit(1);
+  }
+  defaultoptions(&o);
+
+#ifdef macintosh
+  _ftype = 'TEXT';
+  _fcreator ='ttxt';
+
+  ac = ccommand (&av);
+  ctx->debug = 1;
+  o.do_file = 1;
+#endif
+
+  outfile = stdout;
+  
+  if (getoptions(ctx, &o, ac, av, msg) != 0) {
+    fprintf(stderr,"%s\n",msg);
+    print_error(o.do_file ? o.filename : "standard output", 
+	       !o.do_file ? "" : file_ext(ctx->file_type));
+  }
+
+  if (planet_readcolors(ctx, o.colorsname) != 0) {
+    fprintf(stderr, 
+	    "Cannot open %s\n", 
+	    o.colorsname);
+    exit(1);
+  }
+
+  if (o.serve != 0) { /* render daemon, until it is stopped */
+    if (serve(ctx, &o) != 0) exit(1);
+    planet_free(ctx);
+    return(0);
+  }
+
+  if (o.batch != 0) { /* job file */
+    if (batch(ctx, &o) != 0) exit(1);
+    planet_free(ctx);
+    return(0);
+  }
+
+  if (o.nout > 1) { /* several maps */
+    if (outputs(ctx, &o, ac, av) != 0) exit(1);
+    planet_free(ctx);
+    return(0);
+  }
+
+  if (o.frames > 0 && ctx->view != 'f') { /* animation */
+    if (frames(ctx, &o) != 0) exit(1);
+    planet_free(ctx);
+    return(0);
+  }
+
+  if (o.tiledir != 0) { /* tile pyramid */
+    if (planet_tiles(ctx, o.tiledir, o.zmin, o.zmax) != 0) {
+      fprintf(stderr, "Could not write the tiles to %s\n", o.tiledir);
+      exit(1);
+    }
+    if (ctx->debug)
+      fprintf(stderr, "\n");
+    planet_free(ctx);
+    return(0);
+  }
+
+  if (o.do_file &&'\0' != o.filename[0]) {
+    if (strchr (o.filename, '.') == 0)
+      strcpy(&(o.filename[strlen(o.filename)]), file_ext(ctx->file_type));
+
+#ifdef macintosh
+    switch (ctx->file_type)
+    {
+      case bmp:
+	_ftype = 'BMPf';
+	break;
+      case ppm:
+	_ftype = 'PPGM';
+	break;
+      case xpm:
+	_ftype = 'TEXT';
+	break;
+      case png:
+	_ftype = 'PNGf';
+	break;
+      default:
+	_ftype = 'BINA';
+	break;
+    }
+      
+    _fcreator ='GKON';
+#endif
+
+    outfile = fopen(o.filename,"wb");
+
+#ifdef macintosh
+    _ftype = 'TEXT';
+    _fcreator ='ttxt';
+#endif
+
+    if (outfile == NULL) {
+      fprintf(stderr,
+	      "Could not open output file %s, error code = %d\n",
+	      o.filename, errno);
+      exit(0);
+    }
+  }
+  else
+    outfile = stdout;
+  
+  if (ctx->view == 'f') planet_readmap(ctx, stdin);
+
+  if (planet_setup(ctx) != 0) {
+    fprintf(stderr, "Memory allocation failed.");
+    exit(1);
+  }
+
+  if (ctx->view == 'f') { /* Search */
+    planet_search(ctx, stdout);
+    fprintf(stderr, "search: %ld seeds in %.1f s, %.1f seeds/s\n",
+	    ctx->seeds, ctx->seedsecs,
+	    ctx->seedsecs > 0.0 ? ctx->seeds/ctx->seedsecs : 0.0);
+    if (ctx->seeds > 0)
+      fprintf(stderr, "search: %ld seeds rejected early, %.1f of %d rows"
+	      " mapped per seed\n", ctx->rejected,
+	      (double)ctx->searchrows/ctx->seeds, ctx->Height);
+    planet_free(ctx);
+    return(0);
+  }
+
+  /* render and plot picture (a band at a time with --band) */
+  planet_stream(ctx, outfile);
+  fclose(outfile);
+
+  if (o.do_file && '\0' != o.filename[0])
+    sidecars(ctx, o.filename);
+  printstats(ctx, o.do_file ? o.filename : "-");
+
+  if (ctx->view == 'p') {
+    if (ctx->debug)
+      fprintf(stderr,"\n");
+    fprintf(stderr,"water percentage: %d\n",
+	    (int)(100*ctx->water/(ctx->water+ctx->land)));
+  }
+
+  if (ctx->debug)
+    fprintf(stderr, "\n");
+
+  if (ctx->debug && ctx->sspoints > 0)
+    fprintf(stderr,
+	    "tetrahedron cache: %.1f%% hits, %.1f of %.1f levels skipped\n",
+	    100.0*ctx->sshits/ctx->sspoints,
+	    ctx->ssskipped/ctx->sspoints, ctx->sslevels/ctx->sspoints);
+
+  if (ctx->debug && ctx->treenodes > 0)
+    fprintf(stderr,
+	    "subdivision tree: %ld nodes (%.1f MB), %ld points left it when full\n",
+	    ctx->treenodes, ctx->treemb, ctx->treefull);
+
+  if (ctx->debug && ctx->adaptive)
+    fprintf(stderr, "adaptive: %ld of %ld pixels interpolated\n",
+	    ctx->interpolated, (long)ctx->Width*ctx->Height);
+
+  if (ctx->debug && ctx->outbytes > 0)
+    fprintf(stderr, "output: %.1f MB in %.2f s, %.1f MB/s\n",
+	    ctx->outbytes/1048576.0, ctx->outsecs,
+	    ctx->outbytes/1048576.0/(ctx->outsecs > 0.0 ? ctx->outsecs : 1e-6));
+
+  planet_free(ctx);
+  return(0);
+}
+
+void print_error(char *filename, char *ext)
+{
+  fprintf(stderr,"Usage: planet [options]\n\n");
+  fprintf(stderr,"options:\n");
+  fprintf(stderr,"  -?                (or any illegal option) Output this text\n");
+  fprintf(stderr,"  -s seed           Specifies seed as number between 0.0 and 1.0\n");
+  fprintf(stderr,"  -w width          Specifies width in pixels, default = 800\n");
+  fprintf(stderr,"  -h height         Specifies height in pixels, default = 600\n");
+  fprintf(stderr,"  -m magnification  Specifies magnification, default = 1.0\n");
+  fprintf(stderr,"  -o output_file    Specifies output file, default is %s%s\n",
+                                            filename, ext);
+  fprintf(stderr,"  -l longitude      Specifies longitude of centre in degrees, default = 0.0\n");
+  fprintf(stderr,"  -L latitude       Specifies latitude of centre in degrees, default = 0.0\n");
+  fprintf(stderr,"  -g gridsize       Specifies vertical gridsize in degrees, default = 0.0 (no grid)\n");
+  fprintf(stderr,"  -G gridsize       Specifies horisontal gridsize in degrees, default = 0.0 (no grid)\n");
+  fprintf(stderr,"  -i init_alt       Specifies initial altitude (default = -0.02)\n");
+  fprintf(stderr,"  -c                Colour depends on latitude (default: only altitude)\n");
+  fprintf(stderr,"  -C file           Read colour definitions from file\n");
+  fprintf(stderr,"  -O                Produce a black and white outline map\n");
+  fprintf(stderr,"  -E                Trace the edges of land in black on colour map\n");
+  fprintf(stderr,"  -B                Use ``bumpmap'' shading\n");
+  fprintf(stderr,"  -b                Use ``bumpmap'' shading on land only\n");
+  fprintf(stderr,"  -d                Use ``daylight'' shading\n");
+  fprintf(stderr,"  -a angle	      Angle of ``light'' in bumpmap shading\n");
+  fprintf(stderr,"                    or longitude of sun in daylight shading\n");
+  fprintf(stderr,"  -A latitude	      Latitude of sun in daylight shading\n");
+  fprintf(stderr,"  -P                Use PPM file format (default is BMP)\n");
+  fprintf(stderr,"  -x                Use XPM file format (default is BMP)\n");
+  fprintf(stderr,"  -N                Use PNG file format (default is BMP)\n");
+  fprintf(stderr,"  -t threads        Number of rendering threads, 0 = one per CPU (default = 1)\n");
+  fprintf(stderr,"  -R                Use the original recursive subdivision (slower, same result)\n");
+  fprintf(stderr,"  --tree-cache-mb N Keep the subdivision tree in up to N megabytes (default 0)\n");
+  fprintf(stderr,"  --tiles dir z0 z1 Write Mercator tiles for zoom levels z0 to z1 to dir/z/x/y\n");
+  fprintf(stderr,"  --adaptive tol    Interpolate blocks of pixels differing by at most tol\n");
+  fprintf(stderr,"  --pixel-depth     Subdivide each pixel as deep as its size needs\n");
+  fprintf(stderr,"  --sphere-grid N   Interpolate from a grid of 6*(N+1)^2 points on the sphere\n");
+  fprintf(stderr,"  --stats           Print the time of each phase and other statistics as JSON\n");
+  fprintf(stderr,"  --band rows       Render and write the map this many rows at a time\n");
+  fprintf(stderr,"  --serve socket    Run as a daemon rendering maps on request, see manual\n");
+  fprintf(stderr,"  --batch file      Make the maps of the option lines in file, see manual\n");
+  fprintf(stderr,"  --frames N        Write N frames of an animation, numbered from 0,\n");
+  fprintf(stderr,"  --dlon degrees    turning the longitude,\n");
+  fprintf(stderr,"  --dlat degrees    and latitude by this,\n");
+  fprintf(stderr,"  --dzoom factor    and magnifying by this, from frame to frame\n");
+  fprintf(stderr,"  --frame-reuse px  Reuse pixels of the frame before within px pixels (-po)\n");
+  fprintf(stderr,"  --heights format  Write the altitudes as pgm (16 bits), raw or npy (floats)\n");
+  fprintf(stderr,"  --search-seeds N  Stop the seed search (-pf) after N seeds,\n");
+  fprintf(stderr,"  --search-time T   or T seconds,\n");
+  fprintf(stderr,"  --search-goal E   or when a match has at most E errors\n");
+  fprintf(stderr,"  -V number         Distance contribution to variation (default = 0.03)\n");
+  fprintf(stderr,"  -v number         Altitude contribution to variation (default = 0.4)\n");
+  fprintf(stderr,"  -pprojection      Specifies projection: m = Mercator (default)\n");
+  fprintf(stderr,"                                          p = Peters\n");
+  fprintf(stderr,"                                          q = Square\n");
+  fprintf(stderr,"                                          s = Stereographic\n");
+  fprintf(stderr,"                                          o = Orthographic\n");
+  fprintf(stderr,"                                          g = Gnomonic\n");
+  fprintf(stderr,"                                          a = Area preserving azimuthal\n");
+  fprintf(stderr,"                                          c = Conical (conformal)\n");
+  fprintf(stderr,"                                          M = Mollweide\n");
+  fprintf(stderr,"                                          S = Sinusoidal\n");
+  fprintf(stderr,"                                          i = Icosaheral\n");
+  fprintf(stderr,"                                          h = Heightfield\n");
+  fprintf(stderr,"                                          f = Find match, see manual\n");
+  exit(0);
+}
+
+/* With the -pf option a map must be given on standard input.  */
+/* This map is 11 lines of 24 characters. The characters are:  */
+/*    . : very strong preference for water (value=8)	       */
+/*    , : strong preference for water (value=4)		       */
+/*    : : preference for water (value=2)		       */
+/*    ; : weak preference for water (value=1)		       */
+/*    - : don't care (value=0)				       */
+/*    * : weak preference for land (value=1)		       */
+/*    o : preference for land (value=2)			       */
+/*    O : strong preference for land (value=4)		       */
+/*    @ : very strong preference for land (value=8)	       */
+/*							       */
+/* Each point on the map corresponds to a point on a 15 grid. */
+/*							       */
+/* The program tries seeds starting from the specified and     */
+/* successively outputs the seed (and rotation) of the best    */
+/* current match, together with a small map of this.	       */
+/* This is all ascii, no bitmap is produced.		       a*/
+
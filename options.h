@@ -0,0 +1,44 @@
+/* options.h */
+/* options of the planet program that are not parameters of the map, */
+/* shared by main.c and serve.c */
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#define MAXOUTS 64      /* -o options on one command line */
+
+typedef struct options
+{
+  char filename[256];   /* -o: output file */
+  int do_file;          /* 1 if -o was given */
+  int nout;             /* number of -o options, and the index in av */
+  int outarg[MAXOUTS];  /* of the file name of each */
+  char colorsname[256]; /* -C: colour file */
+  char *tiledir;        /* --tiles: tile directory and zoom levels */
+  int zmin, zmax;
+  char *serve;          /* --serve: socket of the render daemon */
+  char *batch;          /* --batch: job file */
+  int frames;           /* --frames: frames of an animation, */
+  double dlon, dlat;    /* changing -l and -L by these, */
+  double dzoom;         /* and -m by this factor, from frame to frame */
+} options;
+
+/* main.c */
+char *file_ext(ftype file_type);
+void defaultoptions(options *o);
+int getoptions(planet_ctx *ctx, options *o, int ac, char **av, char *msg);
+void sidecars(planet_ctx *ctx, char *filename);
+int frames(planet_ctx *ctx, options *o);
+int outputs(planet_ctx *ctx, options *o, int ac, char **av);
+
+/* serve.c: run the render daemon on socket o->serve, with the */
+/* parameters in ctx and o as defaults, until SIGINT or SIGTERM. */
+/* Returns 0 then, or -1 on errors */
+int serve(planet_ctx *ctx, options *o);
+
+/* serve.c: make the maps of the jobs in file o->batch with -t worker */
+/* threads, with the parameters in ctx and o as defaults.  Returns 0, */
+/* or -1 if a job failed */
+int batch(planet_ctx *ctx, options *o);
+
+#endif
@@ -26,76 +26,84 @@
 /* to different precision on different machines, the same seed numbers */
 /* can yield very different planets. */
 
-/* The primitive user interface is primarily a result of portability concerns */
-
-#ifdef THINK_C
-#define macintosh 1
-#endif
-
-#ifdef macintosh
-#include <console.h>
-#include <unix.h>
-#endif
+/* This file is the generator itself (libplanet), see planet.h for its */
+/* interface.  The command line program is in main.c */
 
 #include <stdio.h>
-#include <errno.h>
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "planet.h"
+
+/* Directories and links for planet_tiles(), and the clock */
+
+#ifdef _WIN32
+#include <direct.h>
+#include <time.h>
+#define MKDIR(d) _mkdir(d)
+#define LINK(old,new) (-1)
+#else
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#define MKDIR(d) mkdir(d, 0777)
+#define LINK(old,new) link(old, new)
+#endif
 
-int BLACK = 0;
-int WHITE = 1;
-int BACK = 2;
-int GRID = 3;
-int OUTLINE1 = 4;
-int OUTLINE2 = 5;
-int LOWEST = 6;
-int SEA = 7;
-int LAND = 8;
-int HIGHEST = 9;
-
-int debug = 0;
-
-char view;
-
-int nocols = 65536;
+/* Compile with -DNOMMAP to write binary heightfields with fwrite() */
+/* only, on POSIX systems without mmap() */
 
-int rtable[65536], gtable[65536], btable[65536];
+#if !defined(_WIN32) && !defined(NOMMAP)
+#include <sys/mman.h>
+#define MMAP
+#endif
 
-/* Supported output file types:
-    BMP - Windows Bit MaPs
-    PPM - Portable Pix Maps
-    XPM - X-windows Pix Maps
- */
+/* Compile with -DNOTHREADS on systems without POSIX threads. */
+/* The -t option is then accepted but rendering is sequential. */
 
-typedef enum ftype
-    {
-	bmp,
-	ppm,
-	xpm
-    }
-    ftype;
-    
-ftype file_type = bmp;
+#ifndef NOTHREADS
+#include <unistd.h>
+#define LOCK(ctx) pthread_mutex_lock(&(ctx)->lock)
+#define UNLOCK(ctx) pthread_mutex_unlock(&(ctx)->lock)
+#else
+#define LOCK(ctx)
+#define UNLOCK(ctx)
+#endif
 
-char* file_ext(ftype file_type)
-{
-  switch (file_type)
-  {
-    case bmp:
-      return (".bmp");
-    case ppm:
-      return (".ppm");
-    case xpm:
-      return (".xpm");
-    default:
-      return ("");
-  }
-}
+/* Compile with -DNOSTATS to leave out the counters and timers of */
+/* --stats (ctx->stats).  t is a double[2] holding the start times */
+
+#ifndef NOSTATS
+#define STAT(s) s
+#define STARTPHASE(ctx, t)						\
+  { (t)[0] = (t)[1] = 0.0;						\
+    if ((ctx)->stats) { (t)[0] = wallclock(); (t)[1] = cpuclock(); } }
+#define ENDPHASE(ctx, k, t)						\
+  { if ((ctx)->stats) { (ctx)->wallsecs[k] += wallclock()-(t)[0];	\
+			(ctx)->cpusecs[k] += cpuclock()-(t)[1]; } }
+#else
+#define STAT(s)
+#define STARTPHASE(ctx, t) (void)(t)
+#define ENDPHASE(ctx, k, t)
+#endif
+#define COUNTLEVEL(w, l)						\
+  STAT((w)->levels[(l) <= 0 ? 0 : (l) < PLANET_LEVELS-1 ? (l)		\
+		   : PLANET_LEVELS-1]++)
+
+#define BLACK 0
+#define WHITE 1
+#define BACK 2
+#define GRID 3
+#define OUTLINE1 4
+#define OUTLINE2 5
+#define LOWEST 6
 
 /* Character table for XPM output */
 
-char letters[64] = {
+static const char letters[64] = {
 	'@','$','.',',',':',';','-','+','=','#','*','&','A','B','C','D',
 	'E','F','G','H','I','J','K','L','M','N','O','P','Q','R','S','T',
 	'U','V','W','X','Y','Z','a','b','c','d','e','f','g','h','i','j',
@@ -104,786 +112,1816 @@ char letters[64] = {
 #define PI 3.14159265358979
 #define DEG2RAD 0.0174532918661 /* pi/180 */
 
-/* these three values can be changed to change world characteristica */
+/* A vertex of the subdivided tetrahedron */
 
-double M  = -.02;   /* initial altitude (slightly below sea level) */
-double dd1 = 0.45;  /* weight for altitude difference */
-double dd2 = 0.035; /* weight for distance */
-double POW = 0.47;  /* power for distance function */
+typedef struct vertex
+{
+  double h;       /* altitude */
+  double s;       /* seed */
+  double x,y,z;   /* coordinates */
+} vertex;
 
-int Depth; /* depth of subdivisions */
-double r1,r2,r3,r4; /* seeds */
-double longi,lat,scale;
-double vgrid, hgrid;
+/* Levels of subdivision kept in the tetrahedron cache */
 
-int latic = 0; /* flag for latitude based colour */
+#define SSLEVELS 100
 
-int Width = 800, Height = 600; /* default map size */
+/* Adaptive rendering starts with every ADAPTBLOCK'th pixel.  Each */
+/* pixel is UNKNOWN, a SAMPLE to compute in the current pass, or KNOWN */
 
-unsigned short **col;  /* colour array */
-int **heights;         /* heightfield array */
-double **xxx, **yyy, **zzz; /* x,y,z arrays  (used fo gridlines */
-int cl0[60][30]; /* search map */
+#define ADAPTBLOCK 16
+#define UNKNOWN 0
+#define SAMPLE 1
+#define KNOWN 2
 
-int do_outline = 0;  /* if 1, draw coastal outline */
-int do_bw = 0;       /* if 1, reduce map to black outline on white */
-int contourstep = 0; /* if >0, # of colour steps between contour lines */
-int *outx, *outy;
+/* The writers encode about OUTBYTES of rows at a time */
 
-int doshade = 0;
-int shade;
-unsigned short **shades; /* shade array */
-double shade_angle = 150.0; /* angle of "light" on bumpmap */
-double shade_angle2 = 20.0; /* with daylight shading, these two are
-			       longitude/latitude */
+#define OUTBYTES (1<<20)
 
-double cla, sla, clo, slo;
+/* Rows of the map layers start on ROWALIGN byte boundaries */
 
-double rseed, increment = 0.0000001;
+#define ROWALIGN 64
 
-int best = 500000;
-int weight[30];
+/* The binary heightfield formats, which need the altitudes, and the */
+/* altitude of pixels that do not show the planet (NaN) */
 
-int min(x,y)
-int x,y;
-{ return(x<y ? x : y); }
+#define ALTFILE(ctx) \
+  ((ctx)->file_type == pgm || (ctx)->file_type == raw || \
+   (ctx)->file_type == npy)
+#define NOALT ((float)(HUGE_VAL-HUGE_VAL))
 
-int max(x,y)
-int x,y;
-{ return(x<y ? y : x); }
+/* The grid cell of a pixel is the number of the longitude (or */
+/* latitude) band it is in, stored doubled, and for longitudes plus */
+/* one at the poles.  NOCELL (a latitude just outside -90..90) */
+/* differs from every cell, itself included */
 
-double fmin(x,y)
-double x,y;
-{ return(x<y ? x : y); }
+#define MAXCELL (1<<29)
+#define NOCELL (-2*MAXCELL-2)
 
-double fmax(x,y)
-double x,y;
-{ return(x<y ? y : x); }
+/* A node of the subdivision tree (see treeplanet()) */
 
-int main(ac,av)
-int ac;
-char **av;
+typedef struct tnode
 {
-  void printppm(), printppmBW(), printbmp(), printbmpBW(), printxpm(), printxpmBW(),
-       printheights(), print_error();
-  void mercator(), peter(), squarep(), mollweide(), sinusoid(), stereo(),
-    orthographic(), gnomonic(), icosahedral(), azimuth(), conical(),
-    heightfield(), search();
-  int i;
-  double rand2(), log_2(), planet1();
-  void readcolors();
-  void readmap(), makeoutline(), smoothshades();
-  FILE *outfile, *colfile = NULL;
-  char filename[256] = "planet-map";
-  char colorsname[256] = "Olsson.col";
-  int do_file = 0;
-
-
-#ifdef macintosh
-  _ftype = 'TEXT';
-  _fcreator ='ttxt';
-
-  ac = ccommand (&av);
-  debug = 1;
-  do_file = 1;
+  vertex e;                /* new vertex on the longest edge */
+  double s;                /* side of a, for the side test */
+  struct tnode *child[2];  /* child[1] keeps vertex a, child[0] vertex b */
+  unsigned char a,b,c,d;   /* order of the vertices for the cut */
+  unsigned gen;            /* last render that used the node */
+} tnode;
+
+/* Nodes are allocated in slabs and handed to threads in batches */
+
+#define TSLAB 4096
+#define TBATCH 256
+
+typedef struct tslab
+{
+  struct tslab *next;
+  tnode n[TSLAB];
+} tslab;
+
+struct planet_tree
+{
+  vertex t[4];             /* the initial tetrahedron */
+  tnode root;              /* its cut */
+  tnode *free;             /* unused nodes, linked by child[0] */
+  tslab *slabs;
+  int slabused;            /* nodes used in the first slab */
+  long used, max;          /* nodes in the tree or given to threads, budget */
+  unsigned gen;            /* number of the current render */
+  double r1,r2,r3,r4,M,dd1,dd2,POW; /* parameters it was made with */
+};
+
+/* The sphere grid (see spherepoint()).  Each of the 6 faces of a cube */
+/* has (n+1)*(n+1) points, which hold the altitude and, with shading, */
+/* the gradient leafshade() uses */
+
+struct planet_sphere
+{
+  float *p;                /* stride floats per point, face by face */
+  int n, stride, depth;
+  int ready;               /* 0 while the points are being computed */
+  int doshade;             /* 0, 1 (also for 2) or 3 */
+  double r1,r2,r3,r4,M,dd1,dd2,POW; /* parameters it was made with */
+};
+
+/* The samples of the last orthographic map, which the next one reuses */
+/* (see reuseframe()): for each pixel the point on the planet it shows, */
+/* and its colour and shade */
+
+typedef struct fsample
+{
+  float x, y, z;           /* x is NaN if the pixel showed no point */
+  unsigned short col;
+  unsigned char shade;
+} fsample;
+
+struct planet_frame
+{
+  fsample *last, *next;    /* the last map, and the one being rendered */
+  int ready;               /* 1 once last holds a map */
+  double cla, sla, clo, slo, scale; /* the view of the last map */
+  int Width, Height, Depth, doshade, latic, SEA, LAND, HIGHEST, sphere_n;
+  double shade_angle, shade_angle2;
+  double r1,r2,r3,r4,M,dd1,dd2,POW; /* parameters it was made with */
+};
+
+
+/* State of the compressor of one part of a PNG file (see printpng()) */
+
+#define ZMINPART 65536     /* smallest part compressed by a thread */
+#define ZHASH (1<<15)      /* size of the hash table of 3-byte strings */
+#define ZWINDOW 32768      /* farthest match */
+#define ZCHAIN 8           /* earlier strings tried at each position */
+#define ZSYMS 16384        /* literals and matches in a deflate block */
+#define ZBOUND(n) ((n)+(n)/256+64) /* compressed size of n bytes, at most */
+
+struct planet_zstream
+{
+  int head[ZHASH];        /* last position (plus one) with each hash */
+  int prev[ZWINDOW];      /* the one before that of each position */
+  unsigned short lit[ZSYMS]; /* literal, or 256+length of a match */
+  unsigned short dist[ZSYMS]; /* distance of the match, 0 for literals */
+  int nsyms;
+  unsigned char lcode[259]; /* length code of each length */
+  unsigned char dcode[512]; /* distance code of distances 1..256, and */
+			    /* of (d-1)>>7 for longer ones */
+  unsigned char *out;     /* the compressed part */
+  long nout;
+  unsigned long bits;     /* bits not yet stored in out */
+  int nbits;
+  unsigned long adler, crc; /* of the part, and of its IDAT chunk */
+};
+
+/* State of a rendering thread.  The tetrahedron cache and the current */
+/* depth and shade change for every pixel, so each thread has its own. */
+
+struct planet_worker
+{
+  planet_ctx *ctx;
+  int Depth; /* depth of subdivisions */
+  int shade;
+  vertex ss[SSLEVELS][4]; /* ss[l] is the tetrahedron at level l (levels */
+			  /* to go) in the subdivision of the last point */
+  int ssn;                /* ss[1..ssn] are valid */
+  int ssDepth;            /* Depth they were computed with */
+  long sspoints, sshits;  /* statistics, see planet_ctx */
+  double sslevels, ssskipped;
+  tnode *tt[SSLEVELS];    /* the same for the subdivision tree: tt[k] */
+  vertex ttv[SSLEVELS][4]; /* is the node k levels down on the way to */
+  int ttn;                /* the last point, ttv[k] its tetrahedron, */
+			  /* for k = 1..ttn */
+  tnode *pool;            /* nodes for the tree, linked by child[0] */
+  int npool;
+  int nomore;             /* the tree had no more nodes for it */
+  long tfull;             /* points that left the tree when it was full */
+  double grad[3];         /* gradient at the last point (see leafshade()) */
+  long levels[PLANET_LEVELS]; /* statistics, see planet_ctx */
+  long calls, background;
+  int *lonrow, *latrow;   /* if not 0, planet0() only stores the grid */
+			  /* cells of each pixel here (see gridrow()) */
+  int lastrow;            /* row it rendered last, -1 for none */
+  int prime;              /* if 1, planet0() only notes the point (see */
+  double px, py, pz;      /* primerow()) and its Depth, which is -1 */
+  int pDepth;             /* while there is none */
+};
+
+typedef struct planet_worker worker;
+
+static void mercator(worker *w, int j0, int j1);
+static void peter(worker *w, int j0, int j1);
+static void squarep(worker *w, int j0, int j1);
+static void mollweide(worker *w, int j0, int j1);
+static void sinusoid(worker *w, int j0, int j1);
+static void stereo(worker *w, int j0, int j1);
+static void orthographic(worker *w, int j0, int j1);
+static void gnomonic(worker *w, int j0, int j1);
+static void icosahedral(worker *w, int j0, int j1);
+static void azimuth(worker *w, int j0, int j1);
+static void conical(worker *w, int j0, int j1);
+static void heightfield(worker *w, int j0, int j1);
+static int pixeldepth(planet_ctx *ctx, double a);
+static void render_rows(planet_ctx *ctx, void (*proc)(worker *, int, int));
+static void marksamples(planet_ctx *ctx, int step);
+static void fillblocks(planet_ctx *ctx, int step);
+static void makeoutline(planet_ctx *ctx);
+static void drawgrid(planet_ctx *ctx);
+static void smoothshades(planet_ctx *ctx);
+static int searchdepth(planet_ctx *ctx, int j);
+static void searchrow(planet_ctx *ctx, int j, int i0);
+static int searchscore(planet_ctx *ctx, int j, unsigned long long *water,
+		       unsigned long long *land, int *err);
+static int searchmatches(planet_ctx *ctx, int bound, int *err, int *match);
+static void printmatch(planet_ctx *ctx, FILE *outfile, int *match);
+static double wallclock(void);
+static void planet0(worker *w, double x, double y, double z, int i, int j);
+static void background(worker *w, int i, int j);
+static void *row_worker(void *arg);
+static int rowdepth(planet_ctx *ctx);
+static void primerow(worker *w, int j);
+static void run_rows(planet_ctx *ctx, void *(*proc)(void *), int j0);
+static int altcolour(planet_ctx *ctx, double alt, double y);
+static double planet1(worker *w, double x, double y, double z);
+static double planet(worker *w,
+		     double a, double b, double c, double d,
+		     double as, double bs, double cs, double ds,
+		     double ax, double ay, double az,
+		     double bx, double by, double bz,
+		     double cx, double cy, double cz,
+		     double dx, double dy, double dz,
+		     double x, double y, double z, int level);
+static double planeti(worker *w, vertex *t,
+		      double x, double y, double z, int level);
+static int inside(vertex *t, double x, double y, double z);
+static double treeplanet(worker *w, double x, double y, double z);
+static int maketree(planet_ctx *ctx);
+static void freetree(planet_ctx *ctx);
+static void prunetree(planet_ctx *ctx);
+static void returnnodes(planet_ctx *ctx);
+static double spherepoint(worker *w, double x, double y, double z);
+static int makesphere(planet_ctx *ctx);
+static void freesphere(planet_ctx *ctx);
+static int makeframe(planet_ctx *ctx);
+static void freeframe(planet_ctx *ctx);
+static void reuseframe(planet_ctx *ctx);
+static void keepframe(planet_ctx *ctx);
+static void roottetra(planet_ctx *ctx, vertex *t);
+static int leafshade(planet_ctx *ctx, vertex *a, vertex *b, vertex *c,
+		     vertex *d, double x, double y, double z, double *g);
+static void leafgrad(planet_ctx *ctx, vertex *a, vertex *b, vertex *c,
+		     vertex *d, double *g);
+static int gradshade(planet_ctx *ctx, double *g, double h,
+		     double x, double y, double z);
+static void ssclear(worker *w);
+static void setseeds(planet_ctx *ctx);
+static double rand2(double p, double q);
+static double log_2(double x);
+static double wallclock(void);
+#ifndef NOSTATS
+static double cpuclock(void);
 #endif
+static void printppm(planet_ctx *ctx, FILE *outfile, int j0, int j1);
+static void printppmBW(planet_ctx *ctx, FILE *outfile, int j0, int j1);
+static void printbmp(planet_ctx *ctx, FILE *outfile, int j0, int j1);
+static void printbmpBW(planet_ctx *ctx, FILE *outfile, int j0, int j1);
+static void printxpm(planet_ctx *ctx, FILE *outfile, int j0, int j1);
+static void printxpmBW(planet_ctx *ctx, FILE *outfile, int j0, int j1);
+static void printheights(planet_ctx *ctx, FILE *outfile, int j0, int j1);
+static void printpng(planet_ctx *ctx, FILE *outfile, int j0, int j1);
+static void printalts(planet_ctx *ctx, FILE *outfile, int j0, int j1);
+static int pngpalette(planet_ctx *ctx);
+static int rowbytes(planet_ctx *ctx);
+
+/* allocate a Width x Height array as Height row pointers and the */
+/* rows themselves, in one block, so (a)[j][i] is pixel i of row j */
+/* and a row is contiguous.  When the map is streamed, the block only */
+/* holds rows rowmin..rowmax-1, and the other row pointers are 0 */
+
+#define ROWBYTES(type) \
+  ((ctx->Width*sizeof(type)+ROWALIGN-1)/ROWALIGN*ROWALIGN)
+
+#define ROWDATA(a) \
+  ((char*)(((size_t)((a)+ctx->Height)+ROWALIGN-1)/ROWALIGN*ROWALIGN))
+
+#define NEWROWS(a, type, k)						\
+  if (((a) = (type**)getrows(ctx, k, ctx->Height*sizeof(type*)		\
+			     +ROWALIGN-1+ctx->rowmax*ROWBYTES(type))) == 0) \
+    return(-1);								\
+  for (j=0; j<ctx->rowmax; j++)						\
+    (a)[j] = (type*)(ROWDATA(a)+j*ROWBYTES(type));
+
+/* keep layer k of the map as a spare (see getrows()) */
+
+#define KEEPROWS(a, k)							\
+  if ((a) != 0) {							\
+    free(ctx->spare[k]);						\
+    ctx->spare[k] = (a);						\
+    ctx->sparesize[k] = ctx->layersize[k];				\
+    (a) = 0;								\
+  }
 
-  longi = 0.0;
-  lat = 0.0;
-  scale = 1.0;
-  rseed = 0.123;
-  view = 'm';
-  vgrid = hgrid = 0.0;
-  outfile = stdout;
-  
-  for (i = 1; i<ac; i++) {
-    if (av[i][0] == '-') {
-      switch (av[i][1]) {
-	case 'X' : debug = 1;
-		   break;
-	case 'V' : sscanf(av[++i],"%lf",&dd2);
-		   break;
-	case 'v' : sscanf(av[++i],"%lf",&dd1);
-		   break;
-	case 's' : sscanf(av[++i],"%lf",&rseed);
-		   break;
-	case 'w' : sscanf(av[++i],"%d",&Width);
-		   break;
-	case 'h' : sscanf(av[++i],"%d",&Height);
-		   break;
-	case 'm' : sscanf(av[++i],"%lf",&scale);
-		   break;
-	case 'o' : sscanf(av[++i],"%s",filename);
-		   do_file = 1;
-		   break;
-	case 'x' : file_type =xpm;
-		   break;
-	case 'C' : sscanf(av[++i],"%s",colorsname);
-		   break;
-	case 'l' : sscanf(av[++i],"%lf",&longi);
-		   break;
-	case 'L' : sscanf(av[++i],"%lf",&lat);
-		   break;
-	case 'g' : sscanf(av[++i],"%lf",&vgrid);
-		   break;
-	case 'G' : sscanf(av[++i],"%lf",&hgrid);
-		   break;
-	case 'c' : latic = 1;
-		   break;
-	case 'O' : do_outline = 1;
-		   do_bw = 1;
-		   if (strlen(av[i])>2)
-		     sscanf(av[i],"-O%d",&contourstep);
-		   break;
-	case 'E' : do_outline = 1;
-		   if (strlen(av[i])>2)
-		     sscanf(av[i],"-E%d",&contourstep);
-		   break;
-	case 'B' : doshade = 1;
-		   break;
-	case 'b' : doshade = 2;
-		   break;
-	case 'd' : doshade = 3;
-		   break;
-	case 'P' : file_type = ppm;
-		   break;
-	case 'a' : sscanf(av[++i],"%lf",&shade_angle);
-		   break;
-	case 'A' : sscanf(av[++i],"%lf",&shade_angle2);
-		   break;
-	case 'i' : sscanf(av[++i],"%lf",&M);
-		   break;
-	case 'p' : if (strlen(av[i])>2) view = av[i][2];
-	           else view = av[++i][0];
-	           switch (view) {
-		     case 'm' : 
-		     case 'p' : 
-		     case 'q' : 
-		     case 's' :
-		     case 'o' :
-		     case 'g' :
-		     case 'a' :
-		     case 'c' :
-		     case 'M' : 
-		     case 'S' :
-		     case 'h' :
-		     case 'i' :
-		     case 'f' : break;
-		     default: fprintf(stderr,"Unknown projection: %s\n",av[i]);
-			      print_error(do_file ? filename : "standard output", 
-					 !do_file ? "" : file_ext(file_type));
-		   }
-		   break;
-	default: fprintf(stderr,"Unknown option: %s\n",av[i]);
-		 print_error(do_file ? filename : "standard output", 
-			    !do_file ? "" : file_ext(file_type));
-      }
-    }
-    else {
-      fprintf(stderr,"Unknown option: %s\n\n",av[i]);
-      print_error(do_file ? filename : "standard output", 
-		 !do_file ? "" : file_ext(file_type));
-    }
+/* move the rows held from rowmin..rowmax-1 to r0..r0+n-1 and clear them */
+
+#define MOVEROWS(a, type)						\
+  if ((a) != 0) {							\
+    for (j=ctx->rowmin; j<ctx->rowmax; j++) (a)[j] = 0;		\
+    for (j=0; j<n; j++)							\
+      (a)[r0+j] = (type*)(ROWDATA(a)+j*ROWBYTES(type));		\
+    memset(ROWDATA(a), 0, n*ROWBYTES(type));				\
   }
 
-  readcolors(colfile, colorsname);
+planet_ctx *planet_new(void)
+{
+  planet_ctx *ctx;
+
+  ctx = (planet_ctx*)calloc(1,sizeof(planet_ctx));
+  if (ctx == 0) return(0);
+
+  ctx->rseed = 0.123;
+  ctx->view = 'm';
+  ctx->Width = 800; ctx->Height = 600; /* default map size */
+  ctx->scale = 1.0;
+  ctx->longitude = 0.0;
+  ctx->latitude = 0.0;
+  ctx->vgrid = ctx->hgrid = 0.0;
+
+  /* these four values can be changed to change world characteristica */
+
+  ctx->M  = -.02;   /* initial altitude (slightly below sea level) */
+  ctx->dd1 = 0.45;  /* weight for altitude difference */
+  ctx->dd2 = 0.035; /* weight for distance */
+  ctx->POW = 0.47;  /* power for distance function */
+
+  ctx->shade_angle = 150.0;
+  ctx->shade_angle2 = 20.0;
+  ctx->file_type = bmp;
+  ctx->nthreads = 1;
+  ctx->tree_mb = 0.0;
+  ctx->reuse = 0.0;
+  ctx->sphere_n = 0;
+
+  ctx->nocols = 65536;
+  ctx->SEA = 7;
+  ctx->LAND = 8;
+  ctx->HIGHEST = 9;
+
+  ctx->best = 500000;
+  ctx->increment = 0.0000001;
+  ctx->goal = -1;
+
+#ifndef NOTHREADS
+  pthread_mutex_init(&ctx->lock, NULL);
+#endif
+  return(ctx);
+}
 
-  if (do_file &&'\0' != filename[0]) {
-    if (strchr (filename, '.') == 0)
-      strcpy(&(filename[strlen(filename)]), file_ext(file_type));
+/* n cleared bytes for layer k of the map, the spare block kept from */
+/* the last map if it has that size (which saves the page faults of */
+/* fresh memory when many maps are made with one context) */
 
-#ifdef macintosh
-    switch (file_type)
-    {
-      case bmp:
-	_ftype = 'BMPf';
-	break;
-      case ppm:
-	_ftype = 'PPGM';
-	break;
-      case xpm:
-	_ftype = 'TEXT';
-	break;
-    }
-      
-    _fcreator ='GKON';
+static void *getrows(planet_ctx *ctx, int k, size_t n)
+{
+  void *p = ctx->spare[k];
+
+  ctx->spare[k] = 0;
+  if (p != 0 && ctx->sparesize[k] == n)
+    memset(p, 0, n);
+  else {
+    free(p);
+    p = calloc(1, n);
+  }
+  ctx->layersize[k] = n;
+  return(p);
+}
+
+static void freemap(planet_ctx *ctx)
+{
+  int i;
+
+  KEEPROWS(ctx->col, 0);
+  KEEPROWS(ctx->shades, 1);
+  KEEPROWS(ctx->heights, 2);
+  KEEPROWS(ctx->alts, 3);
+  free(ctx->gridcells); ctx->gridcells = 0;
+  free(ctx->outbuf); ctx->outbuf = 0;
+  free(ctx->outlen); ctx->outlen = 0;
+  if (ctx->zs)
+    for (i=0; i<ctx->nworkers; i++) free(ctx->zs[i].out);
+  free(ctx->zs); ctx->zs = 0;
+  free(ctx->pngprev); ctx->pngprev = 0;
+  free(ctx->outx); ctx->outx = 0;
+  free(ctx->outy); ctx->outy = 0;
+  free(ctx->marks); ctx->marks = 0;
+  ctx->rowmin = 0;
+  returnnodes(ctx);
+  free(ctx->workers); ctx->workers = 0;
+  ctx->nworkers = 0;
+#ifndef NOTHREADS
+  free(ctx->threads); ctx->threads = 0;
 #endif
+}
 
-    outfile = fopen(filename,"wb");
+void planet_free(planet_ctx *ctx)
+{
+  int i;
 
-#ifdef macintosh
-    _ftype = 'TEXT';
-    _fcreator ='ttxt';
+  if (ctx == 0) return;
+  freemap(ctx);
+  for (i=0; i<4; i++) free(ctx->spare[i]);
+  freetree(ctx);
+  freesphere(ctx);
+  freeframe(ctx);
+#ifndef NOTHREADS
+  pthread_mutex_destroy(&ctx->lock);
 #endif
+  free(ctx);
+}
 
-    if (outfile == NULL) {
-      fprintf(stderr,
-	      "Could not open output file %s, error code = %d\n",
-	      filename, errno);
-      exit(0);
-    }
+void planet_copy(planet_ctx *dst, planet_ctx *src)
+{
+  struct planet_tree *tree;
+  struct planet_sphere *sphere;
+  struct planet_frame *frame;
+  void *spare[4];
+  size_t sparesize[4];
+#ifndef NOTHREADS
+  pthread_mutex_t lock;
+#endif
+
+  if (dst == src) return;
+  freemap(dst);
+  tree = dst->tree;
+  sphere = dst->sphere;
+  frame = dst->frame;
+  memcpy(spare, dst->spare, sizeof(spare));
+  memcpy(sparesize, dst->sparesize, sizeof(sparesize));
+#ifndef NOTHREADS
+  lock = dst->lock;
+#endif
+  memcpy(dst, src, sizeof(planet_ctx));
+  dst->col = 0;
+  dst->shades = 0;
+  dst->heights = 0;
+  dst->alts = 0;
+  dst->gridcells = 0;
+  dst->outbuf = 0;
+  dst->outlen = 0;
+  dst->zs = 0;
+  dst->pngprev = 0;
+  dst->outx = dst->outy = 0;
+  dst->marks = 0;
+  dst->workers = 0;
+  dst->nworkers = 0;
+  dst->tree = tree;
+  dst->sphere = sphere;
+  dst->frame = frame;
+  memcpy(dst->spare, spare, sizeof(spare));
+  memcpy(dst->sparesize, sparesize, sizeof(sparesize));
+#ifndef NOTHREADS
+  dst->threads = 0;
+  dst->lock = lock;
+#endif
+}
+
+int planet_setup(planet_ctx *ctx)
+{
+  int i, j;
+  double t[2];
+
+  ctx->wallsecs[PHASE_SETUP] = ctx->cpusecs[PHASE_SETUP] = 0.0;
+  STARTPHASE(ctx, t);
+  freemap(ctx);
+
+  /* with band > 0, hold the rows of a band and those around it */
+  /* that the outline, grid and shading need (see planet_stream()) */
+  ctx->rowmin = 0;
+  ctx->rowmax = ctx->Height;
+  if (ctx->band > 0 && ctx->band+3 < ctx->Height) ctx->rowmax = ctx->band+3;
+  ctx->outmin = 0;
+  ctx->outmax = ctx->Height;
+
+#ifndef NOTHREADS
+  if (ctx->nthreads < 1) ctx->nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (ctx->nthreads < 1) ctx->nthreads = 1;
+
+  ctx->longi = ctx->longitude;
+  if (ctx->longi>180) ctx->longi -= 360;
+  ctx->longi = ctx->longi*DEG2RAD;
+  ctx->lat = ctx->latitude*DEG2RAD;
+
+  ctx->sla = sin(ctx->lat); ctx->cla = cos(ctx->lat);
+  ctx->slo = sin(ctx->longi); ctx->clo = cos(ctx->longi);
+
+  if (ctx->view == 'c') {
+    if (ctx->lat == 0) ctx->view = 'm';
+	/* Conical approaches mercator when lat -> 0 */
+    if (abs(ctx->lat) >= PI - 0.000001) ctx->view = 's';
+	/* Conical approaches stereo when lat -> +/- 90 */
   }
+
+  if (ctx->view == 'm' && ctx->fullheight > 0) /* depth of the whole map */
+    ctx->Depth = 3*((int)(log_2(ctx->scale*ctx->fullheight)))+6;
   else
-    outfile = stdout;
-  
-  if (longi>180) longi -= 360;
-  longi = longi*DEG2RAD;
-  lat = lat*DEG2RAD;
-
-  sla = sin(lat); cla = cos(lat);
-  slo = sin(longi); clo = cos(longi);
-
-  if (view == 'f') readmap();
-
-  if (view == 'h') {
-    heights = (int**)calloc(Width,sizeof(int*));
-    if (heights == 0) {
-      fprintf(stderr, "Memory allocation failed.");
-      exit(1);
-    }
-    for (i=0; i<Width; i++) {
-      heights[i] = (int*)calloc(Height,sizeof(int));
-      if (heights[i] == 0) {
-	fprintf(stderr, 
-		"Memory allocation failed at %d out of %d heights\n", 
-		i+1,Width);
-	exit(1);
-      }
-    }
+    ctx->Depth = 3*((int)(log_2(ctx->scale*ctx->Height)))+6;
+
+  setseeds(ctx);
+
+  if (maketree(ctx) != 0) return(-1);
+
+  ctx->workers = (worker*)calloc(ctx->nthreads,sizeof(worker));
+  if (ctx->workers == 0) return(-1);
+  ctx->nworkers = ctx->nthreads;
+  for (i=0; i<ctx->nworkers; i++) {
+    ctx->workers[i].ctx = ctx;
+    ctx->workers[i].Depth = ctx->Depth;
+  }
+#ifndef NOTHREADS
+  if (ctx->nworkers > 1) {
+    ctx->threads = (pthread_t*)calloc(ctx->nworkers-1,sizeof(pthread_t));
+    if (ctx->threads == 0) return(-1);
   }
+#endif
+
+  if (makesphere(ctx) != 0) return(-1);
 
-  col = (unsigned short**)calloc(Width,sizeof(unsigned short*));
-  if (col == 0) {
-    fprintf(stderr, "Memory allocation failed.");
-    exit(1);
+  if (ctx->view == 'h') {
+    NEWROWS(ctx->heights, int, 2);
   }
-  for (i=0; i<Width; i++) {
-    col[i] = (unsigned short*)calloc(Height,sizeof(unsigned short));
-    if (col[i] == 0) {
-      fprintf(stderr, 
-	      "Memory allocation failed at %d out of %d cols\n", 
-	      i+1,Width);
-      exit(1);
-    }
+
+  NEWROWS(ctx->col, unsigned short, 0);
+
+  if (ALTFILE(ctx)) {
+    NEWROWS(ctx->alts, float, 3);
   }
 
-  if (doshade>0) {
-    shades = (unsigned short**)calloc(Width,sizeof(unsigned short*));
-    if (shades == 0) {
-      fprintf(stderr, "Memory allocation failed.");
-      exit(1);
-    }
-    for (i=0; i<Width; i++) {
-      shades[i] = (unsigned short*)calloc(Height,sizeof(unsigned short));
-      if (shades[i] == 0) {
-	fprintf(stderr, 
-		"Memory allocation failed at %d out of %d shades\n", 
-		i,Width);
-	exit(1);
-      }
-    }
+  if (ctx->doshade>0) {
+    NEWROWS(ctx->shades, unsigned char, 1);
   }
 
-  if (vgrid != 0.0) {
-    xxx = (double**)calloc(Width,sizeof(double*));
-    if (xxx == 0) {
-      fprintf(stderr, "Memory allocation failed.");
-      exit(1);
-    }
-    for (i=0; i<Width; i++) {
-      xxx[i] = (double*)calloc(Height,sizeof(double));
-      if (xxx[i] == 0) {
-	fprintf(stderr, 
-		"Memory allocation failed at %d out of %d xs\n", 
-		i+1,Width);
-	exit(1);
-      }
-    }
+  if (ctx->vgrid != 0.0 || ctx->hgrid != 0.0) {
+    ctx->gridcells = (int*)calloc(4*ctx->Width*ctx->nworkers,sizeof(int));
+    if (ctx->gridcells == 0) return(-1);
+  }
 
-    yyy = (double**)calloc(Width,sizeof(double*));
-    if (yyy == 0) {
-      fprintf(stderr, "Memory allocation failed.");
-      exit(1);
-    }
-    for (i=0; i<Width; i++) {
-      yyy[i] = (double*)calloc(Height,sizeof(double));
-      if (yyy[i] == 0) {
-	fprintf(stderr, 
-		"Memory allocation failed at %d out of %d ys\n", 
-		i+1,Width);
-	exit(1);
-      }
-    }
+  /* rows encoded for writing at a time (see writebody()) */
+  ctx->outrows = OUTBYTES/rowbytes(ctx);
+  if (ctx->outrows < 1) ctx->outrows = 1;
+  if (ctx->outrows > ctx->Height) ctx->outrows = ctx->Height;
+  ctx->outstride = rowbytes(ctx);
+  ctx->outbuf = (unsigned char*)malloc((size_t)ctx->outrows*rowbytes(ctx));
+  ctx->outlen = (int*)malloc(ctx->outrows*sizeof(int));
+  if (ctx->outbuf == 0 || ctx->outlen == 0) return(-1);
+
+  /* PNG: a compressor for each thread's part of the rows encoded */
+  /* at a time (see printpng()) */
+  if (ctx->file_type == png && (ctx->do_bw || ctx->view != 'h')) {
+    long n = (long)ctx->outrows*(1+(pngpalette(ctx) ? 1 : 3)*ctx->Width);
+
+    n = (n+ctx->nworkers-1)/ctx->nworkers;
+    if (n < 2*ZMINPART) n = 2*ZMINPART;
+    ctx->zs = (struct planet_zstream*)calloc(ctx->nworkers,
+					     sizeof(struct planet_zstream));
+    if (ctx->zs == 0) return(-1);
+    for (i=0; i<ctx->nworkers; i++)
+      if ((ctx->zs[i].out = (unsigned char*)malloc(ZBOUND(n))) == 0)
+	return(-1);
+    ctx->pngprev = (unsigned char*)malloc(3*ctx->Width);
+    if (ctx->pngprev == 0) return(-1);
   }
 
-  if (hgrid != 0.0) {
-    zzz = (double**)calloc(Width,sizeof(double*));
-    if (zzz == 0) {
-      fprintf(stderr, "Memory allocation failed.");
-      exit(1);
-    }
-    for (i=0; i<Width; i++) {
-      zzz[i] = (double*)calloc(Height,sizeof(double));
-      if (zzz[i] == 0) {
-	fprintf(stderr, 
-		"Memory allocation failed at %d out of %d zs\n", 
-		i+1,Width);
-	exit(1);
-      }
-    }
+  if (ctx->do_outline) {
+    ctx->outx = (int*)calloc(ctx->Width*ctx->rowmax,sizeof(int));
+    ctx->outy = (int*)calloc(ctx->Width*ctx->rowmax,sizeof(int));
+    if (ctx->outx == 0 || ctx->outy == 0) return(-1);
   }
 
-  if (view == 'c') {
-    if (lat == 0) view = 'm';
-	/* Conical approaches mercator when lat -> 0 */
-    if (abs(lat) >= PI - 0.000001) view = 's';
-	/* Conical approaches stereo when lat -> +/- 90 */
+  /* heightfields, Peters maps (water percentage) and streamed maps */
+  /* are always exact */
+  if (ctx->adaptive && ctx->view != 'h' && ctx->view != 'p' &&
+      !ALTFILE(ctx) && ctx->rowmax == ctx->Height) {
+    ctx->marks = (unsigned char*)malloc(ctx->Width*ctx->Height);
+    if (ctx->marks == 0) return(-1);
   }
-  
-  Depth = 3*((int)(log_2(scale*Height)))+6;
+  if (makeframe(ctx) != 0) return(-1);
+
+  ENDPHASE(ctx, PHASE_SETUP, t);
+  return(0);
+}
+
+/* Wall clock time in seconds, for the statistics */
+
+static double wallclock(void)
+{
+#ifdef _WIN32
+  return((double)clock()/CLOCKS_PER_SEC);
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec+1e-6*tv.tv_usec);
+#endif
+}
+
+#ifndef NOSTATS
+/* CPU time of all threads in seconds, for --stats */
+
+static double cpuclock(void)
+{
+  return((double)clock()/CLOCKS_PER_SEC);
+}
+#endif
+
+/* BMP pictures (not heightfields) are written from the bottom row up */
+
+#define BOTTOMUP(ctx) \
+  ((ctx)->file_type == bmp && ((ctx)->do_bw || (ctx)->view != 'h'))
+
+/* Write rows j0..j1-1 of the map.  The writers put the header before */
+/* the first row of the file and the end after the last */
+
+static void writerows(planet_ctx *ctx, FILE *outfile, int j0, int j1)
+{
+  double t0 = wallclock(), t[2];
+
+  STARTPHASE(ctx, t);
+  switch (ctx->file_type)
+  {
+    case ppm:
+      if (ctx->do_bw) printppmBW(ctx, outfile, j0, j1);
+      else if (ctx->view != 'h') printppm(ctx, outfile, j0, j1);
+      else printheights(ctx, outfile, j0, j1);
+      break;
+    case xpm:
+      if (ctx->do_bw) printxpmBW(ctx, outfile, j0, j1);
+      else if (ctx->view != 'h') printxpm(ctx, outfile, j0, j1);
+      else printheights(ctx, outfile, j0, j1);
+      break;
+    case bmp:
+      if (!BOTTOMUP(ctx)) printheights(ctx, outfile, j0, j1);
+      else if (ctx->do_bw) printbmpBW(ctx, outfile, j0, j1);
+      else printbmp(ctx, outfile, j0, j1);
+      break;
+    case png:
+      if (ctx->do_bw || ctx->view != 'h') printpng(ctx, outfile, j0, j1);
+      else printheights(ctx, outfile, j0, j1);
+      break;
+    case pgm:
+    case raw:
+    case npy:
+      printalts(ctx, outfile, j0, j1);
+      break;
+  }
+  ctx->outsecs += wallclock()-t0;
+  ENDPHASE(ctx, PHASE_OUTPUT, t);
+}
 
-  r1 = rseed;
+/* Rendering is split in parts, so planet_stream() can render one band */
+/* after the other */
 
-  r1 = rand2(r1,r1);
-  r2 = rand2(r1,r1);
-  r3 = rand2(r1,r2);
-  r4 = rand2(r2,r3);
+static void startrender(planet_ctx *ctx)
+{
+  int i;
 
-  if (debug && (view != 'f'))
+  if (ctx->debug && (ctx->view != 'f'))
     fprintf(stderr, "+----+----+----+----+----+\n");
 
-  switch (view) {
+  for (i=0; i<ctx->nworkers; i++) {
+    ctx->workers[i].sspoints = ctx->workers[i].sshits = 0;
+    ctx->workers[i].sslevels = ctx->workers[i].ssskipped = 0.0;
+    ctx->workers[i].tfull = 0;
+    memset(ctx->workers[i].levels, 0, sizeof(ctx->workers[i].levels));
+    ctx->workers[i].calls = ctx->workers[i].background = 0;
+  }
+  for (i=PHASE_RENDER; i<PLANET_PHASES; i++)
+    ctx->wallsecs[i] = ctx->cpusecs[i] = 0.0;
+  if (ctx->tree) ctx->tree->gen++;
+  ctx->interpolated = ctx->reused = 0;
+  ctx->water = ctx->land = 0;
+}
+
+/* Render rows rowmin..rowmax-1; returns -1 if the view is not a map */
+
+static int renderrows(planet_ctx *ctx)
+{
+  double t[2];
+
+  STARTPHASE(ctx, t);
+  switch (ctx->view) {
 
     case 'm': /* Mercator projection */
-      mercator();
+      render_rows(ctx, mercator);
       break;
 
     case 'p': /* Peters projection (area preserving cylindrical) */
-      peter();
+      render_rows(ctx, peter);
       break;
 
     case 'q': /* Square projection (equidistant latitudes) */
-      squarep();
+      render_rows(ctx, squarep);
       break;
 
     case 'M': /* Mollweide projection (area preserving) */
-      mollweide();
+      render_rows(ctx, mollweide);
       break;
 
     case 'S': /* Sinusoid projection (area preserving) */
-      sinusoid();
+      render_rows(ctx, sinusoid);
       break;
 
     case 's': /* Stereographic projection */
-      stereo();
+      render_rows(ctx, stereo);
       break;
 
     case 'o': /* Orthographic projection */
-      orthographic();
+      render_rows(ctx, orthographic);
       break;
 
     case 'g': /* Gnomonic projection */
-      gnomonic();
+      render_rows(ctx, gnomonic);
       break;
 
     case 'i': /* Icosahedral projection */
-      icosahedral();
+      render_rows(ctx, icosahedral);
       break;
 
     case 'a': /* Area preserving azimuthal projection */
-      azimuth();
+      render_rows(ctx, azimuth);
       break;
 
     case 'c': /* Conical projection (conformal) */
-      conical();
+      render_rows(ctx, conical);
       break;
 
     case 'h': /* heightfield */
-      heightfield();
+      render_rows(ctx, heightfield);
       break;
 
-    case 'f': /* Search */
-      while (1) {
-	search();
-	rseed += increment;
-	r1 = rseed;
-	r1 = rand2(r1,r1);
-	r2 = rand2(r1,r1);
-	r3 = rand2(r1,r2);
-	r4 = rand2(r2,r3);
-      }
+    default:
+      return(-1);
   }
+  ENDPHASE(ctx, PHASE_RENDER, t);
+  return(0);
+}
 
-  if (do_outline) makeoutline(do_bw);
-
-  if (vgrid != 0.0) { /* draw longitudes */
-    int i,j;
-    for (i=0; i<Width-1; i++)
-      for (j=0; j<Height-1; j++) {
-	double t;
-	int g = 0;
-	if (fabs(yyy[i][j])==1) g=1;
-	else {
-	  t = floor((atan2(xxx[i][j],zzz[i][j])*180/PI+360)/vgrid);
-	  if (t != floor((atan2(xxx[i+1][j],zzz[i+1][j])*180/PI+360)/vgrid))
-	    g=1;
-	  if (t != floor((atan2(xxx[i][j+1],zzz[i][j+1])*180/PI+360)/vgrid))
-	    g=1;
-	}
-	if (g) {
-	  col[i][j] = GRID;
-	  if (doshade>0) shades[i][j] = 255;
-	}
-      }
+static void finishrender(planet_ctx *ctx)
+{
+  int i, k;
+
+  ctx->sspoints = ctx->sshits = ctx->treenodes = ctx->treefull = 0;
+  ctx->sslevels = ctx->ssskipped = ctx->treemb = 0.0;
+  memset(ctx->levels, 0, sizeof(ctx->levels));
+  ctx->calls = ctx->background = 0;
+  for (i=0; i<ctx->nworkers; i++) {
+    for (k=0; k<PLANET_LEVELS; k++) ctx->levels[k] += ctx->workers[i].levels[k];
+    ctx->calls += ctx->workers[i].calls;
+    ctx->background += ctx->workers[i].background;
+    ctx->sspoints += ctx->workers[i].sspoints;
+    ctx->sshits += ctx->workers[i].sshits;
+    ctx->sslevels += ctx->workers[i].sslevels;
+    ctx->ssskipped += ctx->workers[i].ssskipped;
+    ctx->treefull += ctx->workers[i].tfull;
   }
+  if (ctx->tree) {
+    ctx->treenodes = ctx->tree->used;
+    for (i=0; i<ctx->nworkers; i++) ctx->treenodes -= ctx->workers[i].npool;
+    ctx->treemb = ctx->treenodes*(double)sizeof(tnode)/1048576.0;
+    prunetree(ctx);
+  }
+}
 
-  if (hgrid != 0.0) { /* draw latitudes */
-    int i,j;
-    for (i=0; i<Width-1; i++)
-      for (j=0; j<Height-1; j++) {
-	double t;
-	int g = 0;
-	t = floor((asin(yyy[i][j])*180/PI+360)/hgrid);
-	if (t != floor((asin(yyy[i+1][j])*180/PI+360)/hgrid))
-	  g=1;
-	if (t != floor((asin(yyy[i][j+1])*180/PI+360)/hgrid))
-	  g=1;
-	if (g) {
-	  col[i][j] = GRID;
-	  if (doshade>0) shades[i][j] = 255;
-	}
-      }
+/* Outline, grid and shading of the rows held */
+
+static void postprocess(planet_ctx *ctx)
+{
+  double t[2];
+
+  if (ctx->do_outline) {
+    STARTPHASE(ctx, t);
+    makeoutline(ctx);
+    ENDPHASE(ctx, PHASE_OUTLINE, t);
   }
 
-  if (doshade>0) smoothshades();
-  
-  if (debug)
-    fprintf(stderr, "\n");
+  if (ctx->vgrid != 0.0 || ctx->hgrid != 0.0) {
+    STARTPHASE(ctx, t);
+    drawgrid(ctx);
+    ENDPHASE(ctx, PHASE_GRID, t);
+  }
 
-  /* plot picture */
-  switch (file_type)
-  {
-    case ppm:
-      if (do_bw) printppmBW(outfile);
-      else if (view != 'h') printppm(outfile);
-      else printheights(outfile);
-      break;
-    case xpm:
-      if (do_bw) printxpmBW(outfile);
-      else if (view != 'h') printxpm(outfile);
-      else printheights(outfile);
-      break;
-    case bmp:
-      if (do_bw) printbmpBW(outfile);
-      else if (view != 'h') printbmp(outfile);
-      else printheights(outfile);
-      break;
+  if (ctx->doshade>0) {
+    STARTPHASE(ctx, t);
+    smoothshades(ctx);
+    ENDPHASE(ctx, PHASE_SHADES, t);
   }
+}
+
+int planet_render(planet_ctx *ctx, unsigned char *rgb)
+{
+  int i,j,k,c,s;
+
+  if (ctx->rowmax-ctx->rowmin < ctx->Height) return(-1); /* banded */
+  startrender(ctx);
+  if (renderrows(ctx) != 0) return(-1);
+  finishrender(ctx);
+  postprocess(ctx);
+
+  if (rgb != 0 && ctx->view != 'h') /* same colours as printppm */
+    for (j=0; j<ctx->Height; j++)
+      for (i=0; i<ctx->Width; i++) {
+	k = ctx->col[j][i];
+	if (ctx->do_bw) {
+	  c = k < WHITE ? 0 : 255;
+	  *rgb++ = c; *rgb++ = c; *rgb++ = c;
+	} else if (ctx->doshade) {
+	  s = ctx->shades[j][i];
+	  c = s*ctx->rtable[k]/150;
+	  *rgb++ = c > 255 ? 255 : c;
+	  c = s*ctx->gtable[k]/150;
+	  *rgb++ = c > 255 ? 255 : c;
+	  c = s*ctx->btable[k]/150;
+	  *rgb++ = c > 255 ? 255 : c;
+	} else {
+	  *rgb++ = ctx->rtable[k];
+	  *rgb++ = ctx->gtable[k];
+	  *rgb++ = ctx->btable[k];
+	}
+      }
 
   return(0);
 }
 
-void readcolors(FILE *colfile, char* colorsname)
+/* Hold rows r0..r1-1 (at most as many as allocated), cleared like */
+/* a new map */
+
+static void setrows(planet_ctx *ctx, int r0, int r1)
 {
-  int crow, cNum = 0, oldcNum, i;
+  int j, n = r1-r0;
+
+  MOVEROWS(ctx->col, unsigned short);
+  MOVEROWS(ctx->shades, unsigned char);
+  MOVEROWS(ctx->heights, int);
+  MOVEROWS(ctx->alts, float);
+  ctx->rowmin = r0;
+  ctx->rowmax = r1;
+}
 
-  if (NULL == (colfile = fopen(colorsname, "r")))
-    {
-      fprintf(stderr, 
-	      "Cannot open %s\n", 
-	      colorsname);
-      exit(1);
-    }
-    
+/* Bands are rendered with one row above and two below, which the */
+/* outline (one row each way), the grid (one row below) and the */
+/* smoothing of the shades (one row below, after the grid) look at, */
+/* so the rows written are the same as in a map rendered at once. */
+/* BMP files are written bottom-up, so the bands are rendered in that */
+/* order */
 
-  /* Format of colour file is a sequence of lines       */
-  /* each consisting of four integers:                  */
-  /*   colour_number red green blue                     */
-  /* where 0 <= colour_number <= 65535                  */
-  /* and 0<= red, green, blue <= 255                    */
-  /* The colour numbers must be increasing              */
-  /* The first colours have special uses:               */
-  /* 0 is usually black (0,0,0)                         */
-  /* 1 is usually white (255,255,255)                   */
-  /* 2 is the background colour                         */
-  /* 3 is used for latitude/longitude grid lines        */
-  /* 4 and 5 are used for outlines and contour lines    */
-  /* 6 upwards are used for altitudes                   */
-  /* Halfway between 6 and the max colour is sea level  */
-  /* Shallowest sea is (max+6)/2 and land is above this */
-  /* With 65536 colours, (max+6)/2 = 32770              */
-  /* Colours between specified are interpolated         */
+int planet_stream(planet_ctx *ctx, FILE *outfile)
+{
+  int b, n, k, band = ctx->band, H = ctx->Height;
 
-  for (crow = 0; !feof(colfile); crow++)
-    {
-      int	rValue, 
-		gValue, 
-		bValue,
-		result = 0;
+  if (ctx->rowmax-ctx->rowmin == H) {
+    if (planet_render(ctx, NULL) != 0) return(-1);
+    planet_write(ctx, outfile);
+    return(0);
+  }
+  ctx->outbytes = 0;
+  ctx->outsecs = 0.0;
+  startrender(ctx);
+  n = (H+band-1)/band;
+  for (b = 0; b < n; b++) {
+    k = BOTTOMUP(ctx) ? n-1-b : b;
+    ctx->outmin = k*band;
+    ctx->outmax = ctx->outmin+band < H ? ctx->outmin+band : H;
+    setrows(ctx, ctx->outmin > 0 ? ctx->outmin-1 : 0,
+	    ctx->outmax+2 < H ? ctx->outmax+2 : H);
+    if (renderrows(ctx) != 0) return(-1);
+    postprocess(ctx);
+    writerows(ctx, outfile, ctx->outmin, ctx->outmax);
+  }
+  finishrender(ctx);
+  ctx->outmin = 0;
+  ctx->outmax = H;
+  return(0);
+}
 
-      oldcNum = cNum;  /* remember last colour number */
-      result = fscanf(colfile, " %d %d %d %d",
-		      &cNum, &rValue, &gValue, &bValue);
-      
-      if (result > 0)
-	{
-	  if (cNum < oldcNum) cNum = oldcNum;
-	  if (cNum > 65535) cNum = 65535;
-	  rtable[cNum] = rValue;
-	  gtable[cNum] = gValue;
-	  btable[cNum] = bValue;
-	  /* interpolate colours between oldcNum and cNum */
-	  for (i = oldcNum+1; i<cNum; i++) {
-	    rtable[i] = (rtable[oldcNum]*(cNum-i)+rtable[cNum]*(i-oldcNum))
-	                / (cNum-oldcNum+1);
-	    gtable[i] = (gtable[oldcNum]*(cNum-i)+gtable[cNum]*(i-oldcNum))
-	                / (cNum-oldcNum+1);
-	    btable[i] = (btable[oldcNum]*(cNum-i)+btable[cNum]*(i-oldcNum))
-	                / (cNum-oldcNum+1);
-	  }
-	}
-    }
+void planet_write(planet_ctx *ctx, FILE *outfile)
+{
+  ctx->outbytes = 0;
+  ctx->outsecs = 0.0;
+  ctx->wallsecs[PHASE_OUTPUT] = ctx->cpusecs[PHASE_OUTPUT] = 0.0;
+  writerows(ctx, outfile, 0, ctx->Height);
+}
 
-  nocols = cNum+1;
-  if (nocols < 10) nocols = 10;
-  
-  HIGHEST = nocols - 1;
-  SEA = (HIGHEST+LOWEST)/2;
-  LAND = SEA+1;
-  
-  for (i = cNum+1; i<nocols; i++) {
-    /* fill up rest of colour table with last read colour */
-    rtable[i] = rtable[cNum];
-    gtable[i] = gtable[cNum];
-    btable[i] = btable[cNum];
+/* Tiles.  Each tile is rendered by mercator() as the part of one big */
+/* map (TILE<<z pixels square) around it, so neighbouring tiles have */
+/* the same Depth and meet without seams.  TILEHALO extra pixels are */
+/* rendered on each side and cut off before writing, so the outline */
+/* and smoothshades() see the same neighbours as in the big map. */
+
+#define TILE 256
+#define TILEHALO 2
+
+typedef struct tilejob
+{
+  planet_ctx *ctx;           /* the caller's context */
+  const char *dir;
+  int zmin;
+  long next, total;          /* next tile to render, number of tiles */
+  int error;
+} tilejob;
+
+typedef struct tilethread
+{
+  tilejob *job;
+  planet_ctx *ctx;           /* this thread's copy of the context */
+  char *path;
+} tilethread;
+
+static const char *file_ext(ftype file_type)
+{
+  switch (file_type) {
+    case bmp: return(".bmp");
+    case ppm: return(".ppm");
+    case xpm: return(".xpm");
+    case png: return(".png");
+    case pgm: return(".pgm");
+    case raw: return(".raw");
+    case npy: return(".npy");
   }
+  return("");
 }
 
-void makeoutline(int do_bw)
+static int writemap(planet_ctx *ctx, const char *path)
 {
-  int i,j,k,t;
+  FILE *f;
+  int err;
 
-  outx = (int*)calloc(Width*Height,sizeof(int));
-  outy = (int*)calloc(Width*Height,sizeof(int));
-  k=0;
-  for (i=1; i<Width-1; i++)
-    for (j=1; j<Height-1; j++)
-      if ((col[i][j] >= LOWEST && col[i][j] <= SEA) &&
-	  (col[i-1][j] >= LAND || col[i+1][j] >= LAND ||
-	   col[i][j-1] >= LAND || col[i][j+1] >= LAND ||
-	   col[i-1][j-1] >= LAND || col[i-1][j+1] >= LAND ||
-	   col[i+1][j-1] >= LAND || col[i+1][j+1] >= LAND)) {
-	/* if point is sea and any neighbour is not, add to outline */
-	outx[k] = i; outy[k++] = j;
-      }
+  if ((f = fopen(path, "wb")) == 0) return(-1);
+  planet_write(ctx, f);
+  err = ferror(f);
+  return(fclose(f) != 0 || err ? -1 : 0);
+}
 
-  if (contourstep>0) {
-    
-  for (i=1; i<Width-1; i++)
-    for (j=1; j<Height-1; j++) {
-      t = (col[i][j] - LAND) / contourstep;
-      if (t>=0 &&
-          ((col[i-1][j]-LAND) / contourstep > t ||
-	   (col[i+1][j]-LAND) / contourstep > t ||
-	   (col[i][j-1]-LAND) / contourstep > t ||
-	   (col[i][j+1]-LAND) / contourstep > t)) {
-	/* if point is at countour line and any neighbour is higher */
-	outx[k] = i; outy[k++] = j;
+/* Render tile x,y of zoom level z and write it */
+
+static int maketile(tilethread *tt, int z, int x, int y)
+{
+  planet_ctx *ctx = tt->ctx;
+  unsigned short **col, *tcol[TILE];
+  unsigned char **shades, *tshades[TILE];
+  float **alts, *talts[TILE];
+  const char *ext = file_ext(ctx->file_type);
+  int i, j, k, s, uniform, err;
+
+  ctx->Width = ctx->Height = TILE+2*TILEHALO;
+  ctx->fullwidth = ctx->fullheight = TILE<<z;
+  ctx->winx = x*TILE-TILEHALO;
+  ctx->winy = y*TILE-TILEHALO;
+  if (planet_setup(ctx) != 0) return(-1);
+  planet_render(ctx, NULL);
+
+  /* cut off the halo */
+  col = ctx->col; shades = ctx->shades; alts = ctx->alts;
+  for (j=0; j<TILE; j++) {
+    tcol[j] = col[j+TILEHALO]+TILEHALO;
+    if (shades) tshades[j] = shades[j+TILEHALO]+TILEHALO;
+    if (alts) talts[j] = alts[j+TILEHALO]+TILEHALO;
+  }
+  ctx->col = tcol;
+  if (shades) ctx->shades = tshades;
+  if (alts) ctx->alts = talts;
+  ctx->Width = ctx->Height = TILE;
+
+  k = tcol[0][0];
+  s = shades ? tshades[0][0] : 0;
+  uniform = alts == 0; /* the same colour is not the same altitude */
+  for (j=0; j<TILE && uniform; j++)
+    for (i=0; i<TILE; i++)
+      if (tcol[j][i] != k || (shades && tshades[j][i] != s)) {
+	uniform = 0;
+	break;
+      }
+
+  /* remove any old tile, it may be a link to a uniform tile */
+  sprintf(tt->path, "%s/%d/%d/%d%s", tt->job->dir, z, x, y, ext);
+  remove(tt->path);
+  err = 0;
+  if (uniform) {
+    char *upath = tt->path+strlen(tt->path)+1;
+    FILE *f;
+
+    sprintf(upath, "%s/uniform/%d-%d%s", tt->job->dir, k, s, ext);
+    LOCK(tt->job->ctx);
+    if ((f = fopen(upath, "rb")) != 0) fclose(f);
+    else err = writemap(ctx, upath);
+    if (err == 0 && LINK(upath, tt->path) != 0) uniform = 0;
+    UNLOCK(tt->job->ctx);
+  }
+  if (!uniform) err = writemap(ctx, tt->path);
+
+  ctx->col = col; ctx->shades = shades; ctx->alts = alts;
+  ctx->Width = ctx->Height = TILE+2*TILEHALO;
+  return(err);
+}
+
+static void *tile_worker(void *arg)
+{
+  tilethread *tt = (tilethread*)arg;
+  tilejob *job = tt->job;
+  long n;
+  int z;
+
+  for (;;) {
+    LOCK(job->ctx);
+    n = job->next++;
+    if (job->ctx->debug && n < job->total &&
+	n % (job->total/25+1) == 0) {
+      fprintf(stderr, "%c", 'm'); fflush(stderr);
+    }
+    UNLOCK(job->ctx);
+    if (n >= job->total) break;
+    for (z = job->zmin; n >= (1L<<(2*z)); z++) n -= 1L<<(2*z);
+    if (maketile(tt, z, (int)(n>>z), (int)(n&((1L<<z)-1))) != 0) {
+      LOCK(job->ctx);
+      job->error = 1;
+      UNLOCK(job->ctx);
+    }
+  }
+  return(arg);
+}
+
+int planet_tiles(planet_ctx *ctx, const char *dir, int zmin, int zmax)
+{
+  tilejob job;
+  tilethread *tt;
+  char *path;
+  int i, n, z, x;
+
+  if (zmin < 0 || zmax < zmin || zmax > 24) return(-1);
+  n = ctx->nthreads;
+#ifndef NOTHREADS
+  if (n < 1) n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (n < 1) n = 1;
+
+  /* make the directories */
+  if ((path = (char*)malloc(strlen(dir)+40)) == 0) return(-1);
+  MKDIR(dir);
+  sprintf(path, "%s/uniform", dir);
+  MKDIR(path);
+  for (z = zmin; z <= zmax; z++) {
+    sprintf(path, "%s/%d", dir, z);
+    MKDIR(path);
+    for (x = 0; x < 1<<z; x++) {
+      sprintf(path, "%s/%d/%d", dir, z, x);
+      if (MKDIR(path) != 0 && errno != EEXIST) {
+	free(path);
+	return(-1);
+      }
+    }
+  }
+  free(path);
+
+  job.ctx = ctx;
+  job.dir = dir;
+  job.zmin = zmin;
+  job.next = 0;
+  job.total = 0;
+  for (z = zmin; z <= zmax; z++) job.total += 1L<<(2*z);
+  job.error = 0;
+
+  if ((tt = (tilethread*)calloc(n, sizeof(tilethread))) == 0) return(-1);
+  for (i=0; i<n; i++) {
+    tt[i].job = &job;
+    tt[i].ctx = planet_new();
+    tt[i].path = (char*)malloc(2*strlen(dir)+120);
+    if (tt[i].ctx == 0 || tt[i].path == 0) { job.error = 1; n = i+1; break; }
+    planet_copy(tt[i].ctx, ctx);
+    tt[i].ctx->view = 'm';
+    tt[i].ctx->scale = 1.0;
+    tt[i].ctx->latitude = 0.0;
+    tt[i].ctx->nthreads = 1;
+    tt[i].ctx->debug = 0;
+    tt[i].ctx->band = 0;
+    tt[i].ctx->tree_mb = ctx->tree_mb/n;
+    tt[i].ctx->sphere_n = 0; /* each thread would make its own */
+  }
+  if (!job.error) {
+#ifndef NOTHREADS
+    pthread_t *threads;
+    int k = 1;
+
+    if (n > 1 &&
+	(threads = (pthread_t*)calloc(n-1, sizeof(pthread_t))) != 0) {
+      for (k = 1; k < n; k++)
+	if (pthread_create(&threads[k-1], NULL, tile_worker, &tt[k]) != 0)
+	  break;
+      tile_worker(&tt[0]);
+      for (i = 1; i < k; i++) pthread_join(threads[i-1], NULL);
+      free(threads);
+    } else
+#endif
+      tile_worker(&tt[0]);
+  }
+  for (i=0; i<n; i++) {
+    planet_free(tt[i].ctx);
+    free(tt[i].path);
+  }
+  free(tt);
+  return(job.error ? -1 : 0);
+}
+
+double planet_altitude(planet_ctx *ctx, double x, double y, double z)
+{
+  worker *w = &ctx->workers[0];
+
+  w->Depth = ctx->Depth;
+  return(planet1(w, x, y, z));
+}
+
+int planet_colour(planet_ctx *ctx, double x, double y, double z,
+		  unsigned char *rgb)
+{
+  worker *w = &ctx->workers[0];
+  int colour, c;
+
+  w->Depth = ctx->Depth;
+  colour = altcolour(ctx, planet1(w, x, y, z), y);
+  if (rgb != 0) {
+    if (ctx->doshade) {
+      c = w->shade*ctx->rtable[colour]/150;
+      rgb[0] = c > 255 ? 255 : c;
+      c = w->shade*ctx->gtable[colour]/150;
+      rgb[1] = c > 255 ? 255 : c;
+      c = w->shade*ctx->btable[colour]/150;
+      rgb[2] = c > 255 ? 255 : c;
+    } else {
+      rgb[0] = ctx->rtable[colour];
+      rgb[1] = ctx->gtable[colour];
+      rgb[2] = ctx->btable[colour];
+    }
+  }
+  return(colour);
+}
+
+/* Seed search.  Each thread has its own copy of the context and takes */
+/* the next seed, made by adding increment as in a sequential search. */
+/* It finds the rotations of its map that are better than all before */
+/* them and than the seeds reported so far, and reports those better */
+/* than all earlier seeds when the earlier seeds have been reported. */
+/* The first points of a map are far from the last, so the tetrahedron */
+/* cache is emptied between seeds without changing the results. */
+/* The rows are mapped and scored heaviest first.  Errors only add up, */
+/* so when every rotation already has as many as the best match, the */
+/* seed can not give a better one and the rest of it is not mapped. */
+/* Where the depth changes from one row to the next, the first points */
+/* of a row use the cache left by the row before at the old depth, so */
+/* the rows after such a row are only mapped once it has been, and the */
+/* cache is made as the row before leaves it.  Should the old cache */
+/* hold all of such a row, the seed is mapped again in order */
+
+#define MAXMATCH (60*21) /* matches of one seed: rotations * offsets */
+#define MAPBITS 5        /* bits of the preferences (at most 16) */
+
+#ifdef __GNUC__
+#define POPCOUNT(x) __builtin_popcountll(x)
+#else
+static int popcount(unsigned long long x)
+{
+  int n;
+
+  for (n = 0; x != 0; n++) x &= x-1;
+  return(n);
+}
+#define POPCOUNT(x) popcount(x)
+#endif
+
+typedef struct searchjob
+{
+  planet_ctx *ctx;           /* the caller's context */
+  FILE *outfile;
+  long next, done;           /* next seed to take, seeds reported */
+  double t0, tprint;         /* start, and last progress report */
+  int stop;
+  int order[30];             /* rows in the order they are mapped */
+  int natural[30];           /* and in order */
+  int depth[30];             /* subdivision depth of each row */
+  unsigned long long water[30][MAPBITS], land[30][MAPBITS];
+			     /* cells of each row preferring water or */
+			     /* land, by bit of the preference */
+  long rejected, rows;       /* seeds rejected early, rows mapped */
+#ifndef NOTHREADS
+  pthread_cond_t turn;       /* signalled when done changes */
+#endif
+} searchjob;
+
+typedef struct searchthread
+{
+  searchjob *job;
+  planet_ctx *ctx;           /* this thread's copy of the context */
+  int match[3*MAXMATCH];     /* errors, rotation and offset of each */
+  int err[MAXMATCH];         /* errors of each rotation and offset */
+} searchthread;
+
+/* Map and score the rows of the seed of st in the given order until */
+/* no rotation can beat bound; returns the rows mapped, or 0 if check */
+/* finds the cache was not left as assumed */
+
+static int searchseed(searchthread *st, int *order, int bound, int check)
+{
+  searchjob *job = st->job;
+  planet_ctx *ctx = st->ctx;
+  worker *w = &ctx->workers[0];
+  int r, j, prev = -1, lowest, *depth = job->depth;
+
+  memset(st->err, 0, sizeof(st->err));
+  w->ssn = 0;
+  for (r = 0; r < ctx->Height; r++) {
+    j = order[r];
+    if (j != prev+1) { /* make the cache as row j-1 leaves it */
+      w->ssn = 0;
+      if (j > 0 && depth[j] != depth[j-1]) searchrow(ctx, j-1, ctx->Width-1);
+    }
+    searchrow(ctx, j, 0);
+    if (check && j > 0 && depth[j] != depth[j-1] && w->ssDepth != w->Depth)
+      return(0);
+    prev = j;
+    lowest = searchscore(ctx, j, job->water[j], job->land[j], st->err);
+    if (lowest >= bound) return(r+1);
+  }
+  return(r);
+}
+
+static void *search_worker(void *arg)
+{
+  searchthread *st = (searchthread*)arg;
+  searchjob *job = st->job;
+  planet_ctx *c0 = job->ctx, *ctx = st->ctx;
+#ifndef NOTHREADS
+  long n;
+#endif
+  int k, m, r, bound;
+  double t;
+
+  for (;;) {
+    LOCK(c0);
+    if (job->stop || (c0->maxseeds > 0 && job->next >= c0->maxseeds)) {
+      UNLOCK(c0);
+      break;
+    }
+#ifndef NOTHREADS
+    n = job->next;
+#endif
+    job->next++;
+    ctx->rseed = c0->rseed;
+    c0->rseed += c0->increment;
+    bound = c0->best;
+    UNLOCK(c0);
+
+    setseeds(ctx);
+    r = searchseed(st, job->order, bound, !ctx->recursive);
+    if (r == 0) r = searchseed(st, job->natural, bound, 0);
+    m = r < ctx->Height ? 0 : searchmatches(ctx, bound, st->err, st->match);
+
+    LOCK(c0);
+#ifndef NOTHREADS
+    while (job->done != n) pthread_cond_wait(&job->turn, &c0->lock);
+#endif
+    if (r < ctx->Height) job->rejected++;
+    job->rows += r;
+    for (k = 0; k < m && !job->stop; k++)
+      if (st->match[3*k] < c0->best) {
+	c0->best = st->match[3*k];
+	printmatch(ctx, job->outfile, &st->match[3*k]);
+      }
+    job->done++;
+    t = wallclock();
+    if ((c0->maxsecs > 0.0 && t-job->t0 >= c0->maxsecs) ||
+	(c0->goal >= 0 && c0->best <= c0->goal))
+      job->stop = 1;
+    if (c0->debug && t-job->tprint >= 10.0) {
+      fprintf(stderr, "search: %ld seeds, %.1f seeds/s\n",
+	      job->done, job->done/(t-job->t0));
+      job->tprint = t;
+    }
+#ifndef NOTHREADS
+    pthread_cond_broadcast(&job->turn);
+#endif
+    UNLOCK(c0);
+  }
+  return(arg);
+}
+
+void planet_search(planet_ctx *ctx, FILE *outfile)
+{
+  searchjob job;
+  searchthread *st;
+  int i, j, k, r, b, v, n = ctx->nworkers, error = 0;
+  int sorted[30], placed[30], trans[30];
+  long mass[30];
+
+  job.ctx = ctx;
+  job.outfile = outfile;
+  job.next = job.done = 0;
+  job.t0 = job.tprint = wallclock();
+  job.stop = 0;
+  job.rejected = job.rows = 0;
+  for (j = 0; j < ctx->Height; j++) { /* heaviest rows first */
+    job.natural[j] = j;
+    job.depth[j] = searchdepth(ctx, j);
+    placed[j] = 0;
+    mass[j] = 0;
+    for (b = 0; b < MAPBITS; b++) job.water[j][b] = job.land[j][b] = 0;
+    for (i = 0; i < ctx->Width; i++) {
+      v = ctx->cl0[i][j];
+      mass[j] += ctx->weight[j]*abs(v);
+      for (b = 0; b < MAPBITS; b++)
+	if ((abs(v)>>b)&1) {
+	  if (v < 0) job.water[j][b] |= 1ULL<<i;
+	  else job.land[j][b] |= 1ULL<<i;
+	}
+    }
+    for (r = j; r > 0 && mass[sorted[r-1]] < mass[j]; r--)
+      sorted[r] = sorted[r-1];
+    sorted[r] = j;
+  }
+  for (r = n = 0; r < ctx->Height; r++) {
+    /* before a row, the rows where the depth changes above it */
+    for (j = sorted[r], k = 0; j >= 0 && !placed[j]; j--)
+      if (k == 0 || (j > 0 && job.depth[j] != job.depth[j-1])) {
+	trans[k++] = j;
+	placed[j] = 1;
+      }
+    while (k > 0) job.order[n++] = trans[--k];
+  }
+  if (ctx->recursive) /* which has no ssDepth to check */
+    memcpy(job.order, job.natural, sizeof(job.order));
+  n = ctx->nworkers;
+#ifndef NOTHREADS
+  pthread_cond_init(&job.turn, NULL);
+#endif
+
+  if ((st = (searchthread*)calloc(n, sizeof(searchthread))) == 0) return;
+  for (i=0; i<n; i++) {
+    st[i].job = &job;
+    st[i].ctx = planet_new();
+    if (st[i].ctx == 0) { error = 1; n = i; break; }
+    planet_copy(st[i].ctx, ctx);
+    st[i].ctx->nthreads = 1;
+    st[i].ctx->tree_mb = 0.0; /* a tree only holds one seed */
+    if (planet_setup(st[i].ctx) != 0) { error = 1; n = i+1; break; }
+  }
+  if (!error) {
+#ifndef NOTHREADS
+    int k;
+
+    for (k = 1; k < n; k++)
+      if (pthread_create(&ctx->threads[k-1], NULL, search_worker, &st[k])
+	  != 0)
+	break;
+    search_worker(&st[0]);
+    for (i = 1; i < k; i++) pthread_join(ctx->threads[i-1], NULL);
+#else
+    search_worker(&st[0]);
+#endif
+  }
+  ctx->seeds = job.done;
+  ctx->seedsecs = wallclock()-job.t0;
+  ctx->rejected = job.rejected;
+  ctx->searchrows = job.rows;
+  for (i=0; i<n; i++) planet_free(st[i].ctx);
+  free(st);
+#ifndef NOTHREADS
+  pthread_cond_destroy(&job.turn);
+#endif
+}
+
+static void setseeds(planet_ctx *ctx)
+{
+  ctx->r1 = ctx->rseed;
+
+  ctx->r1 = rand2(ctx->r1,ctx->r1);
+  ctx->r2 = rand2(ctx->r1,ctx->r1);
+  ctx->r3 = rand2(ctx->r1,ctx->r2);
+  ctx->r4 = rand2(ctx->r2,ctx->r3);
+}
+
+int planet_readcolors(planet_ctx *ctx, const char *colorsname)
+{
+  FILE *colfile;
+  int crow, cNum = 0, oldcNum, i;
+  double t[2];
+
+  ctx->wallsecs[PHASE_COLOURS] = ctx->cpusecs[PHASE_COLOURS] = 0.0;
+  STARTPHASE(ctx, t);
+  if (NULL == (colfile = fopen(colorsname, "r")))
+    return(-1);
+
+  /* Format of colour file is a sequence of lines       */
+  /* each consisting of four integers:                  */
+  /*   colour_number red green blue                     */
+  /* where 0 <= colour_number <= 65535                  */
+  /* and 0<= red, green, blue <= 255                    */
+  /* The colour numbers must be increasing              */
+  /* The first colours have special uses:               */
+  /* 0 is usually black (0,0,0)                         */
+  /* 1 is usually white (255,255,255)                   */
+  /* 2 is the background colour                         */
+  /* 3 is used for latitude/longitude grid lines        */
+  /* 4 and 5 are used for outlines and contour lines    */
+  /* 6 upwards are used for altitudes                   */
+  /* Halfway between 6 and the max colour is sea level  */
+  /* Shallowest sea is (max+6)/2 and land is above this */
+  /* With 65536 colours, (max+6)/2 = 32770              */
+  /* Colours between specified are interpolated         */
+
+  for (crow = 0; !feof(colfile); crow++)
+    {
+      int	rValue, 
+		gValue, 
+		bValue,
+		result = 0;
+
+      oldcNum = cNum;  /* remember last colour number */
+      result = fscanf(colfile, " %d %d %d %d",
+		      &cNum, &rValue, &gValue, &bValue);
+      
+      if (result > 0)
+	{
+	  if (cNum < oldcNum) cNum = oldcNum;
+	  if (cNum > 65535) cNum = 65535;
+	  ctx->rtable[cNum] = rValue;
+	  ctx->gtable[cNum] = gValue;
+	  ctx->btable[cNum] = bValue;
+	  /* interpolate colours between oldcNum and cNum */
+	  for (i = oldcNum+1; i<cNum; i++) {
+	    ctx->rtable[i] = (ctx->rtable[oldcNum]*(cNum-i)+ctx->rtable[cNum]*(i-oldcNum))
+	                / (cNum-oldcNum+1);
+	    ctx->gtable[i] = (ctx->gtable[oldcNum]*(cNum-i)+ctx->gtable[cNum]*(i-oldcNum))
+	                / (cNum-oldcNum+1);
+	    ctx->btable[i] = (ctx->btable[oldcNum]*(cNum-i)+ctx->btable[cNum]*(i-oldcNum))
+	                / (cNum-oldcNum+1);
+	  }
+	}
+    }
+
+  ctx->nocols = cNum+1;
+  if (ctx->nocols < 10) ctx->nocols = 10;
+  
+  ctx->HIGHEST = ctx->nocols - 1;
+  ctx->SEA = (ctx->HIGHEST+LOWEST)/2;
+  ctx->LAND = ctx->SEA+1;
+  
+  for (i = cNum+1; i<ctx->nocols; i++) {
+    /* fill up rest of colour table with last read colour */
+    ctx->rtable[i] = ctx->rtable[cNum];
+    ctx->gtable[i] = ctx->gtable[cNum];
+    ctx->btable[i] = ctx->btable[cNum];
+  }
+  fclose(colfile);
+  ENDPHASE(ctx, PHASE_COLOURS, t);
+  return(0);
+}
+
+static void makeoutline(planet_ctx *ctx)
+{
+  int i,j,k,t;
+
+  k=0;
+  for (j=ctx->rowmin+1; j<ctx->rowmax-1; j++)
+    for (i=1; i<ctx->Width-1; i++)
+      if ((ctx->col[j][i] >= LOWEST && ctx->col[j][i] <= ctx->SEA) &&
+	  (ctx->col[j][i-1] >= ctx->LAND || ctx->col[j][i+1] >= ctx->LAND ||
+	   ctx->col[j-1][i] >= ctx->LAND || ctx->col[j+1][i] >= ctx->LAND ||
+	   ctx->col[j-1][i-1] >= ctx->LAND || ctx->col[j+1][i-1] >= ctx->LAND ||
+	   ctx->col[j-1][i+1] >= ctx->LAND || ctx->col[j+1][i+1] >= ctx->LAND)) {
+	/* if point is sea and any neighbour is not, add to outline */
+	ctx->outx[k] = i; ctx->outy[k++] = j;
+      }
+
+  if (ctx->contourstep>0) {
+    
+  for (j=ctx->rowmin+1; j<ctx->rowmax-1; j++)
+    for (i=1; i<ctx->Width-1; i++) {
+      t = (ctx->col[j][i] - ctx->LAND) / ctx->contourstep;
+      if (t>=0 &&
+          ((ctx->col[j][i-1]-ctx->LAND) / ctx->contourstep > t ||
+	   (ctx->col[j][i+1]-ctx->LAND) / ctx->contourstep > t ||
+	   (ctx->col[j-1][i]-ctx->LAND) / ctx->contourstep > t ||
+	   (ctx->col[j+1][i]-ctx->LAND) / ctx->contourstep > t)) {
+	/* if point is at countour line and any neighbour is higher */
+	ctx->outx[k] = i; ctx->outy[k++] = j;
       }
     }
   }
-  if (do_bw) /* if outline only, clear colours */
-    for (i=0; i<Width; i++)
-      for (j=0; j<Height; j++) {
-	if (col[i][j] >= LOWEST)
-	  col[i][j] = WHITE;
-	else col[i][j] = BLACK;
+  if (ctx->do_bw) /* if outline only, clear colours */
+    for (j=ctx->rowmin; j<ctx->rowmax; j++)
+      for (i=0; i<ctx->Width; i++) {
+	if (ctx->col[j][i] >= LOWEST)
+	  ctx->col[j][i] = WHITE;
+	else ctx->col[j][i] = BLACK;
       }
   /* draw outline (in black if outline only) */
   while (k-->0) {
-    if (do_bw) t = BLACK;
-    else if (contourstep == 0 || col[outx[k]][outy[k]]<LAND ||
-             ((col[outx[k]][outy[k]]-LAND)/contourstep)%2 == 1)
+    if (ctx->do_bw) t = BLACK;
+    else if (ctx->contourstep == 0 || ctx->col[ctx->outy[k]][ctx->outx[k]]<ctx->LAND ||
+             ((ctx->col[ctx->outy[k]][ctx->outx[k]]-ctx->LAND)/ctx->contourstep)%2 == 1)
       t = OUTLINE1;
     else t = OUTLINE2;
-    col[outx[k]][outy[k]] = t;
+    ctx->col[ctx->outy[k]][ctx->outx[k]] = t;
+  }
+}
+
+static int gridcell(double t)
+{
+  if (t != t) return(NOCELL);
+  if (t > MAXCELL) t = MAXCELL;
+  if (t < -MAXCELL) t = -MAXCELL;
+  return(2*(int)t);
+}
+
+/* Store the grid cells of pixel i, which shows point (x,y,z) */
+
+static void setgrid(worker *w, double x, double y, double z, int i)
+{
+  planet_ctx *ctx = w->ctx;
+
+  if (ctx->vgrid != 0.0)
+    w->lonrow[i] =
+      gridcell(floor((atan2(x,z)*180/PI+360)/ctx->vgrid)) + (fabs(y)==1);
+  if (ctx->hgrid != 0.0)
+    w->latrow[i] = gridcell(floor((asin(y)*180/PI+360)/ctx->hgrid));
+}
+
+/* Find the grid cells of row j by projecting it again, without */
+/* computing the planet.  Pixels not on the planet have the cells of */
+/* point (0,0,0) */
+
+static void gridrow(worker *w, int j, int *lon, int *lat)
+{
+  planet_ctx *ctx = w->ctx;
+  int i, lon0, lat0;
+
+  lon0 = gridcell(floor((atan2(0.0,0.0)*180/PI+360)/ctx->vgrid));
+  lat0 = gridcell(floor((asin(0.0)*180/PI+360)/ctx->hgrid));
+  for (i=0; i<ctx->Width; i++) {
+    lon[i] = lon0;
+    lat[i] = lat0;
+  }
+  w->lonrow = lon; w->latrow = lat;
+  ctx->row_proc(w, j, j+1);
+  w->lonrow = w->latrow = 0;
+}
+
+/* A pixel is on a grid line if its grid cell differs from that of */
+/* the pixel to the right or below, or (for longitudes) it is a pole */
+
+#define NEWCELL(a,b) (((a)|1) != ((b)|1) || (a) == NOCELL || (b) == NOCELL)
+
+static void gridrows(worker *w, int j0, int j1)
+{
+  planet_ctx *ctx = w->ctx;
+  int i,j,t,g,W = ctx->Width;
+  int *lon0, *lat0, *lon1, *lat1, *p;
+
+  lon0 = ctx->gridcells+4*W*(w-ctx->workers);
+  lat0 = lon0+W; lon1 = lat0+W; lat1 = lon1+W;
+  gridrow(w, j0, lon0, lat0);
+  for (j=j0; j<j1; j++) {
+    gridrow(w, j+1, lon1, lat1);
+    for (i=0; i<W-1; i++) {
+      g = 0;
+      if (ctx->vgrid != 0.0) { /* longitudes */
+	t = lon0[i];
+	if ((t&1) || NEWCELL(t, lon0[i+1]) || NEWCELL(t, lon1[i])) g = 1;
+      }
+      if (ctx->hgrid != 0.0) { /* latitudes */
+	t = lat0[i];
+	if (NEWCELL(t, lat0[i+1]) || NEWCELL(t, lat1[i])) g = 1;
+      }
+      if (g) {
+	ctx->col[j][i] = GRID;
+	if (ctx->doshade>0) ctx->shades[j][i] = 255;
+      }
+    }
+    p = lon0; lon0 = lon1; lon1 = p;
+    p = lat0; lat0 = lat1; lat1 = p;
+  }
+}
+
+/* Threads take GRIDBAND rows at a time, as the cells of the row */
+/* below each band are computed twice */
+
+#define GRIDBAND 16
+
+static void *grid_worker(void *arg)
+{
+  worker *w = (worker*)arg;
+  planet_ctx *ctx = w->ctx;
+  int j;
+
+  for (;;) {
+    LOCK(ctx);
+    j = ctx->next_row;
+    ctx->next_row += GRIDBAND;
+    UNLOCK(ctx);
+    if (j >= ctx->rowmax-1) break;
+    gridrows(w, j, j+GRIDBAND < ctx->rowmax-1 ? j+GRIDBAND : ctx->rowmax-1);
   }
+  return(arg);
+}
+
+/* The grid is found from the projection of each row, so it takes no */
+/* memory per pixel.  Heightfields have no grid */
+
+static void drawgrid(planet_ctx *ctx)
+{
+  int debug = ctx->debug;
+
+  if (ctx->view == 'h') return;
+  ctx->debug = 0; /* the rows are projected again */
+  run_rows(ctx, grid_worker, ctx->rowmin);
+  ctx->debug = debug;
+}
+
+/* Pixel (i,j) does not show the planet */
+
+static void background(worker *w, int i, int j)
+{
+  planet_ctx *ctx = w->ctx;
+
+  if (w->lonrow != 0 || w->prime) return; /* see planet0() */
+  STAT(w->background++);
+  ctx->col[j][i] = BACK;
+  if (ctx->doshade>0) ctx->shades[j][i] = 255;
+  if (ctx->alts) ctx->alts[j][i] = NOALT;
 }
 
-void readmap()
+void planet_readmap(planet_ctx *ctx, FILE *infile)
 {
   int i,j;
   double y;
   char c;
 
-  Width = 47; Height = 21;
-  for (j = 0; j < Height; j++) {
-    y = 0.5*7.5*(2.0*j-Height+1);
+  ctx->Width = 47; ctx->Height = 21;
+  for (j = 0; j < ctx->Height; j++) {
+    y = 0.5*7.5*(2.0*j-ctx->Height+1);
     y = cos(DEG2RAD*y);
-    weight[j] = (int)(100.0*y+0.5);
+    ctx->weight[j] = (int)(100.0*y+0.5);
   }
-  for (j = 0; j < Height; j+=2) {
-    for(i = 0; i < Width ; i+=2) {
-      c = getchar();
+  for (j = 0; j < ctx->Height; j+=2) {
+    for(i = 0; i < ctx->Width ; i+=2) {
+      c = getc(infile);
       switch (c) {
-      case '.': cl0[i][j] = -8;
+      case '.': ctx->cl0[i][j] = -8;
 		break;
-      case ',': cl0[i][j] = -4;
+      case ',': ctx->cl0[i][j] = -4;
 		break;
-      case ':': cl0[i][j] = -2;
+      case ':': ctx->cl0[i][j] = -2;
 		break;
-      case ';': cl0[i][j] = -1;
+      case ';': ctx->cl0[i][j] = -1;
 		break;
-      case '-': cl0[i][j] = 0;
+      case '-': ctx->cl0[i][j] = 0;
 		break;
-      case '*': cl0[i][j] = 1;
+      case '*': ctx->cl0[i][j] = 1;
 		break;
-      case 'o': cl0[i][j] = 2;
+      case 'o': ctx->cl0[i][j] = 2;
 		break;
-      case 'O': cl0[i][j] = 4;
+      case 'O': ctx->cl0[i][j] = 4;
 		break;
-      case '@': cl0[i][j] = 16;
+      case '@': ctx->cl0[i][j] = 16;
 		break;
       default: printf("Wrong map symbol: %c\n",c);
       }
-      if (i>0) cl0[i-1][j] = (cl0[i][j]+cl0[i-2][j])/2;
+      if (i>0) ctx->cl0[i-1][j] = (ctx->cl0[i][j]+ctx->cl0[i-2][j])/2;
     }
-    c = getchar(); if (c!='\n') printf("Wrong map format: %c\n",c);
+    c = getc(infile); if (c!='\n') printf("Wrong map format: %c\n",c);
   }
-  for (j = 1; j < Height; j+=2)
-    for(i = 0; i < Width ; i++)
-      cl0[i][j] = (cl0[i][j-1]+cl0[i][j+1])/2;
+  for (j = 1; j < ctx->Height; j+=2)
+    for(i = 0; i < ctx->Width ; i++)
+      ctx->cl0[i][j] = (ctx->cl0[i][j-1]+ctx->cl0[i][j+1])/2;
 }
 
 
-void smoothshades()
+static void smoothshades(planet_ctx *ctx)
 {
-  int i,j;
+  int i,j,j1;
 
-  for (i=0; i<Width-2; i++)
-    for (j=0; j<Height-2; j++)
-      shades[i][j] = (4*shades[i][j]+2*shades[i][j+1]
-		      +2*shades[i+1][j]+shades[i+1][j+1]+4)/9;
+  j1 = ctx->rowmax < ctx->Height ? ctx->rowmax-1 : ctx->Height-2;
+  for (j=ctx->rowmin; j<j1; j++)
+    for (i=0; i<ctx->Width-2; i++)
+      ctx->shades[j][i] = (4*ctx->shades[j][i]+2*ctx->shades[j+1][i]
+		      +2*ctx->shades[j][i+1]+ctx->shades[j+1][i+1]+4)/9;
 }
 
-void mercator()
-{
-  double y,scale1,cos2,theta1, log_2();
-  int i,j,k, planet0();
+/* With fullwidth > 0, the map is the Width x Height part at winx,winy */
+/* of a fullwidth x fullheight map (see planet_tiles()) */
 
-  y = sin(lat);
+static void mercator(worker *w, int j0, int j1)
+{
+  planet_ctx *ctx = w->ctx;
+  double y,scale1,cos2,theta1;
+  int i,j,k,W,H,x0,y0;
+
+  W = ctx->Width; H = ctx->Height; x0 = y0 = 0;
+  if (ctx->fullwidth > 0) {
+    W = ctx->fullwidth; H = ctx->fullheight;
+    x0 = ctx->winx; y0 = ctx->winy;
+  }
+  y = sin(ctx->lat);
   y = (1.0+y)/(1.0-y);
   y = 0.5*log(y);
-  k = (int)(0.5*y*Width*scale/PI);
-  for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-    y = PI*(2.0*(j-k)-Height)/Width/scale;
+  k = (int)(0.5*y*W*ctx->scale/PI);
+  for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+    y = PI*(2.0*(j+y0-k)-H)/W/ctx->scale;
     y = exp(2.*y);
     y = (y-1.)/(y+1.);
-    scale1 = scale*Width/Height/sqrt(1.0-y*y)/PI;
+    scale1 = ctx->scale*W/H/sqrt(1.0-y*y)/PI;
     cos2 = sqrt(1.0-y*y);
-    Depth = 3*((int)(log_2(scale1*Height)))+3;
-    for (i = 0; i < Width ; i++) {
-      theta1 = longi-0.5*PI+PI*(2.0*i-Width)/Width/scale;
-      planet0(cos(theta1)*cos2,y,-sin(theta1)*cos2, i,j);
+    w->Depth = 3*((int)(log_2(scale1*H)))+3;
+    for (i = 0; i < ctx->Width ; i++) {
+      theta1 = ctx->longi-0.5*PI+PI*(2.0*(i+x0)-W)/W/ctx->scale;
+      planet0(w, cos(theta1)*cos2,y,-sin(theta1)*cos2, i,j);
     }
   }
 }
 
-void peter()
+static void peter(worker *w, int j0, int j1)
 {
-  double y,cos2,theta1,scale1, log_2();
-  int k,i,j,water,land, planet0();
-
-  y = 2.0*sin(lat);
-  k = (int)(0.5*y*Width*scale/PI);
-  water = land = 0;
-  for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-    y = 0.5*PI*(2.0*(j-k)-Height)/Width/scale;
+  planet_ctx *ctx = w->ctx;
+  double y,cos2,theta1,scale1;
+  int k,i,j;
+  long nwater,nland;
+
+  y = 2.0*sin(ctx->lat);
+  k = (int)(0.5*y*ctx->Width*ctx->scale/PI);
+  nwater = nland = 0;
+  for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+    y = 0.5*PI*(2.0*(j-k)-ctx->Height)/ctx->Width/ctx->scale;
     if (fabs(y)>1.0)
-      for (i = 0; i < Width ; i++) {
-	col[i][j] = BACK;
-	if (doshade>0) shades[i][j] = 255;
+      for (i = 0; i < ctx->Width ; i++) {
+	background(w, i,j);
       }
     else {
       cos2 = sqrt(1.0-y*y);
       if (cos2>0.0) {
-	scale1 = scale*Width/Height/cos2/PI;
-	Depth = 3*((int)(log_2(scale1*Height)))+3;
-	for (i = 0; i < Width ; i++) {
-	  theta1 = longi-0.5*PI+PI*(2.0*i-Width)/Width/scale;
-	  planet0(cos(theta1)*cos2,y,-sin(theta1)*cos2, i,j);
-	  if (col[i][j] < LAND) water++; else land++;
+	scale1 = ctx->scale*ctx->Width/ctx->Height/cos2/PI;
+	w->Depth = 3*((int)(log_2(scale1*ctx->Height)))+3;
+	for (i = 0; i < ctx->Width ; i++) {
+	  theta1 = ctx->longi-0.5*PI+PI*(2.0*i-ctx->Width)/ctx->Width/ctx->scale;
+	  planet0(w, cos(theta1)*cos2,y,-sin(theta1)*cos2, i,j);
+	}
+	if (j >= ctx->outmin && j < ctx->outmax && w->lonrow == 0 &&
+	    !w->prime) {
+	  /* not the rows around, nor the grid or primerow() */
+	  for (i = 0; i < ctx->Width ; i++)
+	    if (ctx->col[j][i] < ctx->LAND) nwater++; else nland++;
 	}
       }
     }
   }
-  if (debug)
-    fprintf(stderr,"\n");
-  fprintf(stderr,"water percentage: %d\n",100*water/(water+land));
+  LOCK(ctx);
+  ctx->water += nwater; ctx->land += nland;
+  UNLOCK(ctx);
 }
 
-void squarep()
+static void squarep(worker *w, int j0, int j1)
 {
-  double y,scale1,theta1,cos2, log_2();
-  int k,i,j, planet0();
-
-  k = (int)(0.5*lat*Width*scale/PI);
-  for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-    y = (2.0*(j-k)-Height)/Width/scale*PI;
-    if (fabs(y)>=0.5*PI) for (i = 0; i < Width ; i++) {
-      col[i][j] = BACK;
-      if (doshade>0) shades[i][j] = 255;
+  planet_ctx *ctx = w->ctx;
+  double y,scale1,theta1,cos2;
+  int k,i,j;
+
+  k = (int)(0.5*ctx->lat*ctx->Width*ctx->scale/PI);
+  for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+    y = (2.0*(j-k)-ctx->Height)/ctx->Width/ctx->scale*PI;
+    if (fabs(y)>=0.5*PI) for (i = 0; i < ctx->Width ; i++) {
+      background(w, i,j);
     } else {
       cos2 = cos(y);
       if (cos2>0.0) {
-	scale1 = scale*Width/Height/cos2/PI;
-	Depth = 3*((int)(log_2(scale1*Height)))+3;
-	for (i = 0; i < Width ; i++) {
-	  theta1 = longi-0.5*PI+PI*(2.0*i-Width)/Width/scale;
-	  planet0(cos(theta1)*cos2,sin(y),-sin(theta1)*cos2, i,j);
+	scale1 = ctx->scale*ctx->Width/ctx->Height/cos2/PI;
+	w->Depth = 3*((int)(log_2(scale1*ctx->Height)))+3;
+	for (i = 0; i < ctx->Width ; i++) {
+	  theta1 = ctx->longi-0.5*PI+PI*(2.0*i-ctx->Width)/ctx->Width/ctx->scale;
+	  planet0(w, cos(theta1)*cos2,sin(y),-sin(theta1)*cos2, i,j);
 	}
       }
     }
   }
 }
 
-void mollweide()
+static void mollweide(worker *w, int j0, int j1)
 {
-  double y,y1,zz,scale1,cos2,theta1,theta2, log_2();
-  int i,j,i1=1,k, planet0();
-
-  for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-    y1 = 2*(2.0*j-Height)/Width/scale;
-    if (fabs(y1)>=1.0) for (i = 0; i < Width ; i++) {
-      col[i][j] = BACK;
-      if (doshade>0) shades[i][j] = 255;
+  planet_ctx *ctx = w->ctx;
+  double y,y1,zz,scale1,cos2,theta1,theta2;
+  int i,j,i1=1,k;
+
+  for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+    y1 = 2*(2.0*j-ctx->Height)/ctx->Width/ctx->scale;
+    if (fabs(y1)>=1.0) for (i = 0; i < ctx->Width ; i++) {
+      background(w, i,j);
     } else {
       zz = sqrt(1.0-y1*y1);
       y = 2.0/PI*(y1*zz+asin(y1));
       cos2 = sqrt(1.0-y*y);
       if (cos2>0.0) {
-	scale1 = scale*Width/Height/cos2/PI;
-	Depth = 3*((int)(log_2(scale1*Height)))+3;
-	for (i = 0; i < Width ; i++) {
-	  theta1 = PI/zz*(2.0*i-Width)/Width/scale;
+	scale1 = ctx->scale*ctx->Width/ctx->Height/cos2/PI;
+	w->Depth = 3*((int)(log_2(scale1*ctx->Height)))+3;
+	for (i = 0; i < ctx->Width ; i++) {
+	  theta1 = PI/zz*(2.0*i-ctx->Width)/ctx->Width/ctx->scale;
 	  if (fabs(theta1)>PI) {
-	    col[i][j] = BACK;
-	    if (doshade>0) shades[i][j] = 255;
+	    background(w, i,j);
 	  } else {
 	    double x2,y2,z2, x3,y3,z3;
 	    theta1 += -0.5*PI;
 	    x2 = cos(theta1)*cos2;
 	    y2 = y;
 	    z2 = -sin(theta1)*cos2;
-	    x3 = clo*x2+slo*sla*y2+slo*cla*z2;
-	    y3 = cla*y2-sla*z2;
-	    z3 = -slo*x2+clo*sla*y2+clo*cla*z2;
+	    x3 = ctx->clo*x2+ctx->slo*ctx->sla*y2+ctx->slo*ctx->cla*z2;
+	    y3 = ctx->cla*y2-ctx->sla*z2;
+	    z3 = -ctx->slo*x2+ctx->clo*ctx->sla*y2+ctx->clo*ctx->cla*z2;
 
-	    planet0(x3,y3,z3, i,j);
+	    planet0(w, x3,y3,z3, i,j);
 	  }
 	}
       }
@@ -891,34 +1929,33 @@ void mollweide()
   }
 }
 
-void sinusoid()
+static void sinusoid(worker *w, int j0, int j1)
 {
-  double y,theta1,theta2,cos2,l1,i1,scale1, log_2();
-  int k,i,j,l,c, planet0();
-
-  k = (int)(lat*Width*scale/PI);
-  for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-    y = (2.0*(j-k)-Height)/Width/scale*PI;
-    if (fabs(y)>=0.5*PI) for (i = 0; i < Width ; i++) {
-      col[i][j] = BACK;
-      if (doshade>0) shades[i][j] = 255;
+  planet_ctx *ctx = w->ctx;
+  double y,theta1,theta2,cos2,l1,i1,scale1;
+  int k,i,j,l,c;
+
+  k = (int)(ctx->lat*ctx->Width*ctx->scale/PI);
+  for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+    y = (2.0*(j-k)-ctx->Height)/ctx->Width/ctx->scale*PI;
+    if (fabs(y)>=0.5*PI) for (i = 0; i < ctx->Width ; i++) {
+      background(w, i,j);
     } else {
       cos2 = cos(y);
       if (cos2>0.0) {
-	scale1 = scale*Width/Height/cos2/PI;
-	Depth = 3*((int)(log_2(scale1*Height)))+3;
-	for (i = 0; i<Width; i++) {
-	  l = i*12/Width;
-	  l1 = l*Width/12.0;
+	scale1 = ctx->scale*ctx->Width/ctx->Height/cos2/PI;
+	w->Depth = 3*((int)(log_2(scale1*ctx->Height)))+3;
+	for (i = 0; i<ctx->Width; i++) {
+	  l = i*12/ctx->Width;
+	  l1 = l*ctx->Width/12.0;
 	  i1 = i-l1;
-	  theta2 = longi-0.5*PI+PI*(2.0*l1-Width)/Width/scale;
-	  theta1 = (PI*(2.0*i1-Width/12)/Width/scale)/cos2;
+	  theta2 = ctx->longi-0.5*PI+PI*(2.0*l1-ctx->Width)/ctx->Width/ctx->scale;
+	  theta1 = (PI*(2.0*i1-ctx->Width/12)/ctx->Width/ctx->scale)/cos2;
 	  if (fabs(theta1)>PI/12.0) {
-	    col[i][j] = BACK;
-	    if (doshade>0) shades[i][j] = 255;
+	    background(w, i,j);
 	  } else {
-	    planet0(cos(theta1+theta2)*cos2,sin(y),-sin(theta1+theta2)*cos2,
+	    planet0(w, cos(theta1+theta2)*cos2,sin(y),-sin(theta1+theta2)*cos2,
 		    i,j);
 	  }
 	}
@@ -927,68 +1964,74 @@ void sinusoid()
   }
 }
 
-void stereo()
+static void stereo(worker *w, int j0, int j1)
 {
+  planet_ctx *ctx = w->ctx;
   double x,y,ymin,ymax,z,zz,x1,y1,z1,theta1,theta2;
-  int i,j, planet0();
+  int i,j;
 
   ymin = 2.0;
   ymax = -2.0;
-  for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-    for (i = 0; i < Width ; i++) {
-      x = (2.0*i-Width)/Height/scale;
-      y = (2.0*j-Height)/Height/scale;
+  for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+    for (i = 0; i < ctx->Width ; i++) {
+      x = (2.0*i-ctx->Width)/ctx->Height/ctx->scale;
+      y = (2.0*j-ctx->Height)/ctx->Height/ctx->scale;
       z = x*x+y*y;
       zz = 0.25*(4.0+z);
+      if (ctx->pixeldepth) w->Depth = pixeldepth(ctx, 1.0/(zz*zz));
       x = x/zz;
       y = y/zz;
       z = (1.0-0.25*z)/zz;
-      x1 = clo*x+slo*sla*y+slo*cla*z;
-      y1 = cla*y-sla*z;
-      z1 = -slo*x+clo*sla*y+clo*cla*z;
+      x1 = ctx->clo*x+ctx->slo*ctx->sla*y+ctx->slo*ctx->cla*z;
+      y1 = ctx->cla*y-ctx->sla*z;
+      z1 = -ctx->slo*x+ctx->clo*ctx->sla*y+ctx->clo*ctx->cla*z;
       if (y1 < ymin) ymin = y1;
       if (y1 > ymax) ymax = y1;
 
       /* for level-of-detail effect:  Depth = 3*((int)(log_2(scale*Height)/(1.0+x1*x1+y1*y1)))+6; */
 
-      planet0(x1,y1,z1, i,j);
+      planet0(w, x1,y1,z1, i,j);
     }
   }
 }
 
-void orthographic()
+static void orthographic(worker *w, int j0, int j1)
 {
-  double x,y,z,x1,y1,z1,ymin,ymax,theta1,theta2,zz;
-  int i,j, planet0();
+  planet_ctx *ctx = w->ctx;
+  double x,y,z,x1,y1,z1,ymin,ymax,theta1,theta2,zz,zmin;
+  int i,j;
 
+  zmin = sqrt(1.0/ctx->Height/ctx->scale);
   ymin = 2.0;
   ymax = -2.0;
-  for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-    for (i = 0; i < Width ; i++) {
-      x = (2.0*i-Width)/Height/scale;
-      y = (2.0*j-Height)/Height/scale;
+  for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+    for (i = 0; i < ctx->Width ; i++) {
+      x = (2.0*i-ctx->Width)/ctx->Height/ctx->scale;
+      y = (2.0*j-ctx->Height)/ctx->Height/ctx->scale;
       if (x*x+y*y>1.0) {
-	col[i][j] = BACK;
-	if (doshade>0) shades[i][j] = 255;
+	background(w, i,j);
       } else {
 	z = sqrt(1.0-x*x-y*y);
-	x1 = clo*x+slo*sla*y+slo*cla*z;
-	y1 = cla*y-sla*z;
-	z1 = -slo*x+clo*sla*y+clo*cla*z;
+	if (ctx->pixeldepth) /* a pixel at the limb reaches zmin inwards */
+	  w->Depth = pixeldepth(ctx, 1.0/(z > zmin ? z : zmin));
+	x1 = ctx->clo*x+ctx->slo*ctx->sla*y+ctx->slo*ctx->cla*z;
+	y1 = ctx->cla*y-ctx->sla*z;
+	z1 = -ctx->slo*x+ctx->clo*ctx->sla*y+ctx->clo*ctx->cla*z;
 	if (y1 < ymin) ymin = y1;
 	if (y1 > ymax) ymax = y1;
-	planet0(x1,y1,z1, i,j);
+	planet0(w, x1,y1,z1, i,j);
       }
     }
   }
 }
 
-void icosahedral() /* modified version of gnomonic */
+static void icosahedral(worker *w, int j0, int j1) /* modified version of gnomonic */
 {
+  planet_ctx *ctx = w->ctx;
   double x,y,z,x1,y1,z1,zz,theta1,theta2,ymin,ymax;
-  int i,j, planet0();
+  int i,j;
   double lat1, longi1, sla, cla, slo, clo, x0, y0, sq3_4, sq3;
   double L1, L2, S;
 
@@ -998,12 +2041,12 @@ void icosahedral() /* modified version of gnomonic */
   L1 = 10.812317;
   L2 = -52.622632;
   S = 55.6;
-  for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-    for (i = 0; i < Width ; i++) {
+  for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+    for (i = 0; i < ctx->Width ; i++) {
 
-      x0 = 198.0*(2.0*i-Width)/Width/scale-36;
-      y0 = 198.0*(2.0*j-Height)/Width/scale - lat/DEG2RAD;
+      x0 = 198.0*(2.0*i-ctx->Width)/ctx->Width/ctx->scale-36;
+      y0 = 198.0*(2.0*j-ctx->Height)/ctx->Width/ctx->scale - ctx->lat/DEG2RAD;
 
       longi1 = 0.0;
       lat1 = 500.0;
@@ -1099,13 +2142,12 @@ void icosahedral() /* modified version of gnomonic */
       }
 
       if (lat1 > 400.0) {
-	col[i][j] = BACK;
-	if (doshade>0) shades[i][j] = 255;
+	background(w, i,j);
       } else {
 	x = (x0 - longi1)/S;
 	y = (y0 + lat1)/S;
 
-	longi1 = longi1*DEG2RAD - longi;
+	longi1 = longi1*DEG2RAD - ctx->longi;
 	lat1 = lat1*DEG2RAD;
 
 	sla = sin(lat1); cla = cos(lat1);
@@ -1122,104 +2164,107 @@ void icosahedral() /* modified version of gnomonic */
 
 	if (y1 < ymin) ymin = y1;
 	if (y1 > ymax) ymax = y1;
-	planet0(x1,y1,z1, i,j);
+	planet0(w, x1,y1,z1, i,j);
       }
     }
   }
 }
 
-void gnomonic()
+static void gnomonic(worker *w, int j0, int j1)
 {
+  planet_ctx *ctx = w->ctx;
   double x,y,z,x1,y1,z1,zz,theta1,theta2,ymin,ymax;
-  int i,j, planet0();
+  int i,j;
 
   ymin = 2.0;
   ymax = -2.0;
-  for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-    for (i = 0; i < Width ; i++) {
-      x = (2.0*i-Width)/Height/scale;
-      y = (2.0*j-Height)/Height/scale;
+  for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+    for (i = 0; i < ctx->Width ; i++) {
+      x = (2.0*i-ctx->Width)/ctx->Height/ctx->scale;
+      y = (2.0*j-ctx->Height)/ctx->Height/ctx->scale;
       zz = sqrt(1.0/(1.0+x*x+y*y));
+      if (ctx->pixeldepth) w->Depth = pixeldepth(ctx, zz*zz*zz);
       x = x*zz;
       y = y*zz;
       z = sqrt(1.0-x*x-y*y);
-      x1 = clo*x+slo*sla*y+slo*cla*z;
-      y1 = cla*y-sla*z;
-      z1 = -slo*x+clo*sla*y+clo*cla*z;
+      x1 = ctx->clo*x+ctx->slo*ctx->sla*y+ctx->slo*ctx->cla*z;
+      y1 = ctx->cla*y-ctx->sla*z;
+      z1 = -ctx->slo*x+ctx->clo*ctx->sla*y+ctx->clo*ctx->cla*z;
       if (y1 < ymin) ymin = y1;
       if (y1 > ymax) ymax = y1;
-      planet0(x1,y1,z1, i,j);
+      planet0(w, x1,y1,z1, i,j);
     }
   }
 }
 
-void azimuth()
+static void azimuth(worker *w, int j0, int j1)
 {
+  planet_ctx *ctx = w->ctx;
   double x,y,z,x1,y1,z1,zz,theta1,theta2,ymin,ymax;
-  int i,j, planet0();
+  int i,j;
 
   ymin = 2.0;
   ymax = -2.0;
-  for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-    for (i = 0; i < Width ; i++) {
-      x = (2.0*i-Width)/Height/scale;
-      y = (2.0*j-Height)/Height/scale;
+  for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+    for (i = 0; i < ctx->Width ; i++) {
+      x = (2.0*i-ctx->Width)/ctx->Height/ctx->scale;
+      y = (2.0*j-ctx->Height)/ctx->Height/ctx->scale;
       zz = x*x+y*y;
       z = 1.0-0.5*zz;
       if (z<-1.0) {
-	col[i][j] = BACK;
-	if (doshade>0) shades[i][j] = 255;
+	background(w, i,j);
       } else {
 	zz = sqrt(1.0-0.25*zz);
 	x = x*zz;
 	y = y*zz;
-	x1 = clo*x+slo*sla*y+slo*cla*z;
-	y1 = cla*y-sla*z;
-	z1 = -slo*x+clo*sla*y+clo*cla*z;
+	x1 = ctx->clo*x+ctx->slo*ctx->sla*y+ctx->slo*ctx->cla*z;
+	y1 = ctx->cla*y-ctx->sla*z;
+	z1 = -ctx->slo*x+ctx->clo*ctx->sla*y+ctx->clo*ctx->cla*z;
 	if (y1 < ymin) ymin = y1;
 	if (y1 > ymax) ymax = y1;
-	planet0(x1,y1,z1, i,j);
+	planet0(w, x1,y1,z1, i,j);
       }
     }
   }
 }
 
-void conical()
+static void conical(worker *w, int j0, int j1)
 {
+  planet_ctx *ctx = w->ctx;
   double k1,c,y2,x,y,zz,x1,y1,z1,theta1,theta2,ymin,ymax,cos2;
-  int i,j, planet0();
+  int i,j;
 
   ymin = 2.0;
   ymax = -2.0;
-  if (lat>0) {
-    k1 = 1.0/sin(lat);
+  if (ctx->lat>0) {
+    k1 = 1.0/sin(ctx->lat);
     c = k1*k1;
-    y2 = sqrt(c*(1.0-sin(lat/k1))/(1.0+sin(lat/k1)));
-    for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-      for (i = 0; i < Width ; i++) {
-	x = (2.0*i-Width)/Height/scale;
-	y = (2.0*j-Height)/Height/scale+y2;
+    y2 = sqrt(c*(1.0-sin(ctx->lat/k1))/(1.0+sin(ctx->lat/k1)));
+    for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+      for (i = 0; i < ctx->Width ; i++) {
+	x = (2.0*i-ctx->Width)/ctx->Height/ctx->scale;
+	y = (2.0*j-ctx->Height)/ctx->Height/ctx->scale+y2;
 	zz = x*x+y*y;
 	if (zz==0.0) theta1 = 0.0; else theta1 = k1*atan2(x,y);
 	if (theta1<-PI || theta1>PI) {
-	  col[i][j] = BACK;
-	  if (doshade>0) shades[i][j] = 255;
+	  background(w, i,j);
 	} else {
-	  theta1 += longi-0.5*PI; /* theta1 is longitude */
+	  theta1 += ctx->longi-0.5*PI; /* theta1 is longitude */
 	  theta2 = k1*asin((zz-c)/(zz+c));
 	  /* theta2 is latitude */
 	  if (theta2 > 0.5*PI || theta2 < -0.5*PI) {
-	    col[i][j] = BACK;
-	    if (doshade>0) shades[i][j] = 255;
+	    background(w, i,j);
 	  } else {
 	    cos2 = cos(theta2);
+	    if (ctx->pixeldepth && zz > 0.0)
+	      w->Depth = pixeldepth(ctx, 2.0*c/(zz+c)*fabs(k1)*cos2/sqrt(zz));
 	    y = sin(theta2);
 	    if (y < ymin) ymin = y;
 	    if (y > ymax) ymax = y;
-	    planet0(cos(theta1)*cos2,y,-sin(theta1)*cos2, i, j);
+	    planet0(w, cos(theta1)*cos2,y,-sin(theta1)*cos2, i, j);
 	  }
 	}
       }
@@ -1227,32 +2272,32 @@ void conical()
 
   }
   else {
-    k1 = 1.0/sin(lat);
+    k1 = 1.0/sin(ctx->lat);
     c = k1*k1;
-    y2 = sqrt(c*(1.0-sin(lat/k1))/(1.0+sin(lat/k1)));
-    for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-      for (i = 0; i < Width ; i++) {
-	x = (2.0*i-Width)/Height/scale;
-	y = (2.0*j-Height)/Height/scale-y2;
+    y2 = sqrt(c*(1.0-sin(ctx->lat/k1))/(1.0+sin(ctx->lat/k1)));
+    for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+      for (i = 0; i < ctx->Width ; i++) {
+	x = (2.0*i-ctx->Width)/ctx->Height/ctx->scale;
+	y = (2.0*j-ctx->Height)/ctx->Height/ctx->scale-y2;
 	zz = x*x+y*y;
 	if (zz==0.0) theta1 = 0.0; else theta1 = -k1*atan2(x,-y);
 	if (theta1<-PI || theta1>PI) {
-	  col[i][j] = BACK;
-	  if (doshade>0) shades[i][j] = 255;
+	  background(w, i,j);
 	} else {
-	  theta1 += longi-0.5*PI; /* theta1 is longitude */
+	  theta1 += ctx->longi-0.5*PI; /* theta1 is longitude */
 	  theta2 = k1*asin((zz-c)/(zz+c));
 	  /* theta2 is latitude */
 	  if (theta2 > 0.5*PI || theta2 < -0.5*PI) {
-	    col[i][j] = BACK;
-	    if (doshade>0) shades[i][j] = 255;
+	    background(w, i,j);
 	  } else {
 	    cos2 = cos(theta2);
+	    if (ctx->pixeldepth && zz > 0.0)
+	      w->Depth = pixeldepth(ctx, 2.0*c/(zz+c)*fabs(k1)*cos2/sqrt(zz));
 	    y = sin(theta2);
 	    if (y < ymin) ymin = y;
 	    if (y > ymax) ymax = y;
-	    planet0(cos(theta1)*cos2,y,-sin(theta1)*cos2, i, j);
+	    planet0(w, cos(theta1)*cos2,y,-sin(theta1)*cos2, i, j);
 	  }
 	}
       }
@@ -1260,154 +2305,458 @@ void conical()
   }
 }
 
+/* With pixeldepth, the depth of a pixel where the projection maps a */
+/* units of area on the planet to one unit of area on the map (which */
+/* is 2 units high at scale 1).  This is ctx->Depth for a = 1, and one */
+/* level of cuts (3) less for each doubling of the pixel size on the */
+/* planet.  Equal-area projections (azimuthal, Mollweide, ...) have */
+/* a = 1 everywhere, so they keep ctx->Depth. */
+
+static int pixeldepth(planet_ctx *ctx, double a)
+{
+  double n = ctx->scale*ctx->Height/sqrt(a);
+
+  if (!(n >= 1.0)) n = 1.0;
+  if (n > 1e9) n = 1e9;
+  return(3*((int)(log_2(n)))+6);
+}
 
-void heightfield()
+static void heightfield(worker *w, int j0, int j1)
 {
-  double x,y,z,x1,y1,z1, planet1();
+  planet_ctx *ctx = w->ctx;
+  double x,y,z,x1,y1,z1,alt;
   int i,j;
 
-  for (j = 0; j < Height; j++) {
-    if (debug && ((j % (Height/25)) == 0)) {fprintf (stderr, "%c", view); fflush(stderr);}
-    for (i = 0; i < Width ; i++) {
-      x = (2.0*i-Width)/Height/scale;
-      y = (2.0*j-Height)/Height/scale;
-      if (x*x+y*y>1.0) heights[i][j] = 0;
-      else {
+  for (j = j0; j < j1; j++) {
+    if (ctx->debug && ((j % (ctx->Height/25)) == 0)) {fprintf (stderr, "%c", ctx->view); fflush(stderr);}
+    for (i = 0; i < ctx->Width ; i++) {
+      x = (2.0*i-ctx->Width)/ctx->Height/ctx->scale;
+      y = (2.0*j-ctx->Height)/ctx->Height/ctx->scale;
+      if (x*x+y*y>1.0) {
+	ctx->heights[j][i] = 0;
+	if (ctx->alts) ctx->alts[j][i] = NOALT;
+      } else {
 	z = sqrt(1.0-x*x-y*y);
-	x1 = clo*x+slo*sla*y+slo*cla*z;
-	y1 = cla*y-sla*z;
-	z1 = -slo*x+clo*sla*y+clo*cla*z;
-	heights[i][j] = 10000000*planet1(x1,y1,z1);
+	x1 = ctx->clo*x+ctx->slo*ctx->sla*y+ctx->slo*ctx->cla*z;
+	y1 = ctx->cla*y-ctx->sla*z;
+	z1 = -ctx->slo*x+ctx->clo*ctx->sla*y+ctx->clo*ctx->cla*z;
+	alt = planet1(w, x1,y1,z1);
+	ctx->heights[j][i] = 10000000*alt;
+	if (ctx->alts) ctx->alts[j][i] = alt;
       }
     }
   }
 }
 
 
-void search()
+/* The projections are rendered a row at a time by render_rows().  With */
+/* -t, rows are handed out to several threads on demand.  As in the */
+/* original program, a row goes on from the tetrahedron cache the row */
+/* above left: a thread that rendered that row keeps its cache, another */
+/* one makes it again with primerow(), so the picture is the same */
+/* regardless of the number of threads. */
+/* With ctx->reuse, an orthographic map only computes the pixels it can */
+/* not take from the last one (see reuseframe()). */
+/* Adaptive rendering makes several passes, which compute the samples */
+/* on grids of every 16th, 8th, 4th, 2nd and finally every pixel.  After */
+/* each pass, the blocks between samples whose corners are (almost) */
+/* the same colour and shade are filled in by interpolation. */
+
+static void *row_worker(void *arg)
 {
-  double y,cos2,theta1,scale1, planet1(), log_2();
-  double y2,cos22,theta12;
-  int i,j,k,l,c,c1,c2,c3, errcount, errcount1;
-
-  for (j = 0; j < Height; j++) {
-    y = 0.5*7.5*(2.0*j-Height+1);
-    y = sin(DEG2RAD*y);
-    scale1 = Width/Height/sqrt(1.0-y*y)/PI;
-    cos2 = sqrt(1.0-y*y);
-    y2 = 0.5*7.5*(2.0*j-Height+1.5);
-    y2 = sin(DEG2RAD*y2);
-    cos22 = sqrt(1.0-y2*y2);
-    Depth = 3*((int)(log_2(scale1*Height)))+6;
-    for (i = 0; i < Width ; i++) {
-      theta1 = -0.5*PI+PI*(2.0*i-Width)/Width;
-      theta12 = -0.5*PI+PI*(2.0*i+0.5-Width)/Width;
-      c = 128+1000*planet1(cos(theta1)*cos2,y,-sin(theta1)*cos2);
-      c1 = 128+1000*planet1(cos(theta12)*cos2,y,-sin(theta12)*cos2);
-      c2 = 128+1000*planet1(cos(theta1)*cos22,y2,-sin(theta1)*cos22);
-      c3 = 128+1000*planet1(cos(theta12)*cos22,y2,-sin(theta12)*cos22);
-      c = (c+c1+c2+c3)/4.0;
-      if (c<0) c = 0;
-      if (c>255) c = 255;
-      col[i][j] = c;
-    }
-  }
-  for (k=0; k<Width; k++) {
-    for (l=-20; l<=20; l+=2) {
-      errcount = 0;
-      for (j = 0; j < Height; j++) {
-	errcount1 = 0;
-	for(i = 0; i < Width ; i++) {
-	  if (cl0[i][j]<0 && col[(i+k)%Width][j] > 128-l)
-	    errcount1-=cl0[i][j];
-	  if (cl0[i][j]>0 && col[(i+k)%Width][j] <= 128-l)
-	    errcount1+=cl0[i][j];
-	}
-	errcount += weight[j]*errcount1;
-      }
-
-      if (errcount < best) {
-	printf("Errors: %d, parameters: -s %.12f -l %.1f -i %.3f\n",
-	       errcount,rseed,(360.0*k)/(Width+1),M+l/1000.0);
-	best = errcount;
-	for (j = 0; j < Height; j++) {
-	  for(i = 0; i < Width ; i++)
-	    if (col[(i+k)%Width][j] <= 128-l) putchar('.');
-	    else putchar('O');
-	  putchar('\n');
-	}
-	fflush(stdout);
-      }
+  worker *w = (worker*)arg;
+  planet_ctx *ctx = w->ctx;
+  int j;
+
+  for (;;) {
+    LOCK(ctx);
+    j = ctx->next_row;
+    if (j < ctx->rowmax-1 && j+ctx->row_step > ctx->rowmax-1)
+      ctx->next_row = ctx->rowmax-1;
+    else
+      ctx->next_row = j+ctx->row_step;
+    UNLOCK(ctx);
+    if (j >= ctx->rowmax) break;
+    if (ctx->marks != 0 &&
+	memchr(&ctx->marks[j*ctx->Width], SAMPLE, ctx->Width) == 0)
+      continue; /* nothing to compute in this row */
+    w->Depth = ctx->Depth;
+    if (ctx->marks != 0 || j == 0 || j != w->lastrow+1) {
+      ssclear(w);
+      if (ctx->marks == 0 && j > 0 && rowdepth(ctx)) primerow(w, j-1);
     }
+    ctx->row_proc(w, j, j+1);
+    w->lastrow = j;
   }
+  return(arg);
 }
 
-int planet0(x,y,z, i, j)
-double x,y,z;
-int i, j;
+/* The cylindrical projections choose the depth of each row.  Where it */
+/* changes, the first points of a row are subdivided from the cached */
+/* level-11 tetrahedron of the row above (see planet1()), so the cache */
+/* matters for the picture. */
+
+static int rowdepth(planet_ctx *ctx)
 {
-  double alt, planet1(), y2;
-  int colour;
+  return(ctx->row_proc == mercator || ctx->row_proc == peter ||
+	 ctx->row_proc == squarep || ctx->row_proc == mollweide ||
+	 ctx->row_proc == sinusoid);
+}
 
-  alt = planet1(x,y,z);
-  y2 = y*y; y2 = y2*y2; y2 = y2*y2;
+/* Leave the tetrahedron cache as row j leaves it, by projecting the */
+/* row again and computing only its last point on the planet (as */
+/* searchseed() does for the seed search) */
 
-  /* calculate colour */
-  if (alt <=0.) { /* if below sea level then */
-    if (latic && y2+alt >= 0.98)
-      colour = HIGHEST;	 /* icecap if close to poles */
-    else {
-      colour = SEA+(int)((SEA-LOWEST+1)*(10*alt));
-      if (colour<LOWEST) colour = LOWEST;
-    }
+static void primerow(worker *w, int j)
+{
+  planet_ctx *ctx = w->ctx;
+
+  w->prime = 1;
+  w->pDepth = -1;
+  ctx->row_proc(w, j, j+1);
+  w->prime = 0;
+  if (w->pDepth < 0) return; /* no point on the planet */
+  w->Depth = w->pDepth;
+  planet1(w, w->px, w->py, w->pz);
+  w->Depth = ctx->Depth;
+}
+
+
+static void render_rows(planet_ctx *ctx, void (*proc)(worker *, int, int))
+{
+  int i, step;
+
+  ctx->row_proc = proc;
+  for (i = 0; i < ctx->nworkers; i++) ctx->workers[i].lastrow = -1;
+  if (ctx->frame != 0) {
+    reuseframe(ctx);
+    ctx->row_step = 1;
+    run_rows(ctx, row_worker, ctx->rowmin);
+    keepframe(ctx);
+    return;
   }
-  else {
-    if (latic) alt += 0.1*y2;  /* altitude adjusted with latitude */
-    if (alt >= 0.1) /* if high then */
-      colour = HIGHEST;
-    else {
-      colour = LAND+(int)((HIGHEST-LAND+1)*(10*alt));
-      if (colour>HIGHEST) colour = HIGHEST;
-    }
+  if (ctx->marks == 0) {
+    ctx->row_step = 1;
+    run_rows(ctx, row_worker, ctx->rowmin);
+    return;
   }
+  memset(ctx->marks, UNKNOWN, ctx->Width*ctx->Height);
+  for (step = ADAPTBLOCK; step >= 1; step /= 2) {
+    marksamples(ctx, step);
+    ctx->row_step = step;
+    run_rows(ctx, row_worker, ctx->rowmin);
+    if (step > 1) fillblocks(ctx, step);
+  }
+}
 
-  col[i][j] = colour;
-  if (vgrid != 0.0) {
-    xxx[i][j] = x;
-    yyy[i][j] = y;
+/* Run proc in every thread.  They take rows from j0 on */
+
+static void run_rows(planet_ctx *ctx, void *(*proc)(void *), int j0)
+{
+  ctx->next_row = j0;
+#ifndef NOTHREADS
+  if (ctx->nworkers > 1) {
+    int i, n;
+
+    for (n = 1; n < ctx->nworkers; n++)
+      if (pthread_create(&ctx->threads[n-1], NULL,
+			 proc, &ctx->workers[n]) != 0) break;
+    proc(&ctx->workers[0]); /* this thread works as well */
+    for (i = 1; i < n; i++) pthread_join(ctx->threads[i-1], NULL);
+    return;
   }
-  if (hgrid != 0.0) zzz[i][j] = z;
-  if (doshade>0) shades[i][j] = shade;
-  return(colour);
+#endif
+  proc(&ctx->workers[0]);
 }
 
-double ssa,ssb,ssc,ssd, ssas,ssbs,sscs,ssds,
-  ssax,ssay,ssaz, ssbx,ssby,ssbz, sscx,sscy,sscz, ssdx,ssdy,ssdz;
+/* Mark the pixels on the grid of every step'th pixel (and the last */
+/* row and column) that are not known yet as samples */
 
-double planet(a,b,c,d, as,bs,cs,ds,
-	      ax,ay,az, bx,by,bz, cx,cy,cz, dx,dy,dz,
-	      x,y,z, level)
-double a,b,c,d;		    /* altitudes of the 4 verticess */
-double as,bs,cs,ds;	    /* seeds of the 4 verticess */
-double ax,ay,az, bx,by,bz,  /* vertex coordinates */
-  cx,cy,cz, dx,dy,dz;
-double x,y,z;		    /* goal point */
-int level;		    /* levels to go */
+static void marksamples(planet_ctx *ctx, int step)
 {
-  double rand2();
-  double abx,aby,abz, acx,acy,acz, adx,ady,adz;
-  double bcx,bcy,bcz, bdx,bdy,bdz, cdx,cdy,cdz;
+  int i,j,W = ctx->Width,H = ctx->Height;
+  unsigned char *m;
+
+  for (j = 0; j < H; j++) {
+    if (j % step != 0 && j != H-1) continue;
+    m = &ctx->marks[j*W];
+    for (i = 0; i < W; i++)
+      if ((i % step == 0 || i == W-1) && m[i] == UNKNOWN) m[i] = SAMPLE;
+  }
+}
+
+/* After the pass computing the samples every step'th pixel, fill the */
+/* unknown pixels of the blocks between samples whose colours and */
+/* shades differ by at most adapttol by bilinear interpolation.  Samples */
+/* that were not computed are background, which is never interpolated. */
+
+static void fillblocks(planet_ctx *ctx, int step)
+{
+  int i,j,x0,y0,x1,y1,k,lo,hi,c[4],W = ctx->Width,H = ctx->Height;
+  int s[4] = {0,0,0,0}; /* only read when shading */
+  double fx,fy;
+  unsigned char *m;
+
+  for (j = 0; j < H; j++) {
+    if (j % step != 0 && j != H-1) continue;
+    m = &ctx->marks[j*W];
+    for (i = 0; i < W; i++)
+      if (m[i] == SAMPLE) m[i] = KNOWN;
+  }
+
+  for (y0 = 0; y0 < H-1; y0 += step) {
+    y1 = y0+step < H-1 ? y0+step : H-1;
+    for (x0 = 0; x0 < W-1; x0 += step) {
+      x1 = x0+step < W-1 ? x0+step : W-1;
+      c[0] = ctx->col[y0][x0]; c[1] = ctx->col[y0][x1];
+      c[2] = ctx->col[y1][x0]; c[3] = ctx->col[y1][x1];
+      lo = hi = c[0];
+      for (k = 1; k < 4; k++) {
+	if (c[k] < lo) lo = c[k];
+	if (c[k] > hi) hi = c[k];
+      }
+      if (lo < LOWEST || hi-lo > ctx->adapttol) continue;
+      if (ctx->doshade>0) {
+	s[0] = ctx->shades[y0][x0]; s[1] = ctx->shades[y0][x1];
+	s[2] = ctx->shades[y1][x0]; s[3] = ctx->shades[y1][x1];
+	lo = hi = s[0];
+	for (k = 1; k < 4; k++) {
+	  if (s[k] < lo) lo = s[k];
+	  if (s[k] > hi) hi = s[k];
+	}
+	if (hi-lo > ctx->adapttol) continue;
+      }
+      for (j = y0; j <= y1; j++) {
+	m = &ctx->marks[j*W];
+	fy = (double)(j-y0)/(y1-y0);
+	for (i = x0; i <= x1; i++) {
+	  if (m[i] != UNKNOWN) continue;
+	  fx = (double)(i-x0)/(x1-x0);
+	  ctx->col[j][i] = (int)((1.0-fy)*((1.0-fx)*c[0]+fx*c[1])
+				 +fy*((1.0-fx)*c[2]+fx*c[3])+0.5);
+	  if (ctx->doshade>0)
+	    ctx->shades[j][i] = (int)((1.0-fy)*((1.0-fx)*s[0]+fx*s[1])
+				      +fy*((1.0-fx)*s[2]+fx*s[3])+0.5);
+	  m[i] = KNOWN;
+	  ctx->interpolated++;
+	}
+      }
+    }
+  }
+}
+
+/* Seed search: the subdivision depth of row j of the map */
+
+static int searchdepth(planet_ctx *ctx, int j)
+{
+  double y,scale1;
+
+  y = 0.5*7.5*(2.0*j-ctx->Height+1);
+  y = sin(DEG2RAD*y);
+  scale1 = ctx->Width/ctx->Height/sqrt(1.0-y*y)/PI;
+  return(3*((int)(log_2(scale1*ctx->Height)))+6);
+}
+
+/* Map the cells from i0 on of row j of the current seed */
+
+static void searchrow(planet_ctx *ctx, int j, int i0)
+{
+  worker *w = &ctx->workers[0];
+  double y,cos2,theta1;
+  double y2,cos22,theta12;
+  int i,c,c1,c2,c3;
+
+  y = 0.5*7.5*(2.0*j-ctx->Height+1);
+  y = sin(DEG2RAD*y);
+  cos2 = sqrt(1.0-y*y);
+  y2 = 0.5*7.5*(2.0*j-ctx->Height+1.5);
+  y2 = sin(DEG2RAD*y2);
+  cos22 = sqrt(1.0-y2*y2);
+  w->Depth = searchdepth(ctx, j);
+  for (i = i0; i < ctx->Width ; i++) {
+    theta1 = -0.5*PI+PI*(2.0*i-ctx->Width)/ctx->Width;
+    theta12 = -0.5*PI+PI*(2.0*i+0.5-ctx->Width)/ctx->Width;
+    c = 128+1000*planet1(w, cos(theta1)*cos2,y,-sin(theta1)*cos2);
+    c1 = 128+1000*planet1(w, cos(theta12)*cos2,y,-sin(theta12)*cos2);
+    c2 = 128+1000*planet1(w, cos(theta1)*cos22,y2,-sin(theta1)*cos22);
+    c3 = 128+1000*planet1(w, cos(theta12)*cos22,y2,-sin(theta12)*cos22);
+    c = (c+c1+c2+c3)/4.0;
+    if (c<0) c = 0;
+    if (c>255) c = 255;
+    ctx->col[j][i] = c;
+  }
+}
+
+/* Add the errors of row j to err[21*k+(l+20)/2] of each rotation k and */
+/* altitude offset l; returns the fewest errors there are now.  The */
+/* cells that are land at offset l are a mask, which is rotated by k */
+/* and compared to the masks of cells preferring water or land, a bit */
+/* of the preference at a time */
+
+static int searchscore(planet_ctx *ctx, int j, unsigned long long *water,
+		       unsigned long long *land, int *err)
+{
+  int i,k,l,b,errcount1,lowest = -1, W = ctx->Width;
+  unsigned long long all = (1ULL<<W)-1, island, rot;
+
+  for (l=-20; l<=20; l+=2) {
+    island = 0;
+    for(i = 0; i < W ; i++)
+      if (ctx->col[j][i] > 128-l) island |= 1ULL<<i;
+    for (k=0; k<W; k++) {
+      /* bit i of rot is cell (i+k)%W */
+      rot = ((island>>k) | (island<<(W-k))) & all;
+      errcount1 = 0;
+      for (b = 0; b < MAPBITS; b++)
+	errcount1 += (POPCOUNT(water[b]&rot) + POPCOUNT(land[b]&~rot)) << b;
+      err[21*k+(l+20)/2] += ctx->weight[j]*errcount1;
+    }
+  }
+  for (k = 0; k < 21*W; k++)
+    if (lowest < 0 || err[k] < lowest) lowest = err[k];
+  return(lowest);
+}
+
+/* Store the errors, rotation k and altitude offset l of the matches */
+/* (k,l) with fewer errors than bound and than the matches before */
+/* them in match; returns how many there are */
+
+static int searchmatches(planet_ctx *ctx, int bound, int *err, int *match)
+{
+  int k,l,m = 0, errcount;
+
+  for (k=0; k<ctx->Width; k++) {
+    for (l=-20; l<=20; l+=2) {
+      errcount = *err++;
+      if (errcount < bound) {
+	match[3*m] = errcount;
+	match[3*m+1] = k;
+	match[3*m+2] = l;
+	m++;
+	bound = errcount;
+      }
+    }
+  }
+  return(m);
+}
+
+static void printmatch(planet_ctx *ctx, FILE *outfile, int *match)
+{
+  int i,j, errcount = match[0], k = match[1], l = match[2];
+
+  fprintf(outfile,"Errors: %d, parameters: -s %.12f -l %.1f -i %.3f\n",
+	  errcount,ctx->rseed,(360.0*k)/(ctx->Width+1),ctx->M+l/1000.0);
+  for (j = 0; j < ctx->Height; j++) {
+    for(i = 0; i < ctx->Width ; i++)
+      if (ctx->col[j][(i+k)%ctx->Width] <= 128-l) putc('.',outfile);
+      else putc('O',outfile);
+    putc('\n',outfile);
+  }
+  fflush(outfile);
+}
+
+/* Colour pixel (i,j) from the point (x,y,z) on the planet */
+
+static void planet0(worker *w, double x, double y, double z, int i, int j)
+{
+  planet_ctx *ctx = w->ctx;
+  double alt;
+  unsigned char *m;
+  fsample *s;
+
+  if (w->lonrow != 0) { /* only the grid cells (gridrow()) */
+    setgrid(w, x,y,z, i);
+    return;
+  }
+  if (w->prime) { /* only the point (primerow()) */
+    w->px = x; w->py = y; w->pz = z;
+    w->pDepth = w->Depth;
+    return;
+  }
+  if (ctx->marks != 0) { /* adaptive or reuse: only compute the samples */
+    m = &ctx->marks[j*ctx->Width+i];
+    if (*m != SAMPLE) return;
+    *m = KNOWN;
+  }
+  alt = planet1(w, x,y,z);
+  ctx->col[j][i] = altcolour(ctx, alt, y);
+  if (ctx->doshade>0) ctx->shades[j][i] = w->shade;
+  if (ctx->alts) ctx->alts[j][i] = alt;
+  if (ctx->frame != 0) { /* for the next map to reuse */
+    s = &ctx->frame->next[j*ctx->Width+i];
+    s->x = (float)x; s->y = (float)y; s->z = (float)z;
+    s->col = ctx->col[j][i];
+    s->shade = ctx->doshade>0 ? ctx->shades[j][i] : 0;
+  }
+}
+
+static int altcolour(planet_ctx *ctx, double alt, double y)
+{
+  double y2;
+  int colour;
+
+  y2 = y*y; y2 = y2*y2; y2 = y2*y2;
+
+  /* calculate colour */
+  if (alt <=0.) { /* if below sea level then */
+    if (ctx->latic && y2+alt >= 0.98)
+      colour = ctx->HIGHEST;	 /* icecap if close to poles */
+    else {
+      colour = ctx->SEA+(int)((ctx->SEA-LOWEST+1)*(10*alt));
+      if (colour<LOWEST) colour = LOWEST;
+    }
+  }
+  else {
+    if (ctx->latic) alt += 0.1*y2;  /* altitude adjusted with latitude */
+    if (alt >= 0.1) /* if high then */
+      colour = ctx->HIGHEST;
+    else {
+      colour = ctx->LAND+(int)((ctx->HIGHEST-ctx->LAND+1)*(10*alt));
+      if (colour>ctx->HIGHEST) colour = ctx->HIGHEST;
+    }
+  }
+  return(colour);
+}
+
+static void ssclear(worker *w) /* empty the cached tetrahedron */
+{
+  w->ssn = 0;
+  w->ttn = 0;
+}
+
+static double planet(worker *w,
+		     double a, double b, double c, double d,
+		     /* altitudes of the 4 verticess */
+		     double as, double bs, double cs, double ds,
+		     /* seeds of the 4 verticess */
+		     double ax, double ay, double az,
+		     double bx, double by, double bz,
+		     double cx, double cy, double cz,
+		     double dx, double dy, double dz,
+		     /* vertex coordinates */
+		     double x, double y, double z, /* goal point */
+		     int level) /* levels to go */
+{
+  planet_ctx *ctx = w->ctx;
+  double abx,aby,abz, acx,acy,acz, adx,ady,adz;
+  double bcx,bcy,bcz, bdx,bdy,bdz, cdx,cdy,cdz;
   double lab, lac, lad, lbc, lbd, lcd;
   double ex, ey, ez, e, es, es1, es2, es3;
   double eax,eay,eaz, epx,epy,epz;
   double ecx,ecy,ecz, edx,edy,edz;
   double x1,y1,z1,x2,y2,z2,l1,tmp;
 
+  STAT(w->calls++);
   if (level>0) {
     if (level==11) {
-      ssa=a; ssb=b; ssc=c; ssd=d; ssas=as; ssbs=bs; sscs=cs; ssds=ds;
-      ssax=ax; ssay=ay; ssaz=az; ssbx=bx; ssby=by; ssbz=bz;
-      sscx=cx; sscy=cy; sscz=cz; ssdx=dx; ssdy=dy; ssdz=dz;
+      vertex *ss = w->ss[11];
+      ss[0].h=a; ss[1].h=b; ss[2].h=c; ss[3].h=d;
+      ss[0].s=as; ss[1].s=bs; ss[2].s=cs; ss[3].s=ds;
+      ss[0].x=ax; ss[0].y=ay; ss[0].z=az;
+      ss[1].x=bx; ss[1].y=by; ss[1].z=bz;
+      ss[2].x=cx; ss[2].y=cy; ss[2].z=cz;
+      ss[3].x=dx; ss[3].y=dy; ss[3].z=dz;
+      w->ssn = 11;
     }
     abx = ax-bx; aby = ay-by; abz = az-bz;
     acx = ax-cx; acy = ay-cy; acz = az-cz;
@@ -1416,35 +2765,35 @@ int level;		    /* levels to go */
 
     /* reorder vertices so ab is longest edge */
     if (lab<lac)
-      return(planet(a,c,b,d, as,cs,bs,ds,
+      return(planet(w, a,c,b,d, as,cs,bs,ds,
 		    ax,ay,az, cx,cy,cz, bx,by,bz, dx,dy,dz,
 		    x,y,z, level));
     else {
       adx = ax-dx; ady = ay-dy; adz = az-dz;
       lad = adx*adx+ady*ady+adz*adz;
       if (lab<lad)
-	return(planet(a,d,b,c, as,ds,bs,cs,
+	return(planet(w, a,d,b,c, as,ds,bs,cs,
 		      ax,ay,az, dx,dy,dz, bx,by,bz, cx,cy,cz,
 		      x,y,z, level));
       else {
 	bcx = bx-cx; bcy = by-cy; bcz = bz-cz;
 	lbc = bcx*bcx+bcy*bcy+bcz*bcz;
 	if (lab<lbc)
-	  return(planet(b,c,a,d, bs,cs,as,ds,
+	  return(planet(w, b,c,a,d, bs,cs,as,ds,
 			bx,by,bz, cx,cy,cz, ax,ay,az, dx,dy,dz,
 			x,y,z, level));
 	else {
 	  bdx = bx-dx; bdy = by-dy; bdz = bz-dz;
 	  lbd = bdx*bdx+bdy*bdy+bdz*bdz;
 	  if (lab<lbd)
-	    return(planet(b,d,a,c, bs,ds,as,cs,
+	    return(planet(w, b,d,a,c, bs,ds,as,cs,
 			  bx,by,bz, dx,dy,dz, ax,ay,az, cx,cy,cz,
 			  x,y,z, level));
 	  else {
 	    cdx = cx-dx; cdy = cy-dy; cdz = cz-dz;
 	    lcd = cdx*cdx+cdy*cdy+cdz*cdz;
 	    if (lab<lcd)
-	      return(planet(c,d,a,b, cs,ds,as,bs,
+	      return(planet(w, c,d,a,b, cs,ds,as,bs,
 			    cx,cy,cz, dx,dy,dz, ax,ay,az, bx,by,bz,
 			    x,y,z, level));
 	    else { /* ab is longest, so cut ab */
@@ -1464,8 +2813,8 @@ int level;		    /* levels to go */
 
               /* new altitude is: */
 	      e = 0.5*(a+b) /* average of end points */
-		+ es*dd1*fabs(a-b) /* plus contribution for altitude diff */
-                + es1*dd2*pow(lab,POW); /* plus contribution for distance */
+		+ es*ctx->dd1*fabs(a-b) /* plus contribution for altitude diff */
+                + es1*ctx->dd2*pow(lab,ctx->POW); /* plus contribution for distance */
 	      eax = ax-ex; eay = ay-ey; eaz = az-ez;
 	      epx =  x-ex; epy =  y-ey; epz =  z-ez;
 	      ecx = cx-ex; ecy = cy-ey; ecz = cz-ez;
@@ -1474,11 +2823,11 @@ int level;		    /* levels to go */
 		   -eaz*ecy*edx-eay*ecx*edz-eax*ecz*edy)*
 		  (epx*ecy*edz+epy*ecz*edx+epz*ecx*edy
 		   -epz*ecy*edx-epy*ecx*edz-epx*ecz*edy)>0.0)
-		return(planet(c,d,a,e, cs,ds,as,es,
+		return(planet(w, c,d,a,e, cs,ds,as,es,
 			      cx,cy,cz, dx,dy,dz, ax,ay,az, ex,ey,ez,
 			      x,y,z, level-1));
 	      else
-		return(planet(c,d,b,e, cs,ds,bs,es,
+		return(planet(w, c,d,b,e, cs,ds,bs,es,
 			      cx,cy,cz, dx,dy,dz, bx,by,bz, ex,ey,ez,
 			      x,y,z, level-1));
 	    }
@@ -1488,7 +2837,7 @@ int level;		    /* levels to go */
     } 
   }
   else { /* level == 0 */
-    if (doshade==1 || doshade==2) {
+    if (ctx->doshade==1 || ctx->doshade==2) {
       x1 = 0.25*(ax+bx+cx+dx);
       x1 = a*(x1-ax)+b*(x1-bx)+c*(x1-cx)+d*(x1-dx);
       y1 = 0.25*(ay+by+cy+dy);
@@ -1502,14 +2851,14 @@ int level;		    /* levels to go */
       x2 = x*x1+y*y1+z*z1;
       y2 = -x*y/tmp*x1+tmp*y1-z*y/tmp*z1;
       z2 = -z/tmp*x1+x/tmp*z1;
-      shade =
-	(int)((-sin(PI*shade_angle/180.0)*y2-cos(PI*shade_angle/180.0)*z2)
+      w->shade =
+	(int)((-sin(PI*ctx->shade_angle/180.0)*y2-cos(PI*ctx->shade_angle/180.0)*z2)
 	      /l1*48.0+128.0);
-      if (shade<10) shade = 10;
-      if (shade>255) shade = 255;
-      if (doshade==2 && (a+b+c+d)<0.0) shade = 150;
+      if (w->shade<10) w->shade = 10;
+      if (w->shade>255) w->shade = 255;
+      if (ctx->doshade==2 && (a+b+c+d)<0.0) w->shade = 150;
     }
-    else if (doshade==3) {
+    else if (ctx->doshade==3) {
       if ((a+b+c+d)<0.0) {
 	x1 = x; y1 = y; z1 = z;
       } else {
@@ -1529,27 +2878,226 @@ int level;		    /* levels to go */
       }
       l1 = sqrt(x1*x1+y1*y1+z1*z1);
       if (l1==0.0) l1 = 1.0;
-      x2 = cos(PI*shade_angle/180.0-0.5*PI)*cos(PI*shade_angle2/180.0);
-      y2 = -sin(PI*shade_angle2/180.0);
-      z2 = -sin(PI*shade_angle/180.0-0.5*PI)*cos(PI*shade_angle2/180.0);
-      shade = (int)((x1*x2+y1*y2+z1*z2)/l1*170.0+10);
-      if (shade<10) shade = 10;
-      if (shade>255) shade = 255;
+      x2 = cos(PI*ctx->shade_angle/180.0-0.5*PI)*cos(PI*ctx->shade_angle2/180.0);
+      y2 = -sin(PI*ctx->shade_angle2/180.0);
+      z2 = -sin(PI*ctx->shade_angle/180.0-0.5*PI)*cos(PI*ctx->shade_angle2/180.0);
+      w->shade = (int)((x1*x2+y1*y2+z1*z2)/l1*170.0+10);
+      if (w->shade<10) w->shade = 10;
+      if (w->shade>255) w->shade = 255;
     }
     return((a+b+c+d)/4);
   }
 }
 
-double planet1(x,y,z)
-double x,y,z;
+/* Iterative version of planet().  The tetrahedron t is four vertices */
+/* that are modified in place: reordering the vertices only permutes */
+/* the pointers a,b,c,d, and cutting the longest edge overwrites the */
+/* vertex that falls outside with the new midpoint.  The arithmetic is */
+/* the same as in planet(), so the results are identical.  Every level */
+/* is saved in the tetrahedron cache on the way down. */
+
+static double planeti(worker *w, vertex *t,
+		      double x, double y, double z, /* goal point */
+		      int level) /* levels to go */
+{
+  planet_ctx *ctx = w->ctx;
+  vertex *a = &t[0], *b = &t[1], *c = &t[2], *d = &t[3], *p;
+  double abx,aby,abz, acx,acy,acz, adx,ady,adz;
+  double bcx,bcy,bcz, bdx,bdy,bdz, cdx,cdy,cdz;
+  double lab, lac, lad, lbc, lbd, lcd;
+  double ex, ey, ez, e, es, es1, es2, es3;
+  double eax,eay,eaz, epx,epy,epz;
+  double ecx,ecy,ecz, edx,edy,edz;
+
+  COUNTLEVEL(w, level);
+  STAT(w->calls++);
+  while (level>0) {
+    abx = a->x-b->x; aby = a->y-b->y; abz = a->z-b->z;
+    acx = a->x-c->x; acy = a->y-c->y; acz = a->z-c->z;
+    lab = abx*abx+aby*aby+abz*abz;
+    lac = acx*acx+acy*acy+acz*acz;
+
+    /* reorder vertices so ab is longest edge */
+    if (lab<lac) { /* a,c,b,d */
+      p = b; b = c; c = p;
+      continue;
+    }
+    adx = a->x-d->x; ady = a->y-d->y; adz = a->z-d->z;
+    lad = adx*adx+ady*ady+adz*adz;
+    if (lab<lad) { /* a,d,b,c */
+      p = b; b = d; d = c; c = p;
+      continue;
+    }
+    bcx = b->x-c->x; bcy = b->y-c->y; bcz = b->z-c->z;
+    lbc = bcx*bcx+bcy*bcy+bcz*bcz;
+    if (lab<lbc) { /* b,c,a,d */
+      p = a; a = b; b = c; c = p;
+      continue;
+    }
+    bdx = b->x-d->x; bdy = b->y-d->y; bdz = b->z-d->z;
+    lbd = bdx*bdx+bdy*bdy+bdz*bdz;
+    if (lab<lbd) { /* b,d,a,c */
+      p = a; a = b; b = d; d = c; c = p;
+      continue;
+    }
+    cdx = c->x-d->x; cdy = c->y-d->y; cdz = c->z-d->z;
+    lcd = cdx*cdx+cdy*cdy+cdz*cdz;
+    if (lab<lcd) { /* c,d,a,b */
+      p = a; a = c; c = p;
+      p = b; b = d; d = p;
+      continue;
+    }
+
+    /* ab is longest, so cut ab */
+    if (level<SSLEVELS) {
+      p = w->ss[level];
+      p[0] = *a; p[1] = *b; p[2] = *c; p[3] = *d;
+    }
+    es = rand2(a->s,b->s);
+    es1 = rand2(es,es);
+    es2 = 0.5+0.1*rand2(es1,es1);
+    es3 = 1.0-es2;
+    if (a->x<b->x) {
+      ex = es2*a->x+es3*b->x; ey = es2*a->y+es3*b->y; ez = es2*a->z+es3*b->z;
+    } else if (a->x>b->x) {
+      ex = es3*a->x+es2*b->x; ey = es3*a->y+es2*b->y; ez = es3*a->z+es2*b->z;
+    } else { /* ax==bx, very unlikely to ever happen */
+      ex = 0.5*a->x+0.5*b->x; ey = 0.5*a->y+0.5*b->y; ez = 0.5*a->z+0.5*b->z;
+    }
+    if (lab>1.0) lab = pow(lab,0.5);
+    /* decrease contribution for very long distances */
+
+    /* new altitude is: */
+    e = 0.5*(a->h+b->h) /* average of end points */
+      + es*ctx->dd1*fabs(a->h-b->h) /* plus contribution for altitude diff */
+      + es1*ctx->dd2*pow(lab,ctx->POW); /* plus contribution for distance */
+    eax = a->x-ex; eay = a->y-ey; eaz = a->z-ez;
+    epx =    x-ex; epy =    y-ey; epz =    z-ez;
+    ecx = c->x-ex; ecy = c->y-ey; ecz = c->z-ez;
+    edx = d->x-ex; edy = d->y-ey; edz = d->z-ez;
+    if ((eax*ecy*edz+eay*ecz*edx+eaz*ecx*edy
+	 -eaz*ecy*edx-eay*ecx*edz-eax*ecz*edy)*
+	(epx*ecy*edz+epy*ecz*edx+epz*ecx*edy
+	 -epz*ecy*edx-epy*ecx*edz-epx*ecz*edy)>0.0) {
+      /* c,d,a,e: e replaces b */
+      p = b; b = d; d = p;
+      p = a; a = c; c = p;
+    } else {
+      /* c,d,b,e: e replaces a */
+      p = a; a = c; c = b; b = d; d = p;
+    }
+    d->h = e; d->s = es; d->x = ex; d->y = ey; d->z = ez;
+    level--;
+  }
+
+  /* level == 0 */
+  if (ctx->doshade>0) w->shade = leafshade(ctx, a,b,c,d, x,y,z, w->grad);
+  return((a->h+b->h+c->h+d->h)/4);
+}
+
+/* Shade of point (x,y,z) in the tetrahedron a,b,c,d at level 0.  g is */
+/* set to the gradient it is found from */
+
+static int leafshade(planet_ctx *ctx, vertex *a, vertex *b, vertex *c,
+		     vertex *d, double x, double y, double z, double *g)
+{
+  leafgrad(ctx, a,b,c,d, g);
+  return(gradshade(ctx, g, a->h+b->h+c->h+d->h, x,y,z));
+}
+
+/* The gradient of the altitude in the tetrahedron a,b,c,d that */
+/* gradshade() shades with */
+
+static void leafgrad(planet_ctx *ctx, vertex *a, vertex *b, vertex *c,
+		     vertex *d, double *g)
+{
+  double abx,aby,abz, acx,acy,acz, adx,ady,adz;
+  double bcx,bcy,bcz, bdx,bdy,bdz, cdx,cdy,cdz;
+  double l1;
+
+  g[0] = g[1] = g[2] = 0.0;
+  if (ctx->doshade==1 || ctx->doshade==2) {
+    g[0] = 0.25*(a->x+b->x+c->x+d->x);
+    g[0] = a->h*(g[0]-a->x)+b->h*(g[0]-b->x)+c->h*(g[0]-c->x)+d->h*(g[0]-d->x);
+    g[1] = 0.25*(a->y+b->y+c->y+d->y);
+    g[1] = a->h*(g[1]-a->y)+b->h*(g[1]-b->y)+c->h*(g[1]-c->y)+d->h*(g[1]-d->y);
+    g[2] = 0.25*(a->z+b->z+c->z+d->z);
+    g[2] = a->h*(g[2]-a->z)+b->h*(g[2]-b->z)+c->h*(g[2]-c->z)+d->h*(g[2]-d->z);
+  }
+  else if (ctx->doshade==3 && (a->h+b->h+c->h+d->h)>=0.0) {
+    abx = a->x-b->x; aby = a->y-b->y; abz = a->z-b->z;
+    acx = a->x-c->x; acy = a->y-c->y; acz = a->z-c->z;
+    adx = a->x-d->x; ady = a->y-d->y; adz = a->z-d->z;
+    bcx = b->x-c->x; bcy = b->y-c->y; bcz = b->z-c->z;
+    bdx = b->x-d->x; bdy = b->y-d->y; bdz = b->z-d->z;
+    cdx = c->x-d->x; cdy = c->y-d->y; cdz = c->z-d->z;
+    l1 = 50.0/
+      sqrt(abx*abx+aby*aby+abz*abz+acx*acx+acy*acy+acz*acz+
+	   adx*adx+ady*ady+adz*adz+bcx*bcx+bcy*bcy+bcz*bcz+
+	   bdx*bdx+bdy*bdy+bdz*bdz+cdx*cdx+cdy*cdy+cdz*cdz);
+    g[0] = 0.25*(a->x+b->x+c->x+d->x);
+    g[0] = l1*(a->h*(g[0]-a->x)+b->h*(g[0]-b->x)+c->h*(g[0]-c->x)+d->h*(g[0]-d->x));
+    g[1] = 0.25*(a->y+b->y+c->y+d->y);
+    g[1] = l1*(a->h*(g[1]-a->y)+b->h*(g[1]-b->y)+c->h*(g[1]-c->y)+d->h*(g[1]-d->y));
+    g[2] = 0.25*(a->z+b->z+c->z+d->z);
+    g[2] = l1*(a->h*(g[2]-a->z)+b->h*(g[2]-b->z)+c->h*(g[2]-c->z)+d->h*(g[2]-d->z));
+  }
+}
+
+/* Shade of point (x,y,z) with gradient g (from leafgrad()), where the */
+/* altitude has the sign of h */
+
+static int gradshade(planet_ctx *ctx, double *g, double h,
+		     double x, double y, double z)
+{
+  double x1,y1,z1,x2,y2,z2,l1,tmp;
+  int shade = 255;
+
+  if (ctx->doshade==1 || ctx->doshade==2) {
+    x1 = g[0]; y1 = g[1]; z1 = g[2];
+    l1 = sqrt(x1*x1+y1*y1+z1*z1);
+    if (l1==0.0) l1 = 1.0;
+    tmp = sqrt(1.0-y*y);
+    if (tmp<0.0001) tmp = 0.0001;
+    x2 = x*x1+y*y1+z*z1;
+    y2 = -x*y/tmp*x1+tmp*y1-z*y/tmp*z1;
+    z2 = -z/tmp*x1+x/tmp*z1;
+    shade =
+      (int)((-sin(PI*ctx->shade_angle/180.0)*y2-cos(PI*ctx->shade_angle/180.0)*z2)
+	    /l1*48.0+128.0);
+    if (shade<10) shade = 10;
+    if (shade>255) shade = 255;
+    if (ctx->doshade==2 && h<0.0) shade = 150;
+  }
+  else if (ctx->doshade==3) {
+    if (h<0.0) {
+      x1 = x; y1 = y; z1 = z;
+    } else {
+      x1 = g[0] + x; y1 = g[1] + y; z1 = g[2] + z;
+    }
+    l1 = sqrt(x1*x1+y1*y1+z1*z1);
+    if (l1==0.0) l1 = 1.0;
+    x2 = cos(PI*ctx->shade_angle/180.0-0.5*PI)*cos(PI*ctx->shade_angle2/180.0);
+    y2 = -sin(PI*ctx->shade_angle2/180.0);
+    z2 = -sin(PI*ctx->shade_angle/180.0-0.5*PI)*cos(PI*ctx->shade_angle2/180.0);
+    shade = (int)((x1*x2+y1*y2+z1*z2)/l1*170.0+10);
+    if (shade<10) shade = 10;
+    if (shade>255) shade = 255;
+  }
+  return(shade);
+}
+
+/* Is (x,y,z) inside tetrahedron t? */
+
+static int inside(vertex *t, double x, double y, double z)
 {
   double abx,aby,abz, acx,acy,acz, adx,ady,adz, apx,apy,apz;
   double bax,bay,baz, bcx,bcy,bcz, bdx,bdy,bdz, bpx,bpy,bpz;
 
-  abx = ssbx-ssax; aby = ssby-ssay; abz = ssbz-ssaz;
-  acx = sscx-ssax; acy = sscy-ssay; acz = sscz-ssaz;
-  adx = ssdx-ssax; ady = ssdy-ssay; adz = ssdz-ssaz;
-  apx = x-ssax; apy = y-ssay; apz = z-ssaz;
+  abx = t[1].x-t[0].x; aby = t[1].y-t[0].y; abz = t[1].z-t[0].z;
+  acx = t[2].x-t[0].x; acy = t[2].y-t[0].y; acz = t[2].z-t[0].z;
+  adx = t[3].x-t[0].x; ady = t[3].y-t[0].y; adz = t[3].z-t[0].z;
+  apx = x-t[0].x; apy = y-t[0].y; apz = z-t[0].z;
   if ((adx*aby*acz+ady*abz*acx+adz*abx*acy
        -adz*aby*acx-ady*abx*acz-adx*abz*acy)*
       (apx*aby*acz+apy*abz*acx+apz*abx*acy
@@ -1566,326 +3114,1094 @@ double x,y,z;
 	   -apz*ady*acx-apy*adx*acz-apx*adz*acy)>0.0){
 	/* p is on same side of acd as b */
 	bax = -abx; bay = -aby; baz = -abz;
-	bcx = sscx-ssbx; bcy = sscy-ssby; bcz = sscz-ssbz;
-	bdx = ssdx-ssbx; bdy = ssdy-ssby; bdz = ssdz-ssbz;
-	bpx = x-ssbx; bpy = y-ssby; bpz = z-ssbz;
+	bcx = t[2].x-t[1].x; bcy = t[2].y-t[1].y; bcz = t[2].z-t[1].z;
+	bdx = t[3].x-t[1].x; bdy = t[3].y-t[1].y; bdz = t[3].z-t[1].z;
+	bpx = x-t[1].x; bpy = y-t[1].y; bpz = z-t[1].z;
 	if ((bax*bcy*bdz+bay*bcz*bdx+baz*bcx*bdy
 	     -baz*bcy*bdx-bay*bcx*bdz-bax*bcz*bdy)*
 	    (bpx*bcy*bdz+bpy*bcz*bdx+bpz*bcx*bdy
 	     -bpz*bcy*bdx-bpy*bcx*bdz-bpx*bcz*bdy)>0.0){
 	  /* p is on same side of bcd as a */
 	  /* Hence, p is inside tetrahedron */
-	  return(planet(ssa,ssb,ssc,ssd, ssas,ssbs,sscs,ssds,
-			ssax,ssay,ssaz, ssbx,ssby,ssbz,
-			sscx,sscy,sscz, ssdx,ssdy,ssdz,
-			x,y,z, 11));
+	  return(1);
 	}
       }
     }
-  } /* otherwise */
-  return(planet(M,M,M,M,
-		/* initial altitude is M on all corners of tetrahedron */
-		r1,r2,r3,r4,
-		/* same seed set is used in every call */
-		-sqrt(3.0)-0.20, -sqrt(3.0)-0.22, -sqrt(3.0)-0.23,
-		-sqrt(3.0)-0.19,  sqrt(3.0)+0.18,  sqrt(3.0)+0.17,
-		 sqrt(3.0)+0.21, -sqrt(3.0)-0.24,  sqrt(3.0)+0.15,
-		 sqrt(3.0)+0.24,  sqrt(3.0)+0.22, -sqrt(3.0)-0.25,
-		/* coordinates of vertices of tetrahedron*/
-		x,y,z,
-		/* coordinates of point we want colour of */
-		Depth));
-		/* subdivision depth */
+  }
+  return(0);
+}
+
+/* The tetrahedron cache holds the tetrahedra containing the last point */
+/* at every level.  Neighbouring points usually share most of these, so */
+/* a point is subdivided from the deepest one that contains it.  Each */
+/* contains the ones below it, so this is found by binary search.  When */
+/* Depth has changed since the cache was filled, only levels 11 and */
+/* below are used, as the original single level-11 cache did, except */
+/* with pixeldepth, where the depth changes from pixel to pixel and the */
+/* cache is not used (as in treeplanet()). */
+
+static double planet1(worker *w, double x, double y, double z)
+{
+  planet_ctx *ctx = w->ctx;
+  vertex t[4];
+  int lo, hi, mid;
+
+  if (ctx->sphere && ctx->sphere->ready) return(spherepoint(w, x,y,z));
+  if (ctx->tree) return(treeplanet(w, x,y,z));
+  w->sspoints++;
+  w->sslevels += w->Depth;
+  if (ctx->recursive) {
+    if (w->ssn>=11 && inside(w->ss[11], x,y,z)) {
+      w->sshits++;
+      w->ssskipped += w->Depth-11;
+      COUNTLEVEL(w, 11);
+      return(planet(w, w->ss[11][0].h,w->ss[11][1].h,w->ss[11][2].h,w->ss[11][3].h,
+		    w->ss[11][0].s,w->ss[11][1].s,w->ss[11][2].s,w->ss[11][3].s,
+		    w->ss[11][0].x,w->ss[11][0].y,w->ss[11][0].z,
+		    w->ss[11][1].x,w->ss[11][1].y,w->ss[11][1].z,
+		    w->ss[11][2].x,w->ss[11][2].y,w->ss[11][2].z,
+		    w->ss[11][3].x,w->ss[11][3].y,w->ss[11][3].z,
+		    x,y,z, 11));
+    }
+    COUNTLEVEL(w, w->Depth);
+    return(planet(w, ctx->M,ctx->M,ctx->M,ctx->M,
+		  /* initial altitude is M on all corners of tetrahedron */
+		  ctx->r1,ctx->r2,ctx->r3,ctx->r4,
+		  /* same seed set is used in every call */
+		  -sqrt(3.0)-0.20, -sqrt(3.0)-0.22, -sqrt(3.0)-0.23,
+		  -sqrt(3.0)-0.19,  sqrt(3.0)+0.18,  sqrt(3.0)+0.17,
+		   sqrt(3.0)+0.21, -sqrt(3.0)-0.24,  sqrt(3.0)+0.15,
+		   sqrt(3.0)+0.24,  sqrt(3.0)+0.22, -sqrt(3.0)-0.25,
+		  /* coordinates of vertices of tetrahedron*/
+		  x,y,z,
+		  /* coordinates of point we want colour of */
+		  w->Depth));
+		  /* subdivision depth */
+  }
+
+  hi = w->ssn;
+  if (w->ssDepth != w->Depth) hi = ctx->pixeldepth ? 0 : hi > 11 ? 11 : hi;
+  if (hi>0 && inside(w->ss[hi], x,y,z)) {
+    lo = 1; /* ss[hi] contains the point, find the deepest that does */
+    while (lo<hi) {
+      mid = (lo+hi)/2;
+      if (inside(w->ss[mid], x,y,z)) hi = mid;
+      else lo = mid+1;
+    }
+    w->sshits++;
+    w->ssskipped += w->Depth-hi;
+    t[0] = w->ss[hi][0]; t[1] = w->ss[hi][1];
+    t[2] = w->ss[hi][2]; t[3] = w->ss[hi][3];
+    return(planeti(w, t, x,y,z, hi));
+  }
 
+  /* otherwise start from the top */
+  w->ssn = w->Depth<SSLEVELS ? w->Depth : SSLEVELS-1;
+  w->ssDepth = w->Depth;
+  roottetra(ctx, t);
+  return(planeti(w, t, x,y,z, w->Depth));
 }
 
+/* The subdivision tree.  With ctx->tree_mb > 0, the cuts made by the */
+/* subdivision are kept in a tree shared by all threads, so later points */
+/* (in the same or a later render with the same seed) find them there */
+/* instead of computing them again.  Node k levels down holds the kth */
+/* cut on the way to a point, so it does not depend on Depth.  A node is */
+/* made the first time a point passes through it, with the same */
+/* arithmetic as planeti(), so altitudes and shades are unchanged.  When */
+/* the tree has used its budget, no more nodes are made and the rest of */
+/* the subdivision is done by planeti().  At the end of a render (when */
+/* no thread is using the tree), nodes not used by the render and then */
+/* the deepest nodes are freed until at most 3/4 of the budget is used. */
+
+#ifndef NOTHREADS
+#define LOADPTR(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define TOUCH(n,g) \
+  if (__atomic_load_n(&(n)->gen, __ATOMIC_RELAXED) != (g)) \
+    __atomic_store_n(&(n)->gen, g, __ATOMIC_RELAXED)
+#else
+#define LOADPTR(p) (p)
+#define TOUCH(n,g) (n)->gen = (g)
+#endif
+
+/* Find the longest edge of tetrahedron q[0..3] and cut it, exactly as */
+/* planeti() does, and store the cut in n */
 
-double rand2(p,q) /* random number generator taking two seeds */
-double p,q;	  /* rand2(p,q) = rand2(q,p) is important     */
+static void cuttetra(planet_ctx *ctx, tnode *n, vertex **q)
 {
-  double r;
-  r = (p+3.14159265)*(q+3.14159265);
-  return(2.*(r-(int)r)-1.);
+  int a = 0, b = 1, c = 2, d = 3, p;
+  vertex *va, *vb, *vc, *vd;
+  double abx,aby,abz, acx,acy,acz, adx,ady,adz;
+  double bcx,bcy,bcz, bdx,bdy,bdz, cdx,cdy,cdz;
+  double lab, lac, lad, lbc, lbd, lcd;
+  double ex, ey, ez, es, es1, es2, es3;
+  double eax,eay,eaz, ecx,ecy,ecz, edx,edy,edz;
+
+  for (;;) {
+    va = q[a]; vb = q[b]; vc = q[c]; vd = q[d];
+    abx = va->x-vb->x; aby = va->y-vb->y; abz = va->z-vb->z;
+    acx = va->x-vc->x; acy = va->y-vc->y; acz = va->z-vc->z;
+    lab = abx*abx+aby*aby+abz*abz;
+    lac = acx*acx+acy*acy+acz*acz;
+    if (lab<lac) { p = b; b = c; c = p; continue; }
+    adx = va->x-vd->x; ady = va->y-vd->y; adz = va->z-vd->z;
+    lad = adx*adx+ady*ady+adz*adz;
+    if (lab<lad) { p = b; b = d; d = c; c = p; continue; }
+    bcx = vb->x-vc->x; bcy = vb->y-vc->y; bcz = vb->z-vc->z;
+    lbc = bcx*bcx+bcy*bcy+bcz*bcz;
+    if (lab<lbc) { p = a; a = b; b = c; c = p; continue; }
+    bdx = vb->x-vd->x; bdy = vb->y-vd->y; bdz = vb->z-vd->z;
+    lbd = bdx*bdx+bdy*bdy+bdz*bdz;
+    if (lab<lbd) { p = a; a = b; b = d; d = c; c = p; continue; }
+    cdx = vc->x-vd->x; cdy = vc->y-vd->y; cdz = vc->z-vd->z;
+    lcd = cdx*cdx+cdy*cdy+cdz*cdz;
+    if (lab<lcd) { p = a; a = c; c = p; p = b; b = d; d = p; continue; }
+    break;
+  }
+  n->a = a; n->b = b; n->c = c; n->d = d;
+
+  es = rand2(va->s,vb->s);
+  es1 = rand2(es,es);
+  es2 = 0.5+0.1*rand2(es1,es1);
+  es3 = 1.0-es2;
+  if (va->x<vb->x) {
+    ex = es2*va->x+es3*vb->x; ey = es2*va->y+es3*vb->y; ez = es2*va->z+es3*vb->z;
+  } else if (va->x>vb->x) {
+    ex = es3*va->x+es2*vb->x; ey = es3*va->y+es2*vb->y; ez = es3*va->z+es2*vb->z;
+  } else { /* ax==bx, very unlikely to ever happen */
+    ex = 0.5*va->x+0.5*vb->x; ey = 0.5*va->y+0.5*vb->y; ez = 0.5*va->z+0.5*vb->z;
+  }
+  if (lab>1.0) lab = pow(lab,0.5);
+  n->e.h = 0.5*(va->h+vb->h)
+    + es*ctx->dd1*fabs(va->h-vb->h)
+    + es1*ctx->dd2*pow(lab,ctx->POW);
+  n->e.s = es; n->e.x = ex; n->e.y = ey; n->e.z = ez;
+  eax = va->x-ex; eay = va->y-ey; eaz = va->z-ez;
+  ecx = vc->x-ex; ecy = vc->y-ey; ecz = vc->z-ez;
+  edx = vd->x-ex; edy = vd->y-ey; edz = vd->z-ez;
+  n->s = eax*ecy*edz+eay*ecz*edx+eaz*ecx*edy
+    -eaz*ecy*edx-eay*ecx*edz-eax*ecz*edy;
+  n->child[0] = n->child[1] = 0;
 }
 
-void printppm(outfile) /* prints picture in PPM (portable pixel map) format */
-FILE *outfile;
-{
-  int i,j,c,s;
-
-  fprintf(outfile,"P6\n");
-  fprintf(outfile,"#fractal planet image\n");
-  fprintf(outfile,"%d %d 255\n",Width,Height);
- 
-  if (doshade) {
-    for (j=0; j<Height; j++) {
-      for (i=0; i<Width; i++) {
-	s =shades[i][j];
-	c = s*rtable[col[i][j]]/150;
-	if (c>255) c=255;
-	putc(c,outfile);
-	c = s*gtable[col[i][j]]/150;
-	if (c>255) c=255;
-	putc(c,outfile);
-	c = s*btable[col[i][j]]/150;
-	if (c>255) c=255;
-	putc(c,outfile);
+/* Get TBATCH nodes for w from the tree.  Returns 0 if it is full */
+
+static int getnodes(worker *w)
+{
+  struct planet_tree *tr = w->ctx->tree;
+  tnode *n;
+  tslab *sl;
+  int i, ok = 1;
+
+  if (w->nomore) return(0);
+  LOCK(w->ctx);
+  if (tr->used+TBATCH > tr->max) ok = 0;
+  for (i=0; ok && i<TBATCH; i++) {
+    if ((n = tr->free) != 0)
+      tr->free = n->child[0];
+    else {
+      if (tr->slabs == 0 || tr->slabused == TSLAB) {
+	if ((sl = (tslab*)malloc(sizeof(tslab))) == 0) { ok = 0; break; }
+	sl->next = tr->slabs;
+	tr->slabs = sl;
+	tr->slabused = 0;
       }
+      n = &tr->slabs->n[tr->slabused++];
+    }
+    n->child[0] = w->pool;
+    w->pool = n;
+    w->npool++;
+    tr->used++;
+  }
+  UNLOCK(w->ctx);
+  if (!ok) w->nomore = 1; /* don't ask again in this render */
+  return(ok);
+}
+
+/* Make child k of n, with tetrahedron q[0..3].  Returns 0 if the */
+/* tree is full */
+
+static tnode *newnode(worker *w, tnode *n, int k, vertex **q)
+{
+  planet_ctx *ctx = w->ctx;
+  tnode *ch;
+
+  if (w->pool == 0 && !getnodes(w)) return(0);
+  ch = w->pool;
+  w->pool = ch->child[0];
+  w->npool--;
+  cuttetra(ctx, ch, q);
+  ch->gen = ctx->tree->gen;
+#ifndef NOTHREADS
+  {
+    tnode *old = 0;
+
+    if (!__atomic_compare_exchange_n(&n->child[k], &old, ch, 0,
+				     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+      ch->child[0] = w->pool; /* another thread made it first */
+      w->pool = ch;
+      w->npool++;
+      return(old);
     }
+  }
+#else
+  n->child[k] = ch;
+#endif
+  return(ch);
+}
+
+/* planet1() using the tree.  Like the tetrahedron cache, w->tt[k] and */
+/* w->ttv[k] are the node and tetrahedron k levels down on the way to */
+/* the last point, for k = 1..w->ttn */
+
+static double treeplanet(worker *w, double x, double y, double z)
+{
+  planet_ctx *ctx = w->ctx;
+  struct planet_tree *tr = ctx->tree;
+  tnode *n, *ch;
+  vertex v[4], t[4], *q[4], *a, *b, *c, *d;
+  double epx,epy,epz, ecx,ecy,ecz, edx,edy,edz;
+  int D = w->Depth, lo, hi, mid, k, side;
+
+  w->sspoints++;
+  w->sslevels += D;
+
+  /* start from the deepest node on the last path that contains p */
+  hi = w->ttn < D-1 ? w->ttn : D-1;
+  lo = 0;
+  while (lo<hi) {
+    mid = (lo+hi+1)/2;
+    if (inside(w->ttv[mid], x,y,z)) lo = mid;
+    else hi = mid-1;
+  }
+  if (lo>0) {
+    w->sshits++;
+    w->ssskipped += lo;
+    n = w->tt[lo];
+    v[0] = w->ttv[lo][0]; v[1] = w->ttv[lo][1];
+    v[2] = w->ttv[lo][2]; v[3] = w->ttv[lo][3];
   } else {
-    for (j=0; j<Height; j++)
-      for (i=0; i<Width; i++) {
-	putc(rtable[col[i][j]],outfile);
-	putc(gtable[col[i][j]],outfile);
-	putc(btable[col[i][j]],outfile);
+    n = &tr->root;
+    v[0] = tr->t[0]; v[1] = tr->t[1]; v[2] = tr->t[2]; v[3] = tr->t[3];
+  }
+  q[0] = &v[0]; q[1] = &v[1]; q[2] = &v[2]; q[3] = &v[3];
+
+  for (k = lo+1; ; k++) { /* n is k-1 levels down, cut it */
+    TOUCH(n, tr->gen);
+    a = q[n->a]; b = q[n->b]; c = q[n->c]; d = q[n->d];
+    epx = x-n->e.x; epy = y-n->e.y; epz = z-n->e.z;
+    ecx = c->x-n->e.x; ecy = c->y-n->e.y; ecz = c->z-n->e.z;
+    edx = d->x-n->e.x; edy = d->y-n->e.y; edz = d->z-n->e.z;
+    if (n->s*(epx*ecy*edz+epy*ecz*edx+epz*ecx*edy
+	      -epz*ecy*edx-epy*ecx*edz-epx*ecz*edy)>0.0) {
+      /* c,d,a,e: e replaces b */
+      *b = n->e;
+      q[0] = c; q[1] = d; q[2] = a; q[3] = b;
+      side = 1;
+    } else {
+      /* c,d,b,e: e replaces a */
+      *a = n->e;
+      q[0] = c; q[1] = d; q[2] = b; q[3] = a;
+      side = 0;
+    }
+    if (k == D) break;
+    ch = k < SSLEVELS ? LOADPTR(n->child[side]) : 0;
+    if (ch == 0 && (k >= SSLEVELS || (ch = newnode(w, n, side, q)) == 0)) {
+      /* the tree is full, so do the rest with the tetrahedron cache */
+      w->ttn = k-1;
+      w->tfull += k < SSLEVELS;
+      hi = w->ssDepth == D ? (w->ssn < D-k ? w->ssn : D-k-1) : 0;
+      if (hi>0 && inside(w->ss[hi], x,y,z)) {
+	lo = 1;
+	while (lo<hi) {
+	  mid = (lo+hi)/2;
+	  if (inside(w->ss[mid], x,y,z)) hi = mid;
+	  else lo = mid+1;
+	}
+	w->ssskipped += D-k-hi;
+	t[0] = w->ss[hi][0]; t[1] = w->ss[hi][1];
+	t[2] = w->ss[hi][2]; t[3] = w->ss[hi][3];
+	return(planeti(w, t, x,y,z, hi));
       }
+      w->ssn = D-k < SSLEVELS ? D-k : SSLEVELS-1;
+      w->ssDepth = D;
+      t[0] = *q[0]; t[1] = *q[1]; t[2] = *q[2]; t[3] = *q[3];
+      return(planeti(w, t, x,y,z, D-k));
+    }
+    n = w->tt[k] = ch;
+    w->ttv[k][0] = *q[0]; w->ttv[k][1] = *q[1];
+    w->ttv[k][2] = *q[2]; w->ttv[k][3] = *q[3];
   }
-  fclose(outfile);
+  w->ttn = D-1 < SSLEVELS ? D-1 : SSLEVELS-1;
+  COUNTLEVEL(w, 0); /* all levels were in the tree */
+
+  /* level 0 */
+  if (ctx->doshade>0) w->shade = leafshade(ctx, q[0],q[1],q[2],q[3], x,y,z, w->grad);
+  return((q[0]->h+q[1]->h+q[2]->h+q[3]->h)/4);
+}
+
+/* Make the tree if ctx->tree_mb asks for one.  An existing tree is */
+/* kept if it was made with the same seed and world parameters */
+
+static int maketree(planet_ctx *ctx)
+{
+  struct planet_tree *tr = ctx->tree;
+  vertex *q[4];
+
+  if (tr != 0 &&
+      (ctx->tree_mb <= 0.0 || ctx->view == 'f' || ctx->recursive ||
+       tr->r1 != ctx->r1 || tr->r2 != ctx->r2 || tr->r3 != ctx->r3 ||
+       tr->r4 != ctx->r4 || tr->M != ctx->M || tr->dd1 != ctx->dd1 ||
+       tr->dd2 != ctx->dd2 || tr->POW != ctx->POW))
+    freetree(ctx);
+  if (ctx->tree_mb <= 0.0 || ctx->view == 'f' || ctx->recursive)
+    return(0);
+  if ((tr = ctx->tree) == 0) {
+    tr = (struct planet_tree*)calloc(1,sizeof(struct planet_tree));
+    if (tr == 0) return(-1);
+    roottetra(ctx, tr->t);
+    q[0] = &tr->t[0]; q[1] = &tr->t[1]; q[2] = &tr->t[2]; q[3] = &tr->t[3];
+    cuttetra(ctx, &tr->root, q);
+    tr->r1 = ctx->r1; tr->r2 = ctx->r2; tr->r3 = ctx->r3; tr->r4 = ctx->r4;
+    tr->M = ctx->M; tr->dd1 = ctx->dd1; tr->dd2 = ctx->dd2; tr->POW = ctx->POW;
+    ctx->tree = tr;
+  }
+  tr->max = (long)(ctx->tree_mb*1048576.0/sizeof(tnode));
+  return(0);
+}
+
+static void freetree(planet_ctx *ctx)
+{
+  tslab *sl;
+
+  if (ctx->tree == 0) return;
+  while ((sl = ctx->tree->slabs) != 0) {
+    ctx->tree->slabs = sl->next;
+    free(sl);
+  }
+  free(ctx->tree);
+  ctx->tree = 0;
 }
 
-void printppmBW(outfile) /* prints picture in b/w PPM format */
-FILE *outfile;
+/* Put n and the nodes below it on the free list, returning their number */
+
+static long freenodes(struct planet_tree *tr, tnode *n)
 {
-  int i,j,c;
+  long k;
+
+  if (n == 0) return(0);
+  k = freenodes(tr, n->child[0]) + freenodes(tr, n->child[1]) + 1;
+  n->child[0] = tr->free;
+  tr->free = n;
+  return(k);
+}
+
+/* Free the nodes below n (which is depth levels down) that were not */
+/* used in render gen or are more than maxdepth levels down */
 
-  fprintf(outfile,"P6\n");
-  fprintf(outfile,"#fractal planet image\n");
-  fprintf(outfile,"%d %d 1\n",Width,Height);
- 
-  for (j=0; j<Height; j++)
-    for (i=0; i<Width; i++) {
-      if (col[i][j] < WHITE)
-	c=0;
-      else c=1;
-      putc(c,outfile);
-      putc(c,outfile);
-      putc(c,outfile);
+static long prunenodes(struct planet_tree *tr, tnode *n, unsigned gen,
+		       int depth, int maxdepth)
+{
+  long k = 0;
+  int i;
+
+  for (i=0; i<2; i++)
+    if (n->child[i] != 0) {
+      if ((gen != 0 && n->child[i]->gen != gen) || depth+1 > maxdepth) {
+	k += freenodes(tr, n->child[i]);
+	n->child[i] = 0;
+      } else
+	k += prunenodes(tr, n->child[i], gen, depth+1, maxdepth);
     }
-  fclose(outfile);
+  return(k);
 }
- 
-void printbmp(outfile) /* prints picture in BMP format */
-FILE *outfile;
+
+static void countnodes(tnode *n, int depth, long *count)
 {
-  int i,j,c,s, W1;
+  if (n == 0) return;
+  count[depth]++;
+  countnodes(n->child[0], depth+1, count);
+  countnodes(n->child[1], depth+1, count);
+}
 
-  fprintf(outfile,"BM");
+/* Take back the nodes the threads have not used */
 
-  W1 = (3*Width+3);
-  W1 -= W1 % 4;
-  s = 54+W1*Height; /* file size */
-  putc(s&255,outfile);
-  putc((s>>8)&255,outfile);
-  putc((s>>16)&255,outfile);
-  putc(s>>24,outfile);
-
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(54,outfile); /* offset to data */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(40,outfile); /* size of infoheader */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(Width&255,outfile);
-  putc((Width>>8)&255,outfile);
-  putc((Width>>16)&255,outfile);
-  putc(Width>>24,outfile);
-
-  putc(Height&255,outfile);
-  putc((Height>>8)&255,outfile);
-  putc((Height>>16)&255,outfile);
-  putc(Height>>24,outfile);
-
-  putc(1,outfile);  /* no. of planes = 1 */
-  putc(0,outfile);
-
-  putc(24,outfile);  /* bpp */
-  putc(0,outfile);  
-
-  putc(0,outfile); /* no compression */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* image size (unspecified) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* h. pixels/m */
-  putc(32,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* v. pixels/m */
-  putc(32,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* colours used (unspecified) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-
-  putc(0,outfile); /* important colours (all) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  if (doshade) {
-    for (j=Height-1; j>=0; j--) {
-      for (i=0; i<Width; i++) {
-	s =shades[i][j];
-	c = s*btable[col[i][j]]/150;
-	if (c>255) c=255;
-	putc(c,outfile);
-	c = s*gtable[col[i][j]]/150;
-	if (c>255) c=255;
-	putc(c,outfile);
-	c = s*rtable[col[i][j]]/150;
-	if (c>255) c=255;
-	putc(c,outfile);
-      }
-      for (i=3*Width; i<W1; i++) putc(0,outfile);
+static void returnnodes(planet_ctx *ctx)
+{
+  struct planet_tree *tr = ctx->tree;
+  worker *w;
+  tnode *n;
+  int i;
+
+  if (tr == 0) return;
+  for (i=0; i<ctx->nworkers; i++) {
+    w = &ctx->workers[i];
+    while ((n = w->pool) != 0) {
+      w->pool = n->child[0];
+      n->child[0] = tr->free;
+      tr->free = n;
     }
-  } else {
-    for (j=Height-1; j>=0; j--) {
-      for (i=0; i<Width; i++) {
-	putc(btable[col[i][j]],outfile);
-	putc(gtable[col[i][j]],outfile);
-	putc(rtable[col[i][j]],outfile);
+    tr->used -= w->npool;
+    w->npool = 0;
+    w->nomore = 0;
+    w->ttn = 0;
+  }
+}
+
+/* Called at the end of a render: keep the tree within 3/4 of its budget */
+
+static void prunetree(planet_ctx *ctx)
+{
+  struct planet_tree *tr = ctx->tree;
+  long count[SSLEVELS], keep;
+  int depth;
+
+  returnnodes(ctx);
+  if (tr->used <= tr->max/4*3) return;
+  tr->used -= prunenodes(tr, &tr->root, tr->gen, 0, SSLEVELS);
+  if (tr->used <= tr->max/4*3) return;
+  /* find how many levels can be kept */
+  memset(count, 0, sizeof(count));
+  countnodes(&tr->root, 0, count);
+  keep = count[0] = 0; /* the root is not counted in used */
+  for (depth = 0; depth < SSLEVELS-1; depth++)
+    if ((keep += count[depth+1]) > tr->max/4*3) break;
+  tr->used -= prunenodes(tr, &tr->root, 0, 0, depth);
+}
+
+/* The sphere grid.  With ctx->sphere_n = n > 0, the altitude and the */
+/* gradient for shading are computed once at the points of a grid on */
+/* the sphere, and planet1() interpolates every other point from the 4 */
+/* around it.  The grid is kept while the seed and world parameters */
+/* stay the same, so further maps of the planet, in any projection, */
+/* cost no subdivisions.  It is a cube projected onto the sphere by */
+/* angle (equiangular), whose cells differ by at most 1.3 times in area, */
+/* and the points are subdivided as deep as a Mercator map of height 2n */
+
+static double spherepoint(worker *w, double x, double y, double z)
+{
+  planet_ctx *ctx = w->ctx;
+  struct planet_sphere *sp = ctx->sphere;
+  double p[3], u, v, f[4], g[3], alt;
+  float *q[4];
+  int n = sp->n, m, i, j, k;
+
+  p[0] = x; p[1] = y; p[2] = z;
+  if (fabs(x) >= fabs(y)) m = fabs(x) >= fabs(z) ? 0 : 2;
+  else m = fabs(y) >= fabs(z) ? 1 : 2;
+  if (p[m] == 0.0) return(0.0); /* not on the sphere */
+  u = (atan(p[(m+1)%3]/fabs(p[m]))/(0.25*PI)+1.0)*0.5*n;
+  v = (atan(p[(m+2)%3]/fabs(p[m]))/(0.25*PI)+1.0)*0.5*n;
+  i = (int)u; if (i < 0) i = 0; if (i > n-1) i = n-1;
+  j = (int)v; if (j < 0) j = 0; if (j > n-1) j = n-1;
+  u -= i; v -= j;
+  f[0] = (1.0-u)*(1.0-v); f[1] = u*(1.0-v); f[2] = (1.0-u)*v; f[3] = u*v;
+  q[0] = sp->p+((size_t)((2*m+(p[m]<0.0))*(n+1)+j)*(n+1)+i)*sp->stride;
+  q[1] = q[0]+sp->stride;
+  q[2] = q[0]+(n+1)*sp->stride;
+  q[3] = q[2]+sp->stride;
+  alt = f[0]*q[0][0]+f[1]*q[1][0]+f[2]*q[2][0]+f[3]*q[3][0];
+  if (ctx->doshade>0) {
+    for (k=0; k<3; k++)
+      g[k] = f[0]*q[0][k+1]+f[1]*q[1][k+1]+f[2]*q[2][k+1]+f[3]*q[3][k+1];
+    w->shade = gradshade(ctx, g, alt, x,y,z);
+  }
+  return(alt);
+}
+
+/* Threads take a row of a face at a time.  Row r is row r%(n+1) of */
+/* face r/(n+1), which is the side of axis face/2 with sign (-1)^face */
+
+static void *sphere_worker(void *arg)
+{
+  worker *w = (worker*)arg;
+  planet_ctx *ctx = w->ctx;
+  struct planet_sphere *sp = ctx->sphere;
+  double p[3], l;
+  float *q;
+  int n = sp->n, r, i, m;
+
+  for (;;) {
+    LOCK(ctx);
+    r = ctx->next_row++;
+    UNLOCK(ctx);
+    if (r >= 6*(n+1)) break;
+    m = r/(n+1)/2;
+    w->Depth = sp->depth;
+    ssclear(w);
+    for (i=0; i<=n; i++) {
+      p[m] = (r/(n+1))%2 ? -1.0 : 1.0;
+      p[(m+1)%3] = tan((2.0*i/n-1.0)*0.25*PI);
+      p[(m+2)%3] = tan((2.0*(r%(n+1))/n-1.0)*0.25*PI);
+      l = sqrt(p[0]*p[0]+p[1]*p[1]+p[2]*p[2]);
+      q = sp->p+((size_t)r*(n+1)+i)*sp->stride;
+      q[0] = (float)planet1(w, p[0]/l,p[1]/l,p[2]/l);
+      if (sp->stride > 1) {
+	q[1] = (float)w->grad[0];
+	q[2] = (float)w->grad[1];
+	q[3] = (float)w->grad[2];
       }
-      for (i=3*Width; i<W1; i++) putc(0,outfile);
     }
   }
-  fclose(outfile);
+  return(arg);
+}
+
+/* Make the grid if ctx->sphere_n asks for one, keeping one made with */
+/* the same parameters.  Called by planet_setup() once the workers are */
+/* made */
+
+static int makesphere(planet_ctx *ctx)
+{
+  struct planet_sphere *sp = ctx->sphere;
+  int n = ctx->sphere_n, doshade = ctx->doshade == 2 ? 1 : ctx->doshade;
+
+  if (ctx->view == 'f' || ctx->recursive) n = 0;
+  if (sp != 0 &&
+      (n <= 0 || sp->n != n || sp->doshade != doshade ||
+       sp->r1 != ctx->r1 || sp->r2 != ctx->r2 || sp->r3 != ctx->r3 ||
+       sp->r4 != ctx->r4 || sp->M != ctx->M || sp->dd1 != ctx->dd1 ||
+       sp->dd2 != ctx->dd2 || sp->POW != ctx->POW))
+    freesphere(ctx);
+  if (n <= 0 || ctx->sphere != 0) return(0);
+  sp = (struct planet_sphere*)calloc(1,sizeof(struct planet_sphere));
+  if (sp == 0) return(-1);
+  sp->n = n;
+  sp->stride = doshade > 0 ? 4 : 1;
+  sp->depth = 3*((int)(log_2(2.0*n)))+6;
+  sp->doshade = doshade;
+  sp->p = (float*)malloc((size_t)6*(n+1)*(n+1)*sp->stride*sizeof(float));
+  if (sp->p == 0) { free(sp); return(-1); }
+  sp->r1 = ctx->r1; sp->r2 = ctx->r2; sp->r3 = ctx->r3; sp->r4 = ctx->r4;
+  sp->M = ctx->M; sp->dd1 = ctx->dd1; sp->dd2 = ctx->dd2; sp->POW = ctx->POW;
+  ctx->sphere = sp;
+  run_rows(ctx, sphere_worker, 0);
+  sp->ready = 1;
+  return(0);
 }
 
-void printbmpBW(outfile) /* prints picture in b/w BMP format */
-FILE *outfile;
+static void freesphere(planet_ctx *ctx)
 {
-  int i,j,c,s, W1;
+  if (ctx->sphere == 0) return;
+  free(ctx->sphere->p);
+  free(ctx->sphere);
+  ctx->sphere = 0;
+}
+
+/* Keep the samples of orthographic maps if ctx->reuse asks for it, */
+/* and those of the last map if this one is of the same planet, size */
+/* and depth.  Called by planet_setup() */
+
+static int makeframe(planet_ctx *ctx)
+{
+  struct planet_frame *fr = ctx->frame;
+  size_t n = (size_t)ctx->Width*ctx->Height;
+
+  /* not with the options that need every pixel exact or subdivided */
+  /* to its own depth, nor with a map that is not held whole */
+  if (ctx->reuse <= 0.0 || ctx->view != 'o' || ctx->adaptive ||
+      ctx->pixeldepth || ALTFILE(ctx) || ctx->rowmax != ctx->Height) {
+    freeframe(ctx);
+    return(0);
+  }
+  if (fr != 0 &&
+      (fr->Width != ctx->Width || fr->Height != ctx->Height ||
+       fr->Depth != ctx->Depth || fr->doshade != ctx->doshade ||
+       fr->shade_angle != ctx->shade_angle ||
+       fr->shade_angle2 != ctx->shade_angle2 || fr->latic != ctx->latic ||
+       fr->SEA != ctx->SEA || fr->LAND != ctx->LAND ||
+       fr->HIGHEST != ctx->HIGHEST || fr->sphere_n != ctx->sphere_n ||
+       fr->r1 != ctx->r1 || fr->r2 != ctx->r2 || fr->r3 != ctx->r3 ||
+       fr->r4 != ctx->r4 || fr->M != ctx->M || fr->dd1 != ctx->dd1 ||
+       fr->dd2 != ctx->dd2 || fr->POW != ctx->POW))
+    freeframe(ctx);
+  if (ctx->frame == 0) {
+    fr = (struct planet_frame*)calloc(1,sizeof(struct planet_frame));
+    if (fr == 0) return(-1);
+    fr->last = (fsample*)malloc(n*sizeof(fsample));
+    fr->next = (fsample*)malloc(n*sizeof(fsample));
+    if (fr->last == 0 || fr->next == 0) {
+      free(fr->last); free(fr->next); free(fr);
+      return(-1);
+    }
+    fr->Width = ctx->Width; fr->Height = ctx->Height; fr->Depth = ctx->Depth;
+    fr->doshade = ctx->doshade; fr->latic = ctx->latic;
+    fr->shade_angle = ctx->shade_angle; fr->shade_angle2 = ctx->shade_angle2;
+    fr->SEA = ctx->SEA; fr->LAND = ctx->LAND; fr->HIGHEST = ctx->HIGHEST;
+    fr->sphere_n = ctx->sphere_n;
+    fr->r1 = ctx->r1; fr->r2 = ctx->r2; fr->r3 = ctx->r3; fr->r4 = ctx->r4;
+    fr->M = ctx->M; fr->dd1 = ctx->dd1; fr->dd2 = ctx->dd2; fr->POW = ctx->POW;
+    ctx->frame = fr;
+  }
+  ctx->marks = (unsigned char*)malloc(n);
+  if (ctx->marks == 0) return(-1);
+  return(0);
+}
+
+static void freeframe(planet_ctx *ctx)
+{
+  if (ctx->frame == 0) return;
+  free(ctx->frame->last);
+  free(ctx->frame->next);
+  free(ctx->frame);
+  ctx->frame = 0;
+}
+
+/* Before an orthographic map is rendered, take the colour and shade of */
+/* each pixel on the planet from the sample of the last map whose point */
+/* is now at most ctx->reuse pixels from it, and mark the others to be */
+/* computed.  The sample is looked for around where the last map showed */
+/* the point of the pixel, and as each keeps its own point, the error */
+/* stays below ctx->reuse pixels however many maps pass it on.  Points */
+/* newly turned into view, and all of a map of a different depth (see */
+/* makeframe()), are computed */
+
+static void reuseframe(planet_ctx *ctx)
+{
+  struct planet_frame *fr = ctx->frame;
+  fsample *s, *best;
+  double x,y,z,x1,y1,z1,px,py,pz,d,dmin,tol2 = ctx->reuse*ctx->reuse;
+  double hs = ctx->Height*ctx->scale, hs0 = ctx->Height*fr->scale;
+  int i,j,k,l,pi,pj,W = ctx->Width,H = ctx->Height;
+
+  for (k = 0; k < W*H; k++) fr->next[k].x = NOALT;
+  memset(ctx->marks, SAMPLE, (size_t)W*H);
+  if (!fr->ready) return;
+  for (j = 0; j < H; j++)
+    for (i = 0; i < W; i++) {
+      x = (2.0*i-W)/hs;
+      y = (2.0*j-H)/hs;
+      if (x*x+y*y>1.0) continue; /* background */
+      z = sqrt(1.0-x*x-y*y);
+      x1 = ctx->clo*x+ctx->slo*ctx->sla*y+ctx->slo*ctx->cla*z;
+      y1 = ctx->cla*y-ctx->sla*z;
+      z1 = -ctx->slo*x+ctx->clo*ctx->sla*y+ctx->clo*ctx->cla*z;
+      /* the point in the view of the last map */
+      pz = fr->slo*fr->cla*x1-fr->sla*y1+fr->clo*fr->cla*z1;
+      if (pz <= 0.0) continue;
+      px = fr->clo*x1-fr->slo*z1;
+      py = fr->slo*fr->sla*x1+fr->cla*y1+fr->clo*fr->sla*z1;
+      pi = (int)floor(0.5*(px*hs0+W)+0.5);
+      pj = (int)floor(0.5*(py*hs0+H)+0.5);
+      best = 0;
+      dmin = tol2;
+      for (l = pj-1; l <= pj+1; l++)
+	for (k = pi-1; k <= pi+1; k++) {
+	  if (k < 0 || k >= W || l < 0 || l >= H) continue;
+	  s = &fr->last[l*W+k];
+	  if (s->x != s->x) continue; /* no point */
+	  /* the sample's point in the view of this map */
+	  z1 = ctx->slo*ctx->cla*s->x-ctx->sla*s->y+ctx->clo*ctx->cla*s->z;
+	  if (z1 <= 0.0) continue;
+	  x1 = ctx->clo*s->x-ctx->slo*s->z;
+	  y1 = ctx->slo*ctx->sla*s->x+ctx->cla*s->y+ctx->clo*ctx->sla*s->z;
+	  x1 = 0.5*(x1*hs+W)-i;
+	  y1 = 0.5*(y1*hs+H)-j;
+	  d = x1*x1+y1*y1;
+	  if (d <= dmin) {
+	    dmin = d;
+	    best = s;
+	  }
+	}
+      if (best == 0) continue;
+      fr->next[j*W+i] = *best;
+      ctx->col[j][i] = best->col;
+      if (ctx->doshade>0) ctx->shades[j][i] = best->shade;
+      ctx->marks[j*W+i] = KNOWN;
+      ctx->reused++;
+    }
+}
+
+/* After a map is rendered, keep its samples and view for the next */
+
+static void keepframe(planet_ctx *ctx)
+{
+  struct planet_frame *fr = ctx->frame;
+  fsample *s;
+
+  s = fr->last; fr->last = fr->next; fr->next = s;
+  fr->cla = ctx->cla; fr->sla = ctx->sla;
+  fr->clo = ctx->clo; fr->slo = ctx->slo;
+  fr->scale = ctx->scale;
+  fr->ready = 1;
+}
+
+static void roottetra(planet_ctx *ctx, vertex *t)
+{
+  /* initial altitude is M on all corners of tetrahedron */
+  t[0].h = t[1].h = t[2].h = t[3].h = ctx->M;
+  /* same seed set is used in every call */
+  t[0].s = ctx->r1; t[1].s = ctx->r2; t[2].s = ctx->r3; t[3].s = ctx->r4;
+  /* coordinates of vertices of tetrahedron*/
+  t[0].x = -sqrt(3.0)-0.20; t[0].y = -sqrt(3.0)-0.22; t[0].z = -sqrt(3.0)-0.23;
+  t[1].x = -sqrt(3.0)-0.19; t[1].y =  sqrt(3.0)+0.18; t[1].z =  sqrt(3.0)+0.17;
+  t[2].x =  sqrt(3.0)+0.21; t[2].y = -sqrt(3.0)-0.24; t[2].z =  sqrt(3.0)+0.15;
+  t[3].x =  sqrt(3.0)+0.24; t[3].y =  sqrt(3.0)+0.22; t[3].z = -sqrt(3.0)-0.25;
+}
+
+static double rand2(double p, double q)
+/* random number generator taking two seeds */
+/* rand2(p,q) = rand2(q,p) is important     */
+{
+  double r;
+  r = (p+3.14159265)*(q+3.14159265);
+  return(2.*(r-(int)r)-1.);
+}
 
-  fprintf(outfile,"BM");
+/* The writers encode the rows with a row function, which stores row */
+/* j at buf and returns its length, at most rowbytes(ctx) bytes. */
+/* writebody() has the threads encode OUTBYTES of rows at a time and */
+/* writes them with one fwrite() */
 
-  W1 = (Width+31);
+static int rowbytes(planet_ctx *ctx)
+{
+  if (ctx->view == 'h') return(12*ctx->Width+1); /* "-2147483648 " */
+  if (ctx->file_type == png) return(9*ctx->Width+1); /* see pngrow() */
+  return(4*ctx->Width+4); /* XPM with 4 letters per pixel */
+}
+
+static void *out_worker(void *arg)
+{
+  worker *w = (worker*)arg;
+  planet_ctx *ctx = w->ctx;
+  int k;
+
+  for (;;) {
+    LOCK(ctx);
+    k = ctx->next_row++;
+    UNLOCK(ctx);
+    if (k >= ctx->outn) break;
+    ctx->outlen[k] = ctx->out_proc(ctx, ctx->outj+k*ctx->outdj,
+				   ctx->outbuf+(size_t)k*ctx->outstride);
+  }
+  return(arg);
+}
+
+/* Encode rows outj+k*outdj for k < outn one after the other in */
+/* outbuf; returns their length */
+
+static long encoderows(planet_ctx *ctx)
+{
+  unsigned char *p, *q;
+  int k, size = ctx->outstride;
+
+  if (ctx->outn > 1) run_rows(ctx, out_worker, 0);
+  else {
+    ctx->next_row = 0;
+    out_worker(&ctx->workers[0]);
+  }
+  p = ctx->outbuf;
+  for (k = 0; k < ctx->outn; k++) { /* close the gaps between rows */
+    q = ctx->outbuf+(size_t)k*size;
+    if (p != q) memmove(p, q, ctx->outlen[k]);
+    p += ctx->outlen[k];
+  }
+  return(p-ctx->outbuf);
+}
+
+/* Write rows j0..j1-1 with row function proc, bottom-up if down */
+
+static void writebody(planet_ctx *ctx, FILE *outfile, int j0, int j1,
+		      int (*proc)(planet_ctx *, int, unsigned char *),
+		      int down)
+{
+  long len;
+  int b, n = j1-j0;
+
+  ctx->out_proc = proc;
+  ctx->outdj = down ? -1 : 1;
+  for (b = 0; b < n; b += ctx->outn) {
+    ctx->outn = n-b < ctx->outrows ? n-b : ctx->outrows;
+    ctx->outj = down ? j1-1-b : j0+b;
+    len = encoderows(ctx);
+    fwrite(ctx->outbuf, 1, len, outfile);
+    ctx->outbytes += len;
+  }
+}
+
+static int ppmrow(planet_ctx *ctx, int j, unsigned char *buf)
+{
+  unsigned short *col = ctx->col[j];
+  unsigned char *p = buf;
+  int i,c,s;
+
+  if (ctx->doshade) {
+    for (i=0; i<ctx->Width; i++) {
+      s = ctx->shades[j][i];
+      c = s*ctx->rtable[col[i]]/150;
+      *p++ = c>255 ? 255 : c;
+      c = s*ctx->gtable[col[i]]/150;
+      *p++ = c>255 ? 255 : c;
+      c = s*ctx->btable[col[i]]/150;
+      *p++ = c>255 ? 255 : c;
+    }
+  } else
+    for (i=0; i<ctx->Width; i++) {
+      *p++ = ctx->rtable[col[i]];
+      *p++ = ctx->gtable[col[i]];
+      *p++ = ctx->btable[col[i]];
+    }
+  return(p-buf);
+}
+
+static void printppm(planet_ctx *ctx, FILE *outfile, int j0, int j1)
+/* prints picture in PPM (portable pixel map) format */
+{
+  if (j0 == 0) {
+    fprintf(outfile,"P6\n");
+    fprintf(outfile,"#fractal planet image\n");
+    fprintf(outfile,"%d %d 255\n",ctx->Width,ctx->Height);
+  }
+  writebody(ctx, outfile, j0, j1, ppmrow, 0);
+}
+
+static int ppmrowBW(planet_ctx *ctx, int j, unsigned char *buf)
+{
+  unsigned char *p = buf;
+  int i,c;
+
+  for (i=0; i<ctx->Width; i++) {
+    c = ctx->col[j][i] < WHITE ? 0 : 1;
+    *p++ = c; *p++ = c; *p++ = c;
+  }
+  return(p-buf);
+}
+
+static void printppmBW(planet_ctx *ctx, FILE *outfile, int j0, int j1)
+/* prints picture in b/w PPM format */
+{
+  if (j0 == 0) {
+    fprintf(outfile,"P6\n");
+    fprintf(outfile,"#fractal planet image\n");
+    fprintf(outfile,"%d %d 1\n",ctx->Width,ctx->Height);
+  }
+  writebody(ctx, outfile, j0, j1, ppmrowBW, 0);
+}
+
+static int bmprow(planet_ctx *ctx, int j, unsigned char *buf)
+{
+  unsigned short *col = ctx->col[j];
+  unsigned char *p = buf;
+  int i,c,s, W1;
+
+  W1 = (3*ctx->Width+3);
+  W1 -= W1 % 4;
+  if (ctx->doshade) {
+    for (i=0; i<ctx->Width; i++) {
+      s = ctx->shades[j][i];
+      c = s*ctx->btable[col[i]]/150;
+      *p++ = c>255 ? 255 : c;
+      c = s*ctx->gtable[col[i]]/150;
+      *p++ = c>255 ? 255 : c;
+      c = s*ctx->rtable[col[i]]/150;
+      *p++ = c>255 ? 255 : c;
+    }
+  } else
+    for (i=0; i<ctx->Width; i++) {
+      *p++ = ctx->btable[col[i]];
+      *p++ = ctx->gtable[col[i]];
+      *p++ = ctx->rtable[col[i]];
+    }
+  for (i=3*ctx->Width; i<W1; i++) *p++ = 0;
+  return(p-buf);
+}
+
+static void printbmp(planet_ctx *ctx, FILE *outfile, int j0, int j1)
+/* prints picture in BMP format */
+{
+  int W1;
+  unsigned long size;
+
+  W1 = (3*ctx->Width+3);
+  W1 -= W1 % 4;
+
+  if (j1 == ctx->Height) { /* the last row is written first */
+    fprintf(outfile,"BM");
+
+    size = 54+(unsigned long)W1*ctx->Height; /* file size */
+    putc(size&255,outfile);
+    putc((size>>8)&255,outfile);
+    putc((size>>16)&255,outfile);
+    putc((size>>24)&255,outfile);
+
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(54,outfile); /* offset to data */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(40,outfile); /* size of infoheader */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(ctx->Width&255,outfile);
+    putc((ctx->Width>>8)&255,outfile);
+    putc((ctx->Width>>16)&255,outfile);
+    putc(ctx->Width>>24,outfile);
+
+    putc(ctx->Height&255,outfile);
+    putc((ctx->Height>>8)&255,outfile);
+    putc((ctx->Height>>16)&255,outfile);
+    putc(ctx->Height>>24,outfile);
+
+    putc(1,outfile);  /* no. of planes = 1 */
+    putc(0,outfile);
+
+    putc(24,outfile);  /* bpp */
+    putc(0,outfile);  
+
+    putc(0,outfile); /* no compression */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(0,outfile); /* image size (unspecified) */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(0,outfile); /* h. pixels/m */
+    putc(32,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(0,outfile); /* v. pixels/m */
+    putc(32,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(0,outfile); /* colours used (unspecified) */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+
+    putc(0,outfile); /* important colours (all) */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+  }
+  writebody(ctx, outfile, j0, j1, bmprow, 1);
+}
+
+static int bmprowBW(planet_ctx *ctx, int j, unsigned char *buf)
+{
+  unsigned short *col = ctx->col[j];
+  unsigned char *p = buf;
+  int i,k,c, W1;
+
+  W1 = (ctx->Width+31);
+  W1 -= W1 % 32;
+  for (i=0; i<W1; i+=8) {
+    c = 0;
+    for (k=0; k<8; k++)
+      if (i+k<ctx->Width && col[i+k] >= WHITE) c += 128>>k;
+    *p++ = c;
+  }
+  return(p-buf);
+}
+
+static void printbmpBW(planet_ctx *ctx, FILE *outfile, int j0, int j1)
+/* prints picture in b/w BMP format */
+{
+  int W1;
+  unsigned long size;
+
+  W1 = (ctx->Width+31);
   W1 -= W1 % 32;
-  s = 62+(W1*Height)/8; /* file size */
-  putc(s&255,outfile);
-  putc((s>>8)&255,outfile);
-  putc((s>>16)&255,outfile);
-  putc(s>>24,outfile);
-
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(62,outfile); /* offset to data */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(40,outfile); /* size of infoheader */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(Width&255,outfile);
-  putc((Width>>8)&255,outfile);
-  putc((Width>>16)&255,outfile);
-  putc(Width>>24,outfile);
-
-  putc(Height&255,outfile);
-  putc((Height>>8)&255,outfile);
-  putc((Height>>16)&255,outfile);
-  putc(Height>>24,outfile);
-
-  putc(1,outfile);  /* no. of planes = 1 */
-  putc(0,outfile);
-
-  putc(1,outfile);  /* bpp */
-  putc(0,outfile);  
-
-  putc(0,outfile); /* no compression */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* image size (unspecified) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* h. pixels/m */
-  putc(32,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* v. pixels/m */
-  putc(32,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(2,outfile); /* colours used */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-
-  putc(2,outfile); /* important colours (2) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* colour 0 = black */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(255,outfile); /* colour 1 = white */
-  putc(255,outfile);
-  putc(255,outfile);
-  putc(255,outfile);
-
-  for (j=Height-1; j>=0; j--)
-    for (i=0; i<W1; i+=8) {
-      if (i<Width && col[i][j] >= WHITE)
-	c=128;
-      else c=0;
-      if (i+1<Width && col[i+1][j] >= WHITE)
-	c+=64;
-      if (i+2<Width && col[i+2][j] >= WHITE)
-	c+=32;
-      if (i+3<Width && col[i+3][j] >= WHITE)
-	c+=16;
-      if (i+4<Width && col[i+4][j] >= WHITE)
-	c+=8;
-      if (i+5<Width && col[i+5][j] >= WHITE)
-	c+=4;
-      if (i+6<Width && col[i+6][j] >= WHITE)
-	c+=2;
-      if (i+7<Width && col[i+7][j] >= WHITE)
-	c+=1;
-      putc(c,outfile);
-    }
-  fclose(outfile);
-}
-
-char *nletters(int n, int c)
+
+  if (j1 == ctx->Height) { /* the last row is written first */
+    fprintf(outfile,"BM");
+
+    size = 62+(unsigned long)W1*ctx->Height/8; /* file size */
+    putc(size&255,outfile);
+    putc((size>>8)&255,outfile);
+    putc((size>>16)&255,outfile);
+    putc((size>>24)&255,outfile);
+
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(62,outfile); /* offset to data */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(40,outfile); /* size of infoheader */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(ctx->Width&255,outfile);
+    putc((ctx->Width>>8)&255,outfile);
+    putc((ctx->Width>>16)&255,outfile);
+    putc(ctx->Width>>24,outfile);
+
+    putc(ctx->Height&255,outfile);
+    putc((ctx->Height>>8)&255,outfile);
+    putc((ctx->Height>>16)&255,outfile);
+    putc(ctx->Height>>24,outfile);
+
+    putc(1,outfile);  /* no. of planes = 1 */
+    putc(0,outfile);
+
+    putc(1,outfile);  /* bpp */
+    putc(0,outfile);  
+
+    putc(0,outfile); /* no compression */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(0,outfile); /* image size (unspecified) */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(0,outfile); /* h. pixels/m */
+    putc(32,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(0,outfile); /* v. pixels/m */
+    putc(32,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(2,outfile); /* colours used */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+
+    putc(2,outfile); /* important colours (2) */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(0,outfile); /* colour 0 = black */
+    putc(0,outfile);
+    putc(0,outfile);
+    putc(0,outfile);
+
+    putc(255,outfile); /* colour 1 = white */
+    putc(255,outfile);
+    putc(255,outfile);
+    putc(255,outfile);
+  }
+  writebody(ctx, outfile, j0, j1, bmprowBW, 1);
+}
+
+static char *nletters(int n, int c, char *buffer)
 {
   int i;
-  static char buffer[8];
-  
+
   buffer[n] = '\0';
 
   for (i = n-1; i >= 0; i--)
@@ -1897,146 +4213,835 @@ char *nletters(int n, int c)
   return buffer;
 }
 
-void printxpm(outfile) /* prints picture in XPM (X-windows pixel map) format */
-FILE *outfile;
+static int xpmletters(planet_ctx *ctx) /* letters per pixel */
 {
-  int x,y,i,nbytes;
+  int x, nbytes;
 
-  x = nocols - 1;
+  x = ctx->nocols - 1;
   for (nbytes = 0; x != 0; nbytes++)
     x >>= 5;
-  
-  fprintf(outfile,"/* XPM */\n");
-  fprintf(outfile,"static char *xpmdata[] = {\n");
-  fprintf(outfile,"/* width height ncolors chars_per_pixel */\n");
-  fprintf(outfile,"\"%d %d %d %d\",\n", Width, Height, nocols, nbytes);
-  fprintf(outfile,"/* colors */\n");
-  for (i = 0; i < nocols; i++)
-    fprintf(outfile,"\"%s c #%2.2X%2.2X%2.2X\",\n", 
-	    nletters(nbytes, i), rtable[i], gtable[i], btable[i]);
+  return(nbytes);
+}
+
+static int xpmrow(planet_ctx *ctx, int j, unsigned char *buf)
+{
+  unsigned char *p = buf;
+  int i,k,c,nbytes = xpmletters(ctx);
+
+  *p++ = '"';
+  for (i=0; i<ctx->Width; i++) {
+    c = ctx->col[j][i];
+    for (k = nbytes-1; k >= 0; k--) { /* as nletters() */
+      p[k] = letters[c & 0x001F];
+      c >>= 5;
+    }
+    p += nbytes;
+  }
+  *p++ = '"'; *p++ = ','; *p++ = '\n';
+  return(p-buf);
+}
+
+static void printxpm(planet_ctx *ctx, FILE *outfile, int j0, int j1)
+/* prints picture in XPM (X-windows pixel map) format */
+{
+  int i,nbytes;
+  char buffer[8];
 
-  fprintf(outfile,"/* pixels */\n");
-  for (y = 0 ; y < Height; y++) {
-    fprintf(outfile,"\"");
-    for (x = 0; x < Width; x++)
-      fprintf(outfile, "%s", nletters(nbytes, col[x][y]));
-    fprintf(outfile,"\",\n");
+  nbytes = xpmletters(ctx);
+  
+  if (j0 == 0) {
+    fprintf(outfile,"/* XPM */\n");
+    fprintf(outfile,"static char *xpmdata[] = {\n");
+    fprintf(outfile,"/* width height ncolors chars_per_pixel */\n");
+    fprintf(outfile,"\"%d %d %d %d\",\n", ctx->Width, ctx->Height, ctx->nocols, nbytes);
+    fprintf(outfile,"/* colors */\n");
+    for (i = 0; i < ctx->nocols; i++)
+      fprintf(outfile,"\"%s c #%2.2X%2.2X%2.2X\",\n", 
+	      nletters(nbytes, i, buffer), ctx->rtable[i], ctx->gtable[i], ctx->btable[i]);
+
+    fprintf(outfile,"/* pixels */\n");
   }
-  fprintf(outfile,"};\n");
+  writebody(ctx, outfile, j0, j1, xpmrow, 0);
+  if (j1 == ctx->Height) fprintf(outfile,"};\n");
+
+}
+
+static int xpmrowBW(planet_ctx *ctx, int j, unsigned char *buf)
+{
+  unsigned char *p = buf;
+  int i;
 
-  fclose(outfile);
+  *p++ = '"';
+  for (i=0; i<ctx->Width; i++)
+    *p++ = ctx->col[j][i] < WHITE ? 'X' : '.';
+  *p++ = '"'; *p++ = ','; *p++ = '\n';
+  return(p-buf);
 }
 
-void printxpmBW(outfile) /* prints picture in XPM (X-windows pixel map) format */
-FILE *outfile;
+static void printxpmBW(planet_ctx *ctx, FILE *outfile, int j0, int j1)
+/* prints picture in XPM (X-windows pixel map) format */
 {
-  int x,y,nbytes;
+  int nbytes;
 
-  x = nocols - 1;
   nbytes = 1;
   
-  fprintf(outfile,"/* XPM */\n");
-  fprintf(outfile,"static char *xpmdata[] = {\n");
-  fprintf(outfile,"/* width height ncolors chars_per_pixel */\n");
-  fprintf(outfile,"\"%d %d %d %d\",\n", Width, Height, 2, nbytes);
-  fprintf(outfile,"/* colors */\n");
+  if (j0 == 0) {
+    fprintf(outfile,"/* XPM */\n");
+    fprintf(outfile,"static char *xpmdata[] = {\n");
+    fprintf(outfile,"/* width height ncolors chars_per_pixel */\n");
+    fprintf(outfile,"\"%d %d %d %d\",\n", ctx->Width, ctx->Height, 2, nbytes);
+    fprintf(outfile,"/* colors */\n");
   
-  fprintf(outfile,"\". c #FFFFFF\",\n");
-  fprintf(outfile,"\"X c #000000\",\n");
+    fprintf(outfile,"\". c #FFFFFF\",\n");
+    fprintf(outfile,"\"X c #000000\",\n");
 
-  fprintf(outfile,"/* pixels */\n");
-  for (y = 0 ; y < Height; y++) {
-    fprintf(outfile,"\"");
-    for (x = 0; x < Width; x++)
-      fprintf(outfile, "%s",
-	      (col[x][y] < WHITE)
-	      ? "X" : ".");
-    fprintf(outfile,"\",\n");
+    fprintf(outfile,"/* pixels */\n");
   }
-  fprintf(outfile,"};\n");
+  writebody(ctx, outfile, j0, j1, xpmrowBW, 0);
+  if (j1 == ctx->Height) fprintf(outfile,"};\n");
 
-  fclose(outfile);
 }
 
-void printheights(outfile) /* prints heightfield */
-FILE *outfile;
+static int heightsrow(planet_ctx *ctx, int j, unsigned char *buf)
 {
-  int i,j;
+  unsigned char *p = buf, digits[12];
+  unsigned u;
+  int i,n,h;
+
+  for (i=0; i<ctx->Width; i++) { /* as fprintf("%d ") */
+    h = ctx->heights[j][i];
+    u = h < 0 ? 0u-(unsigned)h : (unsigned)h;
+    n = 0;
+    do {
+      digits[n++] = '0'+u%10;
+      u /= 10;
+    } while (u != 0);
+    if (h < 0) *p++ = '-';
+    while (n > 0) *p++ = digits[--n];
+    *p++ = ' ';
+  }
+  *p++ = '\n';
+  return(p-buf);
+}
 
-  for (j=0; j<Height; j++) {
-    for (i=0; i<Width; i++)
-      fprintf(outfile,"%d ",heights[i][j]);
-    putc('\n',outfile);
+static void printheights(planet_ctx *ctx, FILE *outfile, int j0, int j1)
+/* prints heightfield */
+{
+  writebody(ctx, outfile, j0, j1, heightsrow, 0);
+}
+
+/* Binary heightfields hold the altitude of each pixel: as 16-bit PGM */
+/* samples, PGMSEA at sea level and PGMSCALE per unit of altitude (0 */
+/* is not on the planet), or as little-endian 32-bit floats (NaN is */
+/* not on the planet), raw or in a NumPy .npy file */
+
+#define PGMSEA 32768
+#define PGMSCALE 100000.0
+
+static int pgmrow(planet_ctx *ctx, int j, unsigned char *buf)
+{
+  float *a = ctx->alts[j];
+  double v;
+  int i,h;
+
+  for (i=0; i<ctx->Width; i++) {
+    v = a[i];
+    if (v != v) h = 0;
+    else {
+      v = PGMSEA+floor(v*PGMSCALE+0.5);
+      h = v < 1.0 ? 1 : v > 65535.0 ? 65535 : (int)v;
+    }
+    buf[2*i] = h >> 8;
+    buf[2*i+1] = h & 255;
+  }
+  return(2*ctx->Width);
+}
+
+static int f32row(planet_ctx *ctx, int j, unsigned char *buf)
+{
+  float *a = ctx->alts[j];
+  unsigned u;
+  int i;
+
+  for (i=0; i<ctx->Width; i++) {
+    memcpy(&u, &a[i], 4);
+    buf[4*i] = u & 255;
+    buf[4*i+1] = (u >> 8) & 255;
+    buf[4*i+2] = (u >> 16) & 255;
+    buf[4*i+3] = u >> 24;
+  }
+  return(4*ctx->Width);
+}
+
+/* The rows of binary heightfields all have the same size, so when */
+/* outfile is a regular file, it is extended to hold them and the */
+/* threads encode them straight into a memory mapping of it. */
+/* Returns -1 if that can not be done */
+
+static int mapbody(planet_ctx *ctx, FILE *outfile, int j0, int j1,
+		   int (*proc)(planet_ctx *, int, unsigned char *), int size)
+{
+#ifdef MMAP
+  struct stat st;
+  unsigned char *map, *buf = ctx->outbuf;
+  off_t pos, off, len = (off_t)(j1-j0)*size;
+  int b, fd, n = j1-j0;
+
+  if (fflush(outfile) != 0 || (fd = fileno(outfile)) < 0 ||
+      fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      (pos = ftello(outfile)) < 0)
+    return(-1);
+  off = pos/sysconf(_SC_PAGESIZE)*sysconf(_SC_PAGESIZE);
+  if (st.st_size < pos+len && ftruncate(fd, pos+len) != 0) return(-1);
+  map = (unsigned char*)mmap(0, pos+len-off, PROT_READ|PROT_WRITE,
+			     MAP_SHARED, fd, off);
+  if (map == MAP_FAILED) return(-1);
+
+  ctx->out_proc = proc;
+  ctx->outdj = 1;
+  ctx->outstride = size;
+  for (b = 0; b < n; b += ctx->outn) {
+    ctx->outn = n-b < ctx->outrows ? n-b : ctx->outrows;
+    ctx->outj = j0+b;
+    ctx->outbuf = map+(pos-off)+(size_t)b*size;
+    encoderows(ctx);
+  }
+  ctx->outbuf = buf;
+  ctx->outstride = rowbytes(ctx);
+  munmap(map, pos+len-off);
+  fseeko(outfile, pos+len, SEEK_SET);
+  ctx->outbytes += len;
+  return(0);
+#else
+  (void)ctx; (void)outfile; (void)j0; (void)j1; (void)proc; (void)size;
+  return(-1);
+#endif
+}
+
+static void printalts(planet_ctx *ctx, FILE *outfile, int j0, int j1)
+/* prints altitudes as binary heightfield */
+{
+  int (*proc)(planet_ctx *, int, unsigned char *);
+  char head[128];
+  int n;
+
+  if (j0 == 0 && ctx->file_type == pgm) {
+    fprintf(outfile,"P5\n");
+    fprintf(outfile,"#fractal planet altitudes: (value-%d)/%.0f, "
+	    "0 = not on the planet\n", PGMSEA, PGMSCALE);
+    fprintf(outfile,"%d %d 65535\n",ctx->Width,ctx->Height);
+  }
+  if (j0 == 0 && ctx->file_type == npy) {
+    /* the header is padded with spaces to a multiple of 64 bytes */
+    n = sprintf(head, "{'descr': '<f4', 'fortran_order': False, "
+		"'shape': (%d, %d), }", ctx->Height, ctx->Width);
+    while ((10+n+1) % 64 != 0) head[n++] = ' ';
+    head[n++] = '\n';
+    fwrite("\223NUMPY\001\000", 1, 8, outfile);
+    putc(n & 255, outfile);
+    putc(n >> 8, outfile);
+    fwrite(head, 1, n, outfile);
+  }
+  proc = ctx->file_type == pgm ? pgmrow : f32row;
+  if (mapbody(ctx, outfile, j0, j1, proc,
+	      (ctx->file_type == pgm ? 2 : 4)*ctx->Width) != 0)
+    writebody(ctx, outfile, j0, j1, proc, 0);
+}
+
+/* The equatorial radius of Web Mercator (EPSG:3857), in metres */
+
+#define WEBMERCATOR 6378137.0
+
+int planet_writeworld(planet_ctx *ctx, FILE *outfile)
+{
+  double d, x, y;
+  int W = ctx->Width, H = ctx->Height, x0 = 0, y0 = 0, k;
+
+  /* pixel (i,j) shows longitude longi+PI*(2i-W)/W/scale, and */
+  /* latitude -y for the y given by squarep() and mercator() */
+  if (ctx->view == 'q') {
+    d = 360.0/W/ctx->scale;
+    k = (int)(0.5*ctx->lat*W*ctx->scale/PI);
+    x = ctx->longi/DEG2RAD-180.0/ctx->scale;
+    y = 180.0*(H+2*k)/W/ctx->scale;
+  } else if (ctx->view == 'm') {
+    if (ctx->fullwidth > 0) {
+      W = ctx->fullwidth; H = ctx->fullheight;
+      x0 = ctx->winx; y0 = ctx->winy;
+    }
+    y = sin(ctx->lat);
+    y = (1.0+y)/(1.0-y);
+    y = 0.5*log(y);
+    k = (int)(0.5*y*W*ctx->scale/PI);
+    d = 2*PI*WEBMERCATOR/W/ctx->scale;
+    x = WEBMERCATOR*(ctx->longi+PI*(2.0*x0-W)/W/ctx->scale);
+    y = -WEBMERCATOR*PI*(2.0*(y0-k)-H)/W/ctx->scale;
+  } else
+    return(-1);
+  fprintf(outfile, "%.12g\n0\n0\n%.12g\n%.12g\n%.12g\n", d, -d, x, y);
+  return(0);
+}
+
+void planet_writehdr(planet_ctx *ctx, FILE *outfile)
+{
+  fprintf(outfile, "ENVI\n");
+  fprintf(outfile, "description = {fractal planet altitudes}\n");
+  fprintf(outfile, "samples = %d\n", ctx->Width);
+  fprintf(outfile, "lines = %d\n", ctx->Height);
+  fprintf(outfile, "bands = 1\n");
+  fprintf(outfile, "header offset = 0\n");
+  fprintf(outfile, "file type = ENVI Standard\n");
+  fprintf(outfile, "data type = 4\n");
+  fprintf(outfile, "interleave = bsq\n");
+  fprintf(outfile, "byte order = 0\n");
+}
+
+/* PNG files are compressed by the deflate compressor below, which */
+/* needs no library.  The rows encoded at a time are split in parts */
+/* of at least ZMINPART bytes, one per thread, which are compressed */
+/* independently and each end on a byte boundary with an empty stored */
+/* block, so they can be joined as pigz does.  Each part is an IDAT */
+/* chunk, and the Adler-32 checksums of the parts are combined into */
+/* the one of the zlib stream */
+
+static const unsigned short lbase[29] = { /* lengths 257..285 */
+  3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
+  35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const unsigned char lext[29] = {
+  0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const unsigned short dbase[30] = { /* distances 0..29 */
+  1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+  257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const unsigned char dext[30] = {
+  0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+/* the order in which the code length code lengths are stored */
+static const unsigned char clorder[19] = {
+  16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+
+static unsigned long crc32(unsigned long crc, const unsigned char *p, long n)
+{
+  static const unsigned long crctab[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+
+  crc = ~crc & 0xffffffff;
+  while (n-- > 0) {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ crctab[crc & 15];
+    crc = (crc >> 4) ^ crctab[crc & 15];
+  }
+  return(~crc & 0xffffffff);
+}
+
+#define ADLERBASE 65521
+
+static unsigned long adler32(const unsigned char *p, long n)
+{
+  unsigned long a = 1, b = 0;
+  long k;
+
+  while (n > 0) {
+    k = n < 5552 ? n : 5552; /* no overflow before the modulo */
+    n -= k;
+    while (k-- > 0) {
+      a += *p++;
+      b += a;
+    }
+    a %= ADLERBASE;
+    b %= ADLERBASE;
+  }
+  return((b << 16) | a);
+}
+
+/* the checksum of data with checksum a1 followed by len2 bytes with */
+/* checksum a2 */
+
+static unsigned long adler32combine(unsigned long a1, unsigned long a2,
+				    long len2)
+{
+  unsigned long rem = len2 % ADLERBASE, s1, s2;
+
+  s1 = a1 & 0xffff;
+  s2 = rem*s1 % ADLERBASE;
+  s1 += (a2 & 0xffff) + ADLERBASE - 1;
+  s2 += (a1 >> 16) + (a2 >> 16) + ADLERBASE - rem;
+  if (s1 >= ADLERBASE) s1 -= ADLERBASE;
+  if (s1 >= ADLERBASE) s1 -= ADLERBASE;
+  if (s2 >= 2*ADLERBASE) s2 -= 2*ADLERBASE;
+  if (s2 >= ADLERBASE) s2 -= ADLERBASE;
+  return((s2 << 16) | s1);
+}
+
+static void putbits(struct planet_zstream *z, unsigned v, int n)
+{
+  z->bits |= (unsigned long)v << z->nbits;
+  z->nbits += n;
+  while (z->nbits >= 8) {
+    z->out[z->nout++] = z->bits & 255;
+    z->bits >>= 8;
+    z->nbits -= 8;
+  }
+}
+
+/* Set len[0..n-1] to the lengths of a Huffman code, at most maxbits */
+/* long, for symbols with frequencies freq[0..n-1].  At least two */
+/* symbols get a code, so the code is complete.  If the code is too */
+/* long, the frequencies are halved until it is not */
+
+static void huffman(const long *freq, int n, int maxbits,
+		    unsigned char *len)
+{
+  long f[286], w[2*286];
+  int sym[286], up[2*286], depth[2*286];
+  int i, k, m = 0, q, next, a, s, maxd;
+
+  for (s = 0; s < n; s++) {
+    f[s] = freq[s];
+    len[s] = 0;
+    if (f[s] > 0) sym[m++] = s;
+  }
+  for (s = 0; m < 2; s++)
+    if (f[s] == 0) { f[s] = 1; sym[m++] = s; }
+  for (i = 1; i < m; i++) /* sort by frequency */
+    for (k = i; k > 0 && f[sym[k]] < f[sym[k-1]]; k--) {
+      s = sym[k]; sym[k] = sym[k-1]; sym[k-1] = s;
+    }
+
+  for (;;) {
+    /* the leaves 0..m-1 and the inner nodes made from them are */
+    /* both in order of weight, so the two lightest nodes are the */
+    /* first of either */
+    for (k = 0; k < m; k++) w[k] = f[sym[k]];
+    i = 0; q = m;
+    for (next = m; next < 2*m-1; next++) {
+      for (w[next] = 0, k = 0; k < 2; k++) {
+	a = i < m && (q >= next || w[i] <= w[q]) ? i++ : q++;
+	w[next] += w[a];
+	up[a] = next;
+      }
+    }
+    depth[2*m-2] = 0;
+    maxd = 0;
+    for (k = 2*m-3; k >= 0; k--) {
+      depth[k] = depth[up[k]]+1;
+      if (depth[k] > maxd) maxd = depth[k];
+    }
+    if (maxd <= maxbits) break;
+    for (k = 0; k < m; k++) f[sym[k]] = (f[sym[k]]+1)/2;
+  }
+  for (k = 0; k < m; k++) len[sym[k]] = depth[k];
+}
+
+/* canonical codes for the lengths len, bit reversed as deflate */
+/* stores them */
+
+static void huffcodes(const unsigned char *len, int n, unsigned short *code)
+{
+  int count[16], next[16], b, c, k, r;
+
+  for (b = 0; b < 16; b++) count[b] = 0;
+  for (k = 0; k < n; k++) count[len[k]]++;
+  count[0] = 0;
+  for (c = 0, b = 1; b < 16; b++) {
+    c = (c + count[b-1]) << 1;
+    next[b] = c;
+  }
+  for (k = 0; k < n; k++)
+    if (len[k] > 0) {
+      c = next[len[k]]++;
+      for (r = 0, b = 0; b < len[k]; b++, c >>= 1) r = (r << 1) | (c & 1);
+      code[k] = r;
+    }
+}
+
+#define DISTCODE(z, d) \
+  ((d) <= 256 ? (z)->dcode[(d)-1] : (z)->dcode[256+(((d)-1)>>7)])
+
+/* Write the symbols gathered for data[0..n-1] as a dynamic Huffman */
+/* block, or as stored blocks if that is shorter */
+
+static void zblock(struct planet_zstream *z, const unsigned char *data,
+		   long n)
+{
+  long lf[286], df[30], cf[19], bits, stored;
+  unsigned char ll[286], dl[30], cl[19], lens[286+30];
+  unsigned short lc[286], dc[30], cc[19];
+  unsigned char rle[286+30], rlex[286+30];
+  int nl, nd, nc, nr, k, r, run, v, c, s;
+  long m;
+
+  for (k = 0; k < 286; k++) lf[k] = 0;
+  for (k = 0; k < 30; k++) df[k] = 0;
+  for (k = 0; k < 19; k++) cf[k] = 0;
+  for (k = 0; k < z->nsyms; k++)
+    if (z->dist[k] == 0) lf[z->lit[k]]++;
+    else {
+      lf[257+z->lcode[z->lit[k]-256]]++;
+      df[DISTCODE(z, z->dist[k])]++;
+    }
+  lf[256] = 1; /* end of block */
+  huffman(lf, 286, 15, ll);
+  huffman(df, 30, 15, dl);
+  for (nl = 286; ll[nl-1] == 0; nl--);
+  for (nd = 30; nd > 1 && dl[nd-1] == 0; nd--);
+
+  /* the literal/length and distance code lengths, as one sequence */
+  /* with runs coded by 16 (repeat 3-6 times), 17 and 18 (3-10 and */
+  /* 11-138 zeros) */
+  memcpy(lens, ll, nl);
+  memcpy(lens+nl, dl, nd);
+  for (nr = 0, k = 0; k < nl+nd; k = r) {
+    v = lens[k];
+    for (r = k+1; r < nl+nd && lens[r] == v; r++);
+    run = r-k;
+    if (v == 0) {
+      for (; run >= 11; run -= c) {
+	c = run < 138 ? run : 138;
+	rle[nr] = 18; rlex[nr++] = c-11;
+      }
+      if (run >= 3) {
+	rle[nr] = 17; rlex[nr++] = run-3;
+	run = 0;
+      }
+    } else {
+      rle[nr++] = v;
+      for (run--; run >= 3; run -= c) {
+	c = run < 6 ? run : 6;
+	rle[nr] = 16; rlex[nr++] = c-3;
+      }
+    }
+    for (; run > 0; run--) rle[nr++] = v;
+  }
+  for (k = 0; k < nr; k++) cf[rle[k]]++;
+  huffman(cf, 19, 7, cl);
+  for (nc = 19; nc > 4 && cl[clorder[nc-1]] == 0; nc--);
+
+  bits = 3+5+5+4+3*nc;
+  for (k = 0; k < 19; k++) bits += cf[k]*cl[k];
+  bits += 2*cf[16]+3*cf[17]+7*cf[18];
+  for (k = 0; k < 286; k++) bits += lf[k]*ll[k];
+  for (k = 0; k < 30; k++) bits += df[k]*(dl[k]+dext[k]);
+  for (k = 0; k < 29; k++) bits += lf[257+k]*lext[k];
+  stored = 8*(n+5*((n+65534)/65535))+7;
+
+  if (bits >= stored) {
+    for (m = 0; m < n; m += c) {
+      c = n-m < 65535 ? n-m : 65535;
+      putbits(z, 0, 3);
+      putbits(z, 0, (8-z->nbits) & 7);
+      putbits(z, c & 0xffff, 16);
+      putbits(z, ~c & 0xffff, 16);
+      memcpy(z->out+z->nout, data+m, c);
+      z->nout += c;
+    }
+  } else {
+    huffcodes(ll, 286, lc);
+    huffcodes(dl, 30, dc);
+    huffcodes(cl, 19, cc);
+    putbits(z, 2 << 1, 3);
+    putbits(z, nl-257, 5);
+    putbits(z, nd-1, 5);
+    putbits(z, nc-4, 4);
+    for (k = 0; k < nc; k++) putbits(z, cl[clorder[k]], 3);
+    for (k = 0; k < nr; k++) {
+      putbits(z, cc[rle[k]], cl[rle[k]]);
+      if (rle[k] == 16) putbits(z, rlex[k], 2);
+      else if (rle[k] == 17) putbits(z, rlex[k], 3);
+      else if (rle[k] == 18) putbits(z, rlex[k], 7);
+    }
+    for (k = 0; k < z->nsyms; k++)
+      if (z->dist[k] == 0) putbits(z, lc[z->lit[k]], ll[z->lit[k]]);
+      else {
+	v = z->lit[k]-256;
+	c = z->lcode[v];
+	putbits(z, lc[257+c], ll[257+c]);
+	putbits(z, v-lbase[c], lext[c]);
+	s = z->dist[k];
+	c = DISTCODE(z, s);
+	putbits(z, dc[c], dl[c]);
+	putbits(z, s-dbase[c], dext[c]);
+      }
+    putbits(z, lc[256], ll[256]);
+  }
+  z->nsyms = 0;
+}
+
+#define ZHASHOF(p) \
+  ((((unsigned)(p)[0]<<16 | (unsigned)(p)[1]<<8 | (p)[2])*2654435761u \
+    & 0xffffffffu) >> 17)
+
+/* Compress data[0..n-1] as deflate blocks ending on a byte boundary, */
+/* finding matches by greedy search in hash chains */
+
+static void zpart(struct planet_zstream *z, const unsigned char *data,
+		  long n)
+{
+  long p = 0, start = 0, q, cand;
+  int best, dist, len, max, chain, h, k;
+
+  for (len = 3, k = 0; len <= 258; len++) {
+    while (k < 28 && lbase[k+1] <= len) k++;
+    z->lcode[len] = k;
+  }
+  for (dist = 1, k = 0; dist <= 32768; dist++) {
+    while (k < 29 && dbase[k+1] <= dist) k++;
+    if (dist <= 256) z->dcode[dist-1] = k;
+    else if ((dist-1) % 128 == 0) z->dcode[256+((dist-1)>>7)] = k;
+  }
+  memset(z->head, 0, sizeof(z->head));
+  z->nout = 0;
+  z->bits = 0;
+  z->nbits = 0;
+  z->nsyms = 0;
+  while (p < n) {
+    best = dist = 0;
+    if (p+2 < n) {
+      max = n-p < 258 ? n-p : 258;
+      h = ZHASHOF(data+p);
+      for (cand = z->head[h]-1, chain = ZCHAIN;
+	   cand >= 0 && p-cand <= ZWINDOW && chain > 0;
+	   cand = z->prev[cand & (ZWINDOW-1)]-1, chain--) {
+	if (data[cand+best] != data[p+best]) continue;
+	for (len = 0; len < max && data[cand+len] == data[p+len]; len++);
+	if (len > best) {
+	  best = len;
+	  dist = p-cand;
+	  if (len == max) break;
+	}
+      }
+    }
+    if (best >= 3) {
+      z->lit[z->nsyms] = 256+best;
+      z->dist[z->nsyms++] = dist;
+    } else {
+      best = 1;
+      z->lit[z->nsyms] = data[p];
+      z->dist[z->nsyms++] = 0;
+    }
+    for (q = p+best; p < q; p++) /* insert the strings passed */
+      if (p+2 < n) {
+	h = ZHASHOF(data+p);
+	z->prev[p & (ZWINDOW-1)] = z->head[h];
+	z->head[h] = p+1;
+      }
+    if (z->nsyms == ZSYMS) {
+      zblock(z, data+start, p-start);
+      start = p;
+    }
+  }
+  if (z->nsyms > 0) zblock(z, data+start, p-start);
+  putbits(z, 0, 3); /* empty stored block */
+  putbits(z, 0, (8-z->nbits) & 7);
+  putbits(z, 0x0000, 16);
+  putbits(z, 0xffff, 16);
+}
+
+static unsigned long pngcrc(const char *type, const unsigned char *data,
+			    long n)
+{
+  return(crc32(crc32(0, (const unsigned char*)type, 4), data, n));
+}
+
+static void *z_worker(void *arg)
+{
+  worker *w = (worker*)arg;
+  planet_ctx *ctx = w->ctx;
+  struct planet_zstream *z;
+  long n;
+  int k;
+
+  for (;;) {
+    LOCK(ctx);
+    k = ctx->next_row++;
+    UNLOCK(ctx);
+    if (k >= ctx->zparts) break;
+    z = &ctx->zs[k];
+    n = ctx->zlen-k*ctx->zpart < ctx->zpart ? ctx->zlen-k*ctx->zpart
+					     : ctx->zpart;
+    zpart(z, ctx->outbuf+k*ctx->zpart, n);
+    z->adler = adler32(ctx->outbuf+k*ctx->zpart, n);
+    z->crc = pngcrc("IDAT", z->out, z->nout);
+  }
+  return(arg);
+}
+
+static void pngchunk(planet_ctx *ctx, FILE *outfile, const char *type,
+		     const unsigned char *data, long n, unsigned long crc)
+{
+  unsigned char b[4];
+  int k;
+
+  for (k = 0; k < 4; k++) b[k] = (n >> (24-8*k)) & 255;
+  fwrite(b, 1, 4, outfile);
+  fwrite(type, 1, 4, outfile);
+  fwrite(data, 1, n, outfile);
+  for (k = 0; k < 4; k++) b[k] = (crc >> (24-8*k)) & 255;
+  fwrite(b, 1, 4, outfile);
+  ctx->outbytes += n+12;
+}
+
+/* With no shading and at most 256 colours, PNG pixels are colour */
+/* numbers in a palette, else red, green and blue */
+
+static int pngpalette(planet_ctx *ctx)
+{
+  return(ctx->do_bw || (!ctx->doshade && ctx->nocols <= 256));
+}
+
+static int pngpixels(planet_ctx *ctx, int j, unsigned char *p)
+{
+  int i;
+
+  if (!pngpalette(ctx)) return(ppmrow(ctx, j, p));
+  if (ctx->do_bw)
+    for (i=0; i<ctx->Width; i++) p[i] = ctx->col[j][i] < WHITE ? 0 : 1;
+  else
+    for (i=0; i<ctx->Width; i++) p[i] = ctx->col[j][i];
+  return(ctx->Width);
+}
+
+static int paeth(int a, int b, int c)
+{
+  int p = a+b-c, pa = abs(p-a), pb = abs(p-b), pc = abs(p-c);
+
+  return(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+/* Filter the RGB row cur with row up above it into out, with PNG */
+/* filter f; returns the sum of the absolute values of the bytes */
+
+static long pngfilter(int f, const unsigned char *cur,
+		      const unsigned char *up, unsigned char *out, int n)
+{
+  long sum = 0;
+  int i;
+
+  switch (f) {
+    case 0:
+      memcpy(out, cur, n);
+      break;
+    case 1:
+      memcpy(out, cur, 3);
+      for (i=3; i<n; i++) out[i] = cur[i]-cur[i-3];
+      break;
+    case 2:
+      for (i=0; i<n; i++) out[i] = cur[i]-up[i];
+      break;
+    case 3:
+      for (i=0; i<3; i++) out[i] = cur[i]-(up[i]>>1);
+      for (i=3; i<n; i++) out[i] = cur[i]-((cur[i-3]+up[i])>>1);
+      break;
+    default:
+      for (i=0; i<3; i++) out[i] = cur[i]-up[i];
+      for (i=3; i<n; i++) out[i] = cur[i]-paeth(cur[i-3], up[i], up[i-3]);
+      break;
+  }
+  for (i=0; i<n; i++) sum += abs((signed char)out[i]);
+  return(sum);
+}
+
+/* A PNG row is the filter type and the filtered pixels.  Palette */
+/* rows are not filtered, RGB rows get the filter with the smallest */
+/* sum, as in libpng.  The row and the row above are unfiltered into */
+/* buf after the filtered row */
+
+static int pngrow(planet_ctx *ctx, int j, unsigned char *buf)
+{
+  unsigned char *cur, *up;
+  long sum, best = -1;
+  int f, bestf = 0, n;
+
+  if (pngpalette(ctx)) {
+    buf[0] = 0;
+    return(1+pngpixels(ctx, j, buf+1));
+  }
+  cur = buf+1+3*ctx->Width;
+  up = cur+3*ctx->Width;
+  n = pngpixels(ctx, j, cur);
+  if (j == 0) memset(up, 0, n);
+  else if (j == ctx->outmin) memcpy(up, ctx->pngprev, n); /* of the */
+  else pngpixels(ctx, j-1, up);			    /* last band */
+  for (f = 0; f < 5; f++) {
+    sum = pngfilter(f, cur, up, buf+1, n);
+    if (best < 0 || sum < best) {
+      best = sum;
+      bestf = f;
+    }
+  }
+  if (bestf != 4) pngfilter(bestf, cur, up, buf+1, n);
+  buf[0] = bestf;
+  return(1+n);
+}
+
+static void printpng(planet_ctx *ctx, FILE *outfile, int j0, int j1)
+/* prints picture in PNG format */
+{
+  unsigned char b[3*256];
+  int i, k, m, n = j1-j0;
+  struct planet_zstream *z;
+
+  if (j0 == 0) {
+    fwrite("\211PNG\r\n\032\n", 1, 8, outfile);
+    ctx->outbytes += 8;
+    for (k = 0; k < 4; k++) {
+      b[k] = (ctx->Width >> (24-8*k)) & 255;
+      b[4+k] = (ctx->Height >> (24-8*k)) & 255;
+    }
+    b[8] = 8;                          /* bits per sample */
+    b[9] = pngpalette(ctx) ? 3 : 2;    /* palette or RGB */
+    b[10] = b[11] = b[12] = 0;         /* deflate, filters, no interlace */
+    pngchunk(ctx, outfile, "IHDR", b, 13, pngcrc("IHDR", b, 13));
+    if (pngpalette(ctx)) {
+      m = ctx->do_bw ? 2 : ctx->nocols;
+      for (i = 0; i < m; i++) {
+	b[3*i] = ctx->do_bw ? 255*i : ctx->rtable[i];
+	b[3*i+1] = ctx->do_bw ? 255*i : ctx->gtable[i];
+	b[3*i+2] = ctx->do_bw ? 255*i : ctx->btable[i];
+      }
+      pngchunk(ctx, outfile, "PLTE", b, 3*m, pngcrc("PLTE", b, 3*m));
+    }
+    b[0] = 0x78; b[1] = 0x01;          /* zlib header */
+    pngchunk(ctx, outfile, "IDAT", b, 2, pngcrc("IDAT", b, 2));
+    ctx->adler = 1;
+  }
+
+  ctx->out_proc = pngrow;
+  ctx->outdj = 1;
+  for (k = 0; k < n; k += ctx->outn) {
+    ctx->outn = n-k < ctx->outrows ? n-k : ctx->outrows;
+    ctx->outj = j0+k;
+    ctx->zlen = encoderows(ctx);
+    ctx->zparts = ctx->zlen/ZMINPART;
+    if (ctx->zparts > ctx->nworkers) ctx->zparts = ctx->nworkers;
+    if (ctx->zparts < 1) ctx->zparts = 1;
+    ctx->zpart = (ctx->zlen+ctx->zparts-1)/ctx->zparts;
+    if (ctx->zparts > 1) run_rows(ctx, z_worker, 0);
+    else {
+      ctx->next_row = 0;
+      z_worker(&ctx->workers[0]);
+    }
+    for (i = 0; i < ctx->zparts; i++) {
+      z = &ctx->zs[i];
+      pngchunk(ctx, outfile, "IDAT", z->out, z->nout, z->crc);
+      ctx->adler = adler32combine(ctx->adler, z->adler,
+				  i < ctx->zparts-1 ? ctx->zpart
+				  : ctx->zlen-i*ctx->zpart);
+    }
+  }
+
+  if (j1 < ctx->Height) /* the next band filters against the last row */
+    pngpixels(ctx, j1-1, ctx->pngprev);
+  else {
+    b[0] = 0x03; b[1] = 0x00;          /* empty final block */
+    for (k = 0; k < 4; k++) b[2+k] = (ctx->adler >> (24-8*k)) & 255;
+    pngchunk(ctx, outfile, "IDAT", b, 6, pngcrc("IDAT", b, 6));
+    pngchunk(ctx, outfile, "IEND", b, 0, pngcrc("IEND", b, 0));
   }
-  fclose(outfile);
 }
       
-double log_2(x)
-double x;
+static double log_2(double x)
 { return(log(x)/log(2.0)); }
 
-void print_error(char *filename, char *ext)
-{
-  fprintf(stderr,"Usage: planet [options]\n\n");
-  fprintf(stderr,"options:\n");
-  fprintf(stderr,"  -?                (or any illegal option) Output this text\n");
-  fprintf(stderr,"  -s seed           Specifies seed as number between 0.0 and 1.0\n");
-  fprintf(stderr,"  -w width          Specifies width in pixels, default = 800\n");
-  fprintf(stderr,"  -h height         Specifies height in pixels, default = 600\n");
-  fprintf(stderr,"  -m magnification  Specifies magnification, default = 1.0\n");
-  fprintf(stderr,"  -o output_file    Specifies output file, default is %s%s\n",
-                                            filename, ext);
-  fprintf(stderr,"  -l longitude      Specifies longitude of centre in degrees, default = 0.0\n");
-  fprintf(stderr,"  -L latitude       Specifies latitude of centre in degrees, default = 0.0\n");
-  fprintf(stderr,"  -g gridsize       Specifies vertical gridsize in degrees, default = 0.0 (no grid)\n");
-  fprintf(stderr,"  -G gridsize       Specifies horisontal gridsize in degrees, default = 0.0 (no grid)\n");
-  fprintf(stderr,"  -i init_alt       Specifies initial altitude (default = -0.02)\n");
-  fprintf(stderr,"  -c                Colour depends on latitude (default: only altitude)\n");
-  fprintf(stderr,"  -C file           Read colour definitions from file\n");
-  fprintf(stderr,"  -O                Produce a black and white outline map\n");
-  fprintf(stderr,"  -E                Trace the edges of land in black on colour map\n");
-  fprintf(stderr,"  -B                Use ``bumpmap'' shading\n");
-  fprintf(stderr,"  -b                Use ``bumpmap'' shading on land only\n");
-  fprintf(stderr,"  -d                Use ``daylight'' shading\n");
-  fprintf(stderr,"  -a angle	      Angle of ``light'' in bumpmap shading\n");
-  fprintf(stderr,"                    or longitude of sun in daylight shading\n");
-  fprintf(stderr,"  -A latitude	      Latitude of sun in daylight shading\n");
-  fprintf(stderr,"  -P                Use PPM file format (default is BMP)\n");
-  fprintf(stderr,"  -x                Use XPM file format (default is BMP)\n");
-  fprintf(stderr,"  -V number         Distance contribution to variation (default = 0.03)\n");
-  fprintf(stderr,"  -v number         Altitude contribution to variation (default = 0.4)\n");
-  fprintf(stderr,"  -pprojection      Specifies projection: m = Mercator (default)\n");
-  fprintf(stderr,"                                          p = Peters\n");
-  fprintf(stderr,"                                          q = Square\n");
-  fprintf(stderr,"                                          s = Stereographic\n");
-  fprintf(stderr,"                                          o = Orthographic\n");
-  fprintf(stderr,"                                          g = Gnomonic\n");
-  fprintf(stderr,"                                          a = Area preserving azimuthal\n");
-  fprintf(stderr,"                                          c = Conical (conformal)\n");
-  fprintf(stderr,"                                          M = Mollweide\n");
-  fprintf(stderr,"                                          S = Sinusoidal\n");
-  fprintf(stderr,"                                          i = Icosaheral\n");
-  fprintf(stderr,"                                          h = Heightfield\n");
-  fprintf(stderr,"                                          f = Find match, see manual\n");
-  exit(0);
-}
-
-/* With the -pf option a map must be given on standard input.  */
-/* This map is 11 lines of 24 characters. The characters are:  */
-/*    . : very strong preference for water (value=8)	       */
-/*    , : strong preference for water (value=4)		       */
-/*    : : preference for water (value=2)		       */
-/*    ; : weak preference for water (value=1)		       */
-/*    - : don't care (value=0)				       */
-/*    * : weak preference for land (value=1)		       */
-/*    o : preference for land (value=2)			       */
-/*    O : strong preference for land (value=4)		       */
-/*    @ : very strong preference for land (value=8)	       */
-/*							       */
-/* Each point on the map corresponds to a point on a 15 grid. */
-/*							       */
-/* The program tries seeds starting from the specified and     */
-/* successively outputs the seed (and rotation) of the best    */
-/* current match, together with a small map of this.	       */
-/* This is all ascii, no bitmap is produced.		       a*/
-
@@ -0,0 +1,299 @@
+/* planet.h */
+/* library interface of the planet generating program */
+/* Copyright 1988--2009 Torben AE. Mogensen */
+
+/* All state of a map lives in a planet_ctx, so several maps can be */
+/* generated at the same time in one process, each by its own thread. */
+/* A context must not be used by more than one thread at a time (it */
+/* uses its own threads internally when nthreads > 1). */
+
+/* Typical use:                                                      */
+/*   planet_ctx *ctx = planet_new();                                 */
+/*   ctx->rseed = 0.3; ctx->view = 'o'; ...                          */
+/*   planet_readcolors(ctx, "Olsson.col");                           */
+/*   planet_setup(ctx);                                              */
+/*   planet_render(ctx, rgb);   (rgb holds 3*Width*Height bytes)     */
+/*   ...                                                             */
+/*   planet_free(ctx);                                               */
+/* planet_setup() allocates everything a render needs; planet_render */
+/* and the query functions allocate nothing (except nodes of the      */
+/* subdivision tree, if tree_mb > 0).  Call planet_setup() again      */
+/* after changing any parameter.                                      */
+
+#ifndef PLANET_H
+#define PLANET_H
+
+#include <stdio.h>
+
+#ifndef NOTHREADS
+#include <pthread.h>
+#endif
+
+/* Supported output file types:
+    BMP - Windows Bit MaPs
+    PPM - Portable Pix Maps
+    XPM - X-windows Pix Maps
+    PNG - Portable Network Graphics
+   and heightfields of the altitudes:
+    PGM - 16-bit Portable Grey Maps
+    RAW - 32-bit floats (described by planet_writehdr())
+    NPY - 32-bit floats in a NumPy array file
+ */
+
+typedef enum ftype
+    {
+	bmp,
+	ppm,
+	xpm,
+	png,
+	pgm,
+	raw,
+	npy
+    }
+    ftype;
+
+/* phases of a map, timed with ctx->stats */
+
+typedef enum planet_phase
+    {
+	PHASE_COLOURS,	/* planet_readcolors() */
+	PHASE_SETUP,	/* planet_setup() */
+	PHASE_RENDER,	/* the projection */
+	PHASE_OUTLINE,
+	PHASE_GRID,
+	PHASE_SHADES,	/* smoothing of the shades */
+	PHASE_OUTPUT,	/* encoding and writing the file */
+	PLANET_PHASES
+    }
+    planet_phase;
+
+#define PLANET_LEVELS 64 /* size of the histogram of levels */
+
+struct planet_worker; /* per-thread state, private to planet.c */
+struct planet_zstream; /* PNG compressor state, private to planet.c */
+
+typedef struct planet_ctx
+{
+  /* parameters: planet_new() sets the defaults */
+
+  double rseed;      /* seed, a number between 0.0 and 1.0 */
+  char view;         /* projection letter, as for the -p option */
+  int Width, Height; /* map size */
+  double scale;      /* magnification */
+  double longitude, latitude; /* centre of map in degrees */
+  double vgrid, hgrid; /* grid spacing in degrees, 0.0 = no grid */
+
+  double M;          /* initial altitude (slightly below sea level) */
+  double dd1;        /* weight for altitude difference */
+  double dd2;        /* weight for distance */
+  double POW;        /* power for distance function */
+
+  int latic;         /* flag for latitude based colour */
+  int do_outline;    /* if 1, draw coastal outline */
+  int do_bw;         /* if 1, reduce map to black outline on white */
+  int contourstep;   /* if >0, # of colour steps between contour lines */
+  int doshade;       /* 1 = bumpmap, 2 = bumpmap on land, 3 = daylight */
+  double shade_angle;  /* angle of "light" on bumpmap */
+  double shade_angle2; /* with daylight shading, these two are
+			  longitude/latitude */
+  ftype file_type;   /* format used by planet_write() */
+  int nthreads;      /* number of rendering threads, 0 = one per CPU */
+  int recursive;     /* if 1, use the original recursive subdivision */
+  int fullwidth, fullheight; /* if >0, a Mercator map is the part at */
+  int winx, winy;    /* winx,winy of a map of this size */
+  double tree_mb;    /* if >0, keep the subdivision tree between points */
+		     /* and renders, in at most this many megabytes */
+  int sphere_n;      /* if >0, interpolate altitudes from a grid of */
+		     /* 6*(sphere_n+1)^2 points on the sphere, made by */
+		     /* planet_setup() and kept for the same planet */
+  int adaptive;      /* if 1, compute a coarse grid of pixels first and */
+  int adapttol;      /* interpolate blocks whose corners differ by at */
+		     /* most adapttol colours and shades (see Manual.txt) */
+  int band;          /* if >0, planet_stream() renders and writes the */
+		     /* map this many rows at a time */
+  int pixeldepth;    /* if 1, subdivide each pixel of stereographic, */
+		     /* orthographic, gnomonic and conical maps only as */
+		     /* deep as its size on the planet needs */
+  double reuse;      /* if >0, an orthographic map takes each pixel it */
+		     /* can from the last one, when the point that one */
+		     /* computed is at most this many pixels away */
+  int debug;         /* if 1, print progress on stderr */
+  int stats;         /* if 1, time the phases of each map (--stats) */
+  long maxseeds;     /* seed search: stop after this many seeds, */
+  double maxsecs;    /* or seconds, or when a match has at most goal */
+  int goal;          /* errors (0, 0.0 and -1 = no limit) */
+
+  /* colour table, read by planet_readcolors() */
+
+  int nocols;
+  int SEA, LAND, HIGHEST;
+  int rtable[65536], gtable[65536], btable[65536];
+
+  /* computed by planet_setup() */
+
+  double longi, lat;   /* centre of map in radians */
+  double cla, sla, clo, slo;
+  double r1,r2,r3,r4;  /* seeds */
+  int Depth;           /* initial depth of subdivisions */
+
+  /* the map, filled by planet_render() */
+
+  /* (each a Height array of rows, [j][i] is pixel i of row j) */
+
+  unsigned short **col;    /* colour array */
+  unsigned char **shades;  /* shade array */
+  int **heights;           /* heightfield array */
+  float **alts;            /* altitudes, for pgm, raw and npy files */
+  int *outx, *outy;        /* outline points */
+  long water, land;        /* pixel counts for water percentage (Peters) */
+
+  /* tetrahedron cache statistics of the last planet_render() */
+
+  long sspoints;     /* points computed */
+  long sshits;       /* points started from a cached tetrahedron */
+  double sslevels;   /* subdivision levels needed in total */
+  double ssskipped;  /* levels saved by starting from the cache */
+  long treenodes;    /* nodes in the subdivision tree */
+  double treemb;     /* megabytes used by them */
+  long treefull;     /* points finished outside the tree as it was full */
+  long interpolated; /* pixels interpolated in adaptive rendering */
+  long reused;       /* pixels taken from the last map (reuse) */
+  long levels[PLANET_LEVELS]; /* points subdivided k levels after the */
+		     /* cache (the last entry counts the deeper ones) */
+  long calls;        /* calls of planeti(), or planet() with -R */
+  long background;   /* pixels off the planet */
+		     /* (these three stay 0 if planet.c is compiled */
+		     /* with -DNOSTATS) */
+
+  /* with stats, the wall clock and CPU seconds of each phase (see */
+  /* planet_phase) of the last planet_readcolors(), planet_setup() and */
+  /* map.  The CPU time is that of all threads */
+
+  double wallsecs[PLANET_PHASES], cpusecs[PLANET_PHASES];
+
+  /* output statistics of the last planet_write() or planet_stream() */
+
+  long outbytes;     /* bytes written */
+  double outsecs;    /* seconds it took, not counting the rendering */
+
+  /* seed search (view 'f') */
+
+  int cl0[60][30];  /* search map */
+  int weight[30];
+  int best;
+  double increment;
+  long seeds;       /* seeds tried by planet_search() */
+  double seedsecs;  /* and the seconds it took */
+  long rejected;    /* seeds rejected before all rows were mapped */
+  long searchrows;  /* rows mapped, of Height per seed */
+
+  /* rendering threads */
+
+  int nworkers;
+  struct planet_worker *workers;
+  void (*row_proc)(struct planet_worker *, int, int);
+  int next_row;
+  int row_step;      /* render every row_step'th row (and the last) */
+  int rowmin, rowmax; /* the map arrays hold rows rowmin..rowmax-1 */
+  int outmin, outmax; /* of which these are finished (planet_stream()) */
+  unsigned char *marks; /* adaptive rendering and reuse: state of each */
+		     /* pixel */
+  int *gridcells;    /* grid cells of two rows per thread */
+  int (*out_proc)(struct planet_ctx *, int, unsigned char *);
+  unsigned char *outbuf; /* rows encoded for writing by out_proc, */
+  int *outlen;       /* their lengths */
+  int outrows;       /* room for this many rows */
+  int outstride;     /* bytes from one row to the next */
+  int outn, outj, outdj; /* encoding rows outj+k*outdj for k < outn */
+  struct planet_zstream *zs; /* PNG: compressors of the parts of outbuf, */
+  int zparts;        /* the number of parts */
+  long zlen, zpart;  /* bytes in outbuf and in each part */
+  unsigned long adler; /* checksum of the PNG rows written so far */
+  unsigned char *pngprev; /* the last of them, unfiltered */
+  size_t layersize[4]; /* bytes of col, shades, heights and alts, */
+  void *spare[4];    /* which are kept when the map is freed, for */
+  size_t sparesize[4]; /* the next planet_setup() to use again */
+  struct planet_tree *tree; /* subdivision tree, private to planet.c */
+  struct planet_sphere *sphere; /* sphere grid, likewise */
+  struct planet_frame *frame; /* samples of the last map (reuse), likewise */
+#ifndef NOTHREADS
+  pthread_t *threads;
+  pthread_mutex_t lock;
+#endif
+} planet_ctx;
+
+/* Create a context with default parameters; NULL if out of memory */
+planet_ctx *planet_new(void);
+
+/* Free a context and everything it has allocated */
+void planet_free(planet_ctx *ctx);
+
+/* Copy the parameters and colour table of src to dst.  dst keeps its */
+/* subdivision tree, sphere grid and the memory of its map (for the */
+/* next map of the same size), but must be set up again before rendering */
+void planet_copy(planet_ctx *dst, planet_ctx *src);
+
+/* Read a colour file (see Manual.txt); returns 0, or -1 if the file */
+/* can not be opened */
+int planet_readcolors(planet_ctx *ctx, const char *colorsname);
+
+/* Prepare for rendering: derive seeds and angles from the parameters */
+/* and allocate the map.  Returns 0, or -1 if out of memory */
+int planet_setup(planet_ctx *ctx);
+
+/* Render the map.  If rgb is not NULL, the finished picture is also */
+/* stored there as Height rows of Width red/green/blue byte triples, */
+/* top row first.  Returns 0, or -1 for views that are not maps ('f') */
+/* or if ctx->band > 0 */
+int planet_render(planet_ctx *ctx, unsigned char *rgb);
+
+/* Write the rendered map to outfile in ctx->file_type format */
+/* (or the heightfield for view 'h').  pgm, raw and npy files hold */
+/* the altitudes in any projection, and are written through a memory */
+/* mapping when outfile is a regular file.  The file is not closed */
+void planet_write(planet_ctx *ctx, FILE *outfile);
+
+/* Write a world file for the map to outfile: the size of a pixel and */
+/* the position of the top left one, in degrees for the square */
+/* projection ('q') or in metres of the spherical Web Mercator */
+/* projection for Mercator maps.  Returns -1 for other projections */
+int planet_writeworld(planet_ctx *ctx, FILE *outfile);
+
+/* Write the ENVI header that describes a raw heightfield to outfile */
+void planet_writehdr(planet_ctx *ctx, FILE *outfile);
+
+/* Render the map and write it to outfile, like planet_render() and */
+/* planet_write().  If ctx->band > 0, planet_setup() only allocates a */
+/* band of rows (and a few more), and the map is rendered and written */
+/* a band at a time, so a map of any height can be made in a memory */
+/* proportional to Width*band.  planet_render() can not be used then. */
+/* Returns 0, or -1 for views that are not maps ('f') */
+int planet_stream(planet_ctx *ctx, FILE *outfile);
+
+/* Altitude at point (x,y,z) on the unit sphere; below 0 is sea */
+double planet_altitude(planet_ctx *ctx, double x, double y, double z);
+
+/* Colour number (index into the colour table) at point (x,y,z) */
+/* on the unit sphere.  If rgb is not NULL, the (shaded) colour is */
+/* stored in rgb[0..2] */
+int planet_colour(planet_ctx *ctx, double x, double y, double z,
+		  unsigned char *rgb);
+
+/* Write a "slippy map" pyramid of 256x256 Mercator tiles for zoom */
+/* levels zmin to zmax as dir/z/x/y.bmp (or .ppm, .xpm or .png), */
+/* rendering nthreads tiles at a time.  Uniform tiles (open sea) are */
+/* all links to one file in dir/uniform.  Returns 0, or -1 if a file */
+/* could not be written or memory allocated */
+int planet_tiles(planet_ctx *ctx, const char *dir, int zmin, int zmax);
+
+/* Seed search (view 'f'): read the map to match from infile, */
+/* which sets Width and Height, so call this before planet_setup() */
+void planet_readmap(planet_ctx *ctx, FILE *infile);
+
+/* Seed search: try seeds from rseed on, nthreads at a time, printing */
+/* matches better than any found so far to outfile.  The matches are */
+/* printed in the order of the seeds, the same for any nthreads. */
+/* Returns when maxseeds, maxsecs or goal says so (else never) */
+void planet_search(planet_ctx *ctx, FILE *outfile);
+
+#endif
@@ -0,0 +1,341 @@
+/* planetbench.c */
+/* benchmarks of planet, run by make bench */
+
+/* usage: planetbench [-t threads] [-T seconds] [-w width] [-h height] */
+/*                    [-C colourfile]                                 */
+/*                                                                    */
+/* Times three levels of the program:                                 */
+/*   kernel:      planet1() per point at depths 6 to 36, starting     */
+/*                from the top each time, rand2() and inside() (the   */
+/*                side tests of the tetrahedron cache),               */
+/*   projections: planet_render() of all 12 views of seed 0.3 at      */
+/*                width x height (default 512x256),                   */
+/*   output:      planet_write() of that map (Mercator, or the        */
+/*                heightfield) as BMP, PPM, XPM, PNG and PGM files.   */
+/* Each is repeated until it has taken at least T seconds (default    */
+/* 0.2).  The results are printed as JSON on stdout, with the CPU     */
+/* cycles and instructions of each where the perf_event interface of  */
+/* Linux allows it (otherwise these are null).                        */
+/* planet.c is included to get at its static functions.               */
+
+#include "planet.c"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+static double mintime = 0.2;
+static volatile double sink; /* keeps the kernels from being optimised away */
+
+/* Hardware counters: CPU cycles and instructions of this process and */
+/* the threads it starts, or fd -1 if they can not be had */
+
+static int counterfd[2] = { -1, -1 };
+
+static void opencounters(void)
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+  int k;
+
+  for (k=0; k<2; k++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = k == 0 ? PERF_COUNT_HW_CPU_CYCLES
+			 : PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counterfd[k] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  if (counterfd[0] < 0 || counterfd[1] < 0) {
+    if (counterfd[0] >= 0) close(counterfd[0]);
+    if (counterfd[1] >= 0) close(counterfd[1]);
+    counterfd[0] = counterfd[1] = -1;
+  }
+#endif
+}
+
+static void startcounters(void)
+{
+#ifdef __linux__
+  int k;
+
+  for (k=0; k<2 && counterfd[k] >= 0; k++) {
+    ioctl(counterfd[k], PERF_EVENT_IOC_RESET, 0);
+    ioctl(counterfd[k], PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+/* Read the counters into c[0] (cycles) and c[1] (instructions), */
+/* which are set to -1 if there are none */
+
+static void stopcounters(double *c)
+{
+  c[0] = c[1] = -1.0;
+#ifdef __linux__
+  {
+    long long v;
+    int k;
+
+    for (k=0; k<2 && counterfd[k] >= 0; k++) {
+      ioctl(counterfd[k], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(counterfd[k], &v, sizeof(v)) == sizeof(v)) c[k] = (double)v;
+    }
+  }
+#endif
+}
+
+/* Run fn(arg, n) with n = 1, 2, 4, ... until it takes mintime.  Returns */
+/* the seconds of the last run and its n and counters */
+
+static double measure(void (*fn)(void *, long), void *arg, long *n,
+		      double *c)
+{
+  double t;
+
+  for (*n = 1; ; *n *= 2) {
+    startcounters();
+    t = wallclock();
+    fn(arg, *n);
+    t = wallclock()-t;
+    stopcounters(c);
+    if (t >= mintime || *n >= 1L<<40) return(t);
+  }
+}
+
+/* Print the counters per unit as JSON fields */
+
+static void printcounters(double *c, double units, char *unit)
+{
+  if (c[0] < 0.0)
+    printf("\"cycles_per_%s\": null, \"instructions_per_%s\": null",
+	   unit, unit);
+  else
+    printf("\"cycles_per_%s\": %.1f, \"instructions_per_%s\": %.1f",
+	   unit, c[0]/units, unit, c[1]/units);
+}
+
+/* Kernel */
+
+#define NPOINTS 4096
+
+static double px[NPOINTS], py[NPOINTS], pz[NPOINTS];
+
+static void randompoints(void)
+{
+  unsigned long r = 12345;
+  double x, y, z, l;
+  int i;
+
+  for (i=0; i<NPOINTS; ) {
+    r = r*1103515245+12345; x = (double)((r>>16)&32767)/16384.0-1.0;
+    r = r*1103515245+12345; y = (double)((r>>16)&32767)/16384.0-1.0;
+    r = r*1103515245+12345; z = (double)((r>>16)&32767)/16384.0-1.0;
+    l = sqrt(x*x+y*y+z*z);
+    if (l < 0.1 || l > 1.0) continue;
+    px[i] = x/l; py[i] = y/l; pz[i] = z/l;
+    i++;
+  }
+}
+
+static void benchplanet1(void *arg, long n)
+{
+  worker *w = (worker*)arg;
+  double s = 0.0;
+  long k;
+
+  for (k=0; k<n; k++) {
+    ssclear(w);
+    s += planet1(w, px[k%NPOINTS], py[k%NPOINTS], pz[k%NPOINTS]);
+  }
+  sink = s;
+}
+
+static void benchrand2(void *arg, long n)
+{
+  double s = 0.0, p = 0.3;
+  long k;
+
+  (void)arg;
+  for (k=0; k<n; k++) s += rand2(p+k, 0.7);
+  sink = s;
+}
+
+static void benchinside(void *arg, long n)
+{
+  vertex *t = (vertex*)arg;
+  long k;
+  int s = 0;
+
+  for (k=0; k<n; k++)
+    s += inside(t, px[k%NPOINTS], py[k%NPOINTS], pz[k%NPOINTS]);
+  sink = s;
+}
+
+static void kernel(planet_ctx *ctx)
+{
+  worker *w = &ctx->workers[0];
+  vertex t[4];
+  double secs, c[2];
+  long n;
+  int D;
+
+  printf("  \"kernel\": [\n");
+  for (D = 6; D <= 36; D += 6) {
+    w->Depth = D;
+    secs = measure(benchplanet1, w, &n, c);
+    printf("    {\"name\": \"planet1\", \"depth\": %d, \"ns_per_point\": %.1f, "
+	   "\"ns_per_level\": %.2f, ", D, 1e9*secs/n, 1e9*secs/n/D);
+    printcounters(c, (double)n, "point");
+    printf("},\n");
+  }
+  secs = measure(benchrand2, 0, &n, c);
+  printf("    {\"name\": \"rand2\", \"ns_per_call\": %.2f, ", 1e9*secs/n);
+  printcounters(c, (double)n, "call");
+  printf("},\n");
+  roottetra(ctx, t);
+  secs = measure(benchinside, t, &n, c);
+  printf("    {\"name\": \"inside\", \"ns_per_call\": %.2f, ", 1e9*secs/n);
+  printcounters(c, (double)n, "call");
+  printf("}\n  ],\n");
+}
+
+/* Projections */
+
+static void benchrender(void *arg, long n)
+{
+  long k;
+
+  for (k=0; k<n; k++) planet_render((planet_ctx*)arg, 0);
+}
+
+static void projections(planet_ctx *ctx)
+{
+  static char views[] = "mpqsogacMShi";
+  double secs, c[2], pixels = (double)ctx->Width*ctx->Height;
+  long n;
+  int k;
+
+  printf("  \"projections\": [\n");
+  for (k=0; views[k] != 0; k++) {
+    ctx->view = views[k];
+    if (planet_setup(ctx) != 0) {
+      fprintf(stderr, "Memory allocation failed.\n");
+      exit(1);
+    }
+    secs = measure(benchrender, ctx, &n, c);
+    printf("    {\"view\": \"%c\", \"pixels_per_sec\": %.0f, ",
+	   views[k], pixels*n/secs);
+    printcounters(c, pixels*n, "pixel");
+    printf("}%s\n", views[k+1] != 0 ? "," : "");
+  }
+  printf("  ],\n");
+}
+
+/* Output */
+
+static FILE *devnull;
+
+static void benchwrite(void *arg, long n)
+{
+  long k;
+
+  for (k=0; k<n; k++) planet_write((planet_ctx*)arg, devnull);
+}
+
+static void output(planet_ctx *ctx)
+{
+  static struct { char *name; ftype type; char view; } formats[] = {
+    { "bmp", bmp, 'm' }, { "ppm", ppm, 'm' }, { "xpm", xpm, 'm' },
+    { "png", png, 'm' }, { "heights", bmp, 'h' }, { "pgm", pgm, 'm' }
+  };
+  double secs, c[2], mb;
+  long n;
+  int k, nf = sizeof(formats)/sizeof(formats[0]);
+
+  if ((devnull = fopen("/dev/null", "wb")) == 0) {
+    fprintf(stderr, "Could not open /dev/null\n");
+    exit(1);
+  }
+  printf("  \"output\": [\n");
+  for (k=0; k<nf; k++) {
+    ctx->view = formats[k].view;
+    ctx->file_type = formats[k].type;
+    if (planet_setup(ctx) != 0) {
+      fprintf(stderr, "Memory allocation failed.\n");
+      exit(1);
+    }
+    planet_render(ctx, 0);
+    planet_write(ctx, devnull);
+    mb = ctx->outbytes/1048576.0;
+    secs = measure(benchwrite, ctx, &n, c);
+    printf("    {\"format\": \"%s\", \"bytes\": %ld, \"mb_per_sec\": %.1f, "
+	   "\"pixels_per_sec\": %.0f, ", formats[k].name, ctx->outbytes,
+	   mb*n/secs, (double)ctx->Width*ctx->Height*n/secs);
+    printcounters(c, (double)ctx->outbytes*n, "byte");
+    printf("}%s\n", k+1 < nf ? "," : "");
+  }
+  printf("  ]\n");
+  fclose(devnull);
+}
+
+int main(int ac, char **av)
+{
+  planet_ctx *ctx;
+  char *colours = "Olsson.col";
+  int i;
+
+  if ((ctx = planet_new()) == 0) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    exit(1);
+  }
+  ctx->rseed = 0.3;
+  ctx->Width = 512;
+  ctx->Height = 256;
+  for (i = 1; i < ac; i++) {
+    if (strcmp(av[i], "-t") == 0 && i+1 < ac)
+      ctx->nthreads = atoi(av[++i]);
+    else if (strcmp(av[i], "-T") == 0 && i+1 < ac)
+      mintime = atof(av[++i]);
+    else if (strcmp(av[i], "-w") == 0 && i+1 < ac)
+      ctx->Width = atoi(av[++i]);
+    else if (strcmp(av[i], "-h") == 0 && i+1 < ac)
+      ctx->Height = atoi(av[++i]);
+    else if (strcmp(av[i], "-C") == 0 && i+1 < ac)
+      colours = av[++i];
+    else {
+      fprintf(stderr, "usage: planetbench [-t threads] [-T seconds]"
+	      " [-w width] [-h height] [-C colourfile]\n");
+      exit(1);
+    }
+  }
+  if (planet_readcolors(ctx, colours) != 0) {
+    fprintf(stderr, "Cannot open %s\n", colours);
+    exit(1);
+  }
+  ctx->view = 'o';
+  if (planet_setup(ctx) != 0) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    exit(1);
+  }
+  randompoints();
+  opencounters();
+
+  printf("{\n");
+  printf("  \"seed\": %g, \"width\": %d, \"height\": %d, \"threads\": %d,"
+	 " \"counters\": %s,\n", ctx->rseed, ctx->Width, ctx->Height,
+	 ctx->nthreads, counterfd[0] >= 0 ? "true" : "false");
+  kernel(ctx);
+  projections(ctx);
+  output(ctx);
+  printf("}\n");
+  planet_free(ctx);
+  return(0);
+}
@@ -0,0 +1,183 @@
+/* planetload.c */
+/* load generator for the planet render daemon (planet --serve) */
+
+/* usage: planetload socket [-n requests] [-c clients] [-k seeds]     */
+/*                   [-b percent] [options]                           */
+/*                                                                    */
+/* Sends n requests (default 100) over c connections at a time        */
+/* (default 4).  Request i asks for the map with the given planet     */
+/* options and one of k seeds (default 10), so equal requests may be  */
+/* coalesced.  The given percentage of the requests (default 0) are   */
+/* batch requests, the rest interactive.                              */
+/* Prints the latency percentiles of the interactive and the batch    */
+/* requests and the number of requests per second.                    */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static char *sockname;
+static char options[2048];
+static int requests = 100, clients = 4, seeds = 10, batch = 0;
+static int next, failed;
+static double *latency[2]; /* of batch (0) and interactive (1) requests */
+static int count[2];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec + 1e-6*tv.tv_usec);
+}
+
+static int readall(int fd, char *buf, size_t n)
+{
+  ssize_t k;
+
+  while (n > 0) {
+    if ((k = read(fd, buf, n)) <= 0) {
+      if (k < 0 && errno == EINTR) continue;
+      return(-1);
+    }
+    buf += k;
+    n -= k;
+  }
+  return(0);
+}
+
+/* batch requests are spread evenly over the others */
+
+static int isbatch(int i)
+{
+  return((i*37)%100 < batch);
+}
+
+/* Send one request and read the reply.  Returns 0 if it was OK */
+
+static int request(int fd, int i)
+{
+  char line[2200], head[300], *buf;
+  unsigned long size;
+  int k, n;
+
+  n = sprintf(line, "%s -s 0.%d%s\n", isbatch(i) ? "batch" : "interactive",
+	      1000+i%seeds, options);
+  if (write(fd, line, n) != n) return(-1);
+  for (k = 0; k < (int)sizeof(head)-1; k++)
+    if (readall(fd, &head[k], 1) != 0 || head[k] == '\n') break;
+  head[k] = 0;
+  if (sscanf(head, "OK %lu", &size) != 1) {
+    fprintf(stderr, "planetload: %s\n", head);
+    return(-1);
+  }
+  if ((buf = (char*)malloc(size)) == 0) return(-1);
+  k = readall(fd, buf, size);
+  free(buf);
+  return(k);
+}
+
+static void *client(void *arg)
+{
+  struct sockaddr_un addr;
+  int fd, i, b;
+  double t0, t;
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return(arg);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, sockname, sizeof(addr.sun_path)-1);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    perror(sockname);
+    close(fd);
+    return(arg);
+  }
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    i = next++;
+    pthread_mutex_unlock(&lock);
+    if (i >= requests) break;
+    b = !isbatch(i);
+    t0 = now();
+    if (request(fd, i) != 0) {
+      pthread_mutex_lock(&lock);
+      failed++;
+      pthread_mutex_unlock(&lock);
+      break;
+    }
+    t = now()-t0;
+    pthread_mutex_lock(&lock);
+    latency[b][count[b]++] = t;
+    pthread_mutex_unlock(&lock);
+  }
+  close(fd);
+  return(arg);
+}
+
+static int cmp(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return(x < y ? -1 : x > y);
+}
+
+static void report(char *name, double *l, int n)
+{
+  if (n == 0) return;
+  qsort(l, n, sizeof(double), cmp);
+  printf("%-12s %5d requests  p50 %8.1f ms  p99 %8.1f ms  max %8.1f ms\n",
+	 name, n, 1000*l[n/2], 1000*l[(int)(0.99*(n-1)+0.5)], 1000*l[n-1]);
+}
+
+int main(int ac, char **av)
+{
+  pthread_t *threads;
+  double t0, t;
+  int i;
+
+  if (ac < 2) {
+    fprintf(stderr, "usage: planetload socket [-n requests] [-c clients]"
+	    " [-k seeds] [-b percent] [planet options]\n");
+    return(1);
+  }
+  sockname = av[1];
+  for (i = 2; i < ac; i++) {
+    if (i+1 < ac && strcmp(av[i], "-n") == 0) requests = atoi(av[++i]);
+    else if (i+1 < ac && strcmp(av[i], "-c") == 0) clients = atoi(av[++i]);
+    else if (i+1 < ac && strcmp(av[i], "-k") == 0) seeds = atoi(av[++i]);
+    else if (i+1 < ac && strcmp(av[i], "-b") == 0) batch = atoi(av[++i]);
+    else if (strlen(options)+strlen(av[i]) < sizeof(options)-2) {
+      strcat(options, " ");
+      strcat(options, av[i]);
+    }
+  }
+  if (requests < 1) requests = 1;
+  if (clients < 1) clients = 1;
+  if (seeds < 1) seeds = 1;
+
+  latency[0] = (double*)malloc(requests*sizeof(double));
+  latency[1] = (double*)malloc(requests*sizeof(double));
+  threads = (pthread_t*)malloc(clients*sizeof(pthread_t));
+  if (latency[0] == 0 || latency[1] == 0 || threads == 0) return(1);
+
+  t0 = now();
+  for (i = 0; i < clients; i++)
+    pthread_create(&threads[i], NULL, client, NULL);
+  for (i = 0; i < clients; i++)
+    pthread_join(threads[i], NULL);
+  t = now()-t0;
+
+  report("interactive", latency[1], count[1]);
+  report("batch", latency[0], count[0]);
+  printf("%d requests in %.2f s, %.1f requests/s", count[0]+count[1], t,
+	 (count[0]+count[1])/t);
+  if (failed) printf(", %d failed", failed);
+  printf("\n");
+  return(failed ? 1 : 0);
+}
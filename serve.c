@@ -0,0 +1,689 @@
+/* serve.c */
+/* render daemon of the planet generating program (planet --serve), */
+/* and the batch mode (planet --batch) */
+
+/* The daemon listens on a UNIX socket.  A client sends requests, one */
+/* per line, and gets a reply to each before the next is read:        */
+/*                                                                    */
+/*   request:  [interactive|batch] options                            */
+/*   reply:    OK size\n followed by size bytes of picture file, or   */
+/*             ERROR message\n                                        */
+/*                                                                    */
+/* The options are those of the command line (see Manual.txt), and   */
+/* default to those the daemon was started with.  -o, -pf, --tiles    */
+/* and --serve are not allowed.  Requests are interactive by default. */
+/*                                                                    */
+/* The maps are rendered by -t worker threads, each with its own      */
+/* context, which keeps its subdivision tree (--tree-cache-mb) from   */
+/* one map to the next.  Colour files are only read once.  Waiting    */
+/* interactive requests are rendered before batch requests, and a     */
+/* request identical to one that is waiting or being rendered gets    */
+/* the same picture instead of rendering it again.  On SIGINT or      */
+/* SIGTERM, the daemon stops accepting connections, renders the       */
+/* requests already queued, and returns when the workers are done.    */
+/*                                                                    */
+/* planet --batch file renders the maps of a job file the same way:   */
+/* each line holds the options of a map, including -o file or --tiles */
+/* (lines that are empty or start with # are skipped).  The jobs are  */
+/* taken in order by the -t workers, and when all are done, the time  */
+/* each took is printed on standard error.                            */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "planet.h"
+#include "options.h"
+
+#if defined(NOTHREADS) || defined(_WIN32)
+
+int serve(planet_ctx *ctx, options *o)
+{
+  (void)ctx; (void)o;
+  fprintf(stderr, "This version of planet has no --serve\n");
+  return(-1);
+}
+
+int batch(planet_ctx *ctx, options *o)
+{
+  (void)ctx; (void)o;
+  fprintf(stderr, "This version of planet has no --batch\n");
+  return(-1);
+}
+
+#else
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAXLINE 4096
+#define MAXARGS 100
+
+#define QUEUED 0
+#define RUNNING 1
+#define DONE 2
+
+typedef struct job
+{
+  char *line;            /* the options, also used to find equal requests */
+  int interactive;
+  int state;             /* QUEUED, RUNNING or DONE */
+  int waiting;           /* requests waiting for the result */
+  char *result;          /* picture file, or error message if error */
+  size_t size;
+  int error;
+  double secs;           /* --batch: the time it took */
+  struct job *next;      /* in its queue */
+  struct job *nextall;   /* in the list of jobs not DONE */
+} job;
+
+typedef struct colours   /* a colour file that has been read */
+{
+  char name[256];
+  int nocols, SEA, LAND, HIGHEST;
+  int rtable[65536], gtable[65536], btable[65536];
+  struct colours *next;
+} colours;
+
+static struct
+{
+  planet_ctx *defaults;  /* parameters the daemon was started with */
+  options opts;
+  int nworkers;
+  pthread_mutex_t lock;
+  pthread_cond_t work;   /* signalled when a job is queued */
+  pthread_cond_t done;   /* broadcast when a job is done */
+  job *first[2], *last[2]; /* queues of batch (0) and interactive (1) jobs */
+  job *all;              /* jobs not done */
+  colours *cols;
+  job *jobs;             /* --batch: the jobs, */
+  int njobs, nextjob;    /* how many, and the next to take */
+  int stop;              /* workers stop when the queues are empty */
+  int debug;             /* log each request */
+} server;
+
+/* Wait for SIGINT or SIGTERM, then stop the daemon: arg points at the */
+/* listening socket, which is shut down so that accept() returns */
+
+static void *stopper(void *arg)
+{
+  sigset_t stop;
+  int sig;
+
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  sigwait(&stop, &sig);
+  pthread_mutex_lock(&server.lock);
+  server.stop = 1;
+  pthread_cond_broadcast(&server.work);
+  pthread_mutex_unlock(&server.lock);
+  shutdown(*(int*)arg, SHUT_RDWR);
+  return(0);
+}
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec + 1e-6*tv.tv_usec);
+}
+
+static void enqueue(job *j)
+{
+  int q = j->interactive;
+
+  j->next = 0;
+  if (server.last[q]) server.last[q]->next = j;
+  else server.first[q] = j;
+  server.last[q] = j;
+}
+
+static void unqueue(job *j)
+{
+  int q = j->interactive;
+  job *p, *prev = 0;
+
+  for (p = server.first[q]; p != j; p = p->next) prev = p;
+  if (prev) prev->next = j->next;
+  else server.first[q] = j->next;
+  if (server.last[q] == j) server.last[q] = prev;
+}
+
+/* Colour table of file name if it was read before, with the lock held */
+
+static colours *findcolours(char *name)
+{
+  colours *c;
+
+  for (c = server.cols; c != 0; c = c->next)
+    if (strcmp(c->name, name) == 0) break;
+  return(c);
+}
+
+/* Colour table of file name, read it into ctx if this is the first */
+/* time.  The file is read without the lock, so two threads may read */
+/* it at once, and then the first to finish is kept */
+
+static colours *getcolours(planet_ctx *ctx, char *name)
+{
+  colours *c, *old;
+
+  pthread_mutex_lock(&server.lock);
+  c = findcolours(name);
+  pthread_mutex_unlock(&server.lock);
+  if (c != 0) return(c);
+  if (planet_readcolors(ctx, name) != 0) return(0);
+  if ((c = (colours*)malloc(sizeof(colours))) == 0) return(0);
+  strcpy(c->name, name);
+  c->nocols = ctx->nocols;
+  c->SEA = ctx->SEA; c->LAND = ctx->LAND; c->HIGHEST = ctx->HIGHEST;
+  memcpy(c->rtable, ctx->rtable, sizeof(c->rtable));
+  memcpy(c->gtable, ctx->gtable, sizeof(c->gtable));
+  memcpy(c->btable, ctx->btable, sizeof(c->btable));
+  pthread_mutex_lock(&server.lock);
+  if ((old = findcolours(name)) != 0) {
+    free(c);
+    c = old;
+  } else {
+    c->next = server.cols;
+    server.cols = c;
+  }
+  pthread_mutex_unlock(&server.lock);
+  return(c);
+}
+
+static void fail(job *j, char *msg)
+{
+  j->error = 1;
+  j->result = strdup(msg);
+  j->size = j->result ? strlen(j->result) : 0;
+}
+
+/* Set ctx and o to the defaults changed by the options in line (which */
+/* o then points into) and the colour table they give, for one worker */
+/* thread.  Returns 0, or -1 with a message in msg */
+
+static int prepare(planet_ctx *ctx, options *o, char *line, char *msg)
+{
+  char *av[MAXARGS+1], *save;
+  int ac;
+  colours *c;
+
+  av[0] = "planet";
+  for (ac = 1, av[ac] = strtok_r(line, " \t\r", &save);
+       av[ac] != 0 && ac < MAXARGS;
+       av[++ac] = strtok_r(NULL, " \t\r", &save));
+  if (av[ac] != 0) {
+    sprintf(msg, "More than %d options", MAXARGS-1);
+    return(-1);
+  }
+
+  planet_copy(ctx, server.defaults);
+  *o = server.opts;
+  o->do_file = 0;
+  o->tiledir = o->serve = o->batch = 0;
+  o->frames = 0;
+  o->nout = 0;
+  if (getoptions(ctx, o, ac, av, msg) != 0) return(-1);
+  ctx->nthreads = 1;
+  ctx->debug = 0;
+  ctx->tree_mb = server.defaults->tree_mb/server.nworkers;
+
+  if ((c = getcolours(ctx, o->colorsname)) == 0) {
+    sprintf(msg, "Cannot open %.200s", o->colorsname);
+    return(-1);
+  }
+  ctx->nocols = c->nocols;
+  ctx->SEA = c->SEA; ctx->LAND = c->LAND; ctx->HIGHEST = c->HIGHEST;
+  memcpy(ctx->rtable, c->rtable, sizeof(c->rtable));
+  memcpy(ctx->gtable, c->gtable, sizeof(c->gtable));
+  memcpy(ctx->btable, c->btable, sizeof(c->btable));
+  return(0);
+}
+
+/* Render job j with ctx */
+
+static void render(planet_ctx *ctx, job *j)
+{
+  char *line, msg[256];
+  options o;
+  FILE *f;
+
+  if ((line = strdup(j->line)) == 0) { fail(j, "Out of memory"); return; }
+  if (prepare(ctx, &o, line, msg) != 0) fail(j, msg);
+  else if (o.do_file || o.tiledir || o.frames || o.serve || o.batch ||
+	   ctx->view == 'f')
+    fail(j, "-o, -pf, --tiles, --frames, --serve and --batch can not be "
+	 "used here");
+  free(line);
+  if (j->error) return;
+  ctx->band = 0;
+
+  if (planet_setup(ctx) != 0) { fail(j, "Out of memory"); return; }
+  planet_render(ctx, NULL);
+  if ((f = open_memstream(&j->result, &j->size)) == 0) {
+    fail(j, "Out of memory");
+    return;
+  }
+  planet_write(ctx, f);
+  fclose(f);
+}
+
+static void *worker(void *arg)
+{
+  planet_ctx *ctx;
+  job *j;
+
+  if ((ctx = planet_new()) == 0) return(arg);
+  for (;;) {
+    pthread_mutex_lock(&server.lock);
+    while (server.first[1] == 0 && server.first[0] == 0 && !server.stop)
+      pthread_cond_wait(&server.work, &server.lock);
+    if (server.first[1] == 0 && server.first[0] == 0) {
+      pthread_mutex_unlock(&server.lock);
+      break;
+    }
+    j = server.first[1] ? server.first[1] : server.first[0];
+    unqueue(j);
+    j->state = RUNNING;
+    pthread_mutex_unlock(&server.lock);
+
+    render(ctx, j);
+
+    pthread_mutex_lock(&server.lock);
+    j->state = DONE;
+    if (server.all == j) server.all = j->nextall;
+    else {
+      job *p;
+      for (p = server.all; p->nextall != j; p = p->nextall);
+      p->nextall = j->nextall;
+    }
+    pthread_cond_broadcast(&server.done);
+    pthread_mutex_unlock(&server.lock);
+  }
+  planet_free(ctx);
+  return(arg);
+}
+
+/* Queue a request, or join an equal one that is not done yet.  Returns */
+/* 0 if out of memory, or if the daemon is stopping */
+
+static job *submit(char *line, int interactive, int *shared)
+{
+  job *j;
+
+  pthread_mutex_lock(&server.lock);
+  for (j = server.all; j != 0; j = j->nextall)
+    if (strcmp(j->line, line) == 0) break;
+  *shared = j != 0;
+  if (server.stop) j = 0;
+  else if (j != 0) {
+    j->waiting++;
+    if (interactive && !j->interactive && j->state == QUEUED) {
+      unqueue(j); /* move it to the interactive queue */
+      j->interactive = 1;
+      enqueue(j);
+    }
+  } else if ((j = (job*)calloc(1, sizeof(job))) != 0) {
+    if ((j->line = strdup(line)) == 0) {
+      free(j);
+      j = 0;
+    } else {
+      j->interactive = interactive;
+      j->state = QUEUED;
+      j->waiting = 1;
+      j->nextall = server.all;
+      server.all = j;
+      enqueue(j);
+      pthread_cond_signal(&server.work);
+    }
+  }
+  pthread_mutex_unlock(&server.lock);
+  return(j);
+}
+
+static int writeall(int fd, char *buf, size_t n)
+{
+  ssize_t k;
+
+  while (n > 0) {
+    if ((k = write(fd, buf, n)) < 0) {
+      if (errno == EINTR) continue;
+      return(-1);
+    }
+    buf += k;
+    n -= k;
+  }
+  return(0);
+}
+
+static void *connection(void *arg)
+{
+  int fd = (int)(long)arg, interactive, shared, stop, k, ok = 1;
+  char line[MAXLINE], head[64], *p;
+  double t0;
+  FILE *in;
+  job *j;
+
+  if ((in = fdopen(fd, "r")) == 0) {
+    close(fd);
+    return(0);
+  }
+  while (ok && fgets(line, MAXLINE, in) != 0) {
+    t0 = now();
+    if (strchr(line, '\n') == 0 && !feof(in)) { /* too long, skip it */
+      while ((k = getc(in)) != EOF && k != '\n');
+      ok = writeall(fd, "ERROR Request too long\n", 23) == 0;
+      continue;
+    }
+    line[strcspn(line, "\r\n")] = 0;
+    p = line + strspn(line, " \t");
+    interactive = 1;
+    if (strncmp(p, "batch", 5) == 0 && (p[5] == 0 || p[5] == ' ')) {
+      interactive = 0;
+      p += 5;
+    } else if (strncmp(p, "interactive", 11) == 0 &&
+	       (p[11] == 0 || p[11] == ' '))
+      p += 11;
+    p += strspn(p, " \t");
+
+    if ((j = submit(p, interactive, &shared)) == 0) {
+      pthread_mutex_lock(&server.lock);
+      stop = server.stop;
+      pthread_mutex_unlock(&server.lock);
+      ok = stop ? writeall(fd, "ERROR Shutting down\n", 20) == 0
+		: writeall(fd, "ERROR Out of memory\n", 20) == 0;
+      continue;
+    }
+    pthread_mutex_lock(&server.lock);
+    while (j->state != DONE)
+      pthread_cond_wait(&server.done, &server.lock);
+    pthread_mutex_unlock(&server.lock);
+
+    if (j->error) {
+      ok = writeall(fd, "ERROR ", 6) == 0 &&
+	   writeall(fd, j->result ? j->result : "", j->size) == 0 &&
+	   writeall(fd, "\n", 1) == 0;
+    } else {
+      sprintf(head, "OK %lu\n", (unsigned long)j->size);
+      ok = writeall(fd, head, strlen(head)) == 0 &&
+	   writeall(fd, j->result, j->size) == 0;
+    }
+    if (server.debug)
+      fprintf(stderr, "%s %s: %.1f ms%s\n",
+	      interactive ? "interactive" : "batch", p, 1000.0*(now()-t0),
+	      shared ? " (shared)" : "");
+
+    pthread_mutex_lock(&server.lock);
+    k = --j->waiting;
+    pthread_mutex_unlock(&server.lock);
+    if (k == 0) {
+      free(j->line);
+      free(j->result);
+      free(j);
+    }
+  }
+  fclose(in);
+  return(0);
+}
+
+int serve(planet_ctx *ctx, options *o)
+{
+  struct sockaddr_un addr;
+  sigset_t stop, old;
+  pthread_t thread, signals, *workers;
+  pthread_attr_t attr;
+  colours *c;
+  int s, fd, i, n, err = 0;
+
+  if (strlen(o->serve) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket name too long: %s\n", o->serve);
+    return(-1);
+  }
+  server.defaults = ctx;
+  server.opts = *o;
+  server.debug = ctx->debug;
+  server.nworkers = ctx->nthreads;
+  if (server.nworkers < 1) server.nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (server.nworkers < 1) server.nworkers = 1;
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.work, NULL);
+  pthread_cond_init(&server.done, NULL);
+  if ((workers = (pthread_t*)calloc(server.nworkers, sizeof(pthread_t))) == 0) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    return(-1);
+  }
+
+  if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    perror("socket");
+    free(workers);
+    return(-1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, o->serve);
+  unlink(o->serve);
+  if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(s, 64) != 0) {
+    perror(o->serve);
+    close(s);
+    free(workers);
+    return(-1);
+  }
+  signal(SIGPIPE, SIG_IGN); /* a client may go away before its reply */
+
+  /* SIGINT and SIGTERM are blocked in all threads, and taken by stopper */
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop, &old);
+  if (pthread_create(&signals, NULL, stopper, &s) != 0) {
+    perror("pthread_create");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    close(s);
+    unlink(o->serve);
+    free(workers);
+    return(-1);
+  }
+
+  for (n = 0; n < server.nworkers; n++)
+    if (pthread_create(&workers[n], NULL, worker, NULL) != 0) {
+      perror("pthread_create");
+      err = -1;
+      break;
+    }
+  if (ctx->debug && err == 0)
+    fprintf(stderr, "serving on %s with %d threads\n",
+	    o->serve, server.nworkers);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  while (err == 0) {
+    if ((fd = accept(s, NULL, NULL)) < 0) {
+      pthread_mutex_lock(&server.lock);
+      i = server.stop;
+      pthread_mutex_unlock(&server.lock);
+      if (i) break;
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      err = -1;
+    } else if (pthread_create(&thread, &attr, connection, (void*)(long)fd) != 0)
+      close(fd);
+  }
+  pthread_attr_destroy(&attr);
+
+  /* shut down: no more connections, and the workers finish the queues */
+  if (err != 0) pthread_kill(signals, SIGTERM);
+  pthread_join(signals, NULL);
+  close(s);
+  unlink(o->serve);
+  for (i = 0; i < n; i++) pthread_join(workers[i], NULL);
+  free(workers);
+  while ((c = server.cols) != 0) {
+    server.cols = c->next;
+    free(c);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (ctx->debug) fprintf(stderr, "stopped serving on %s\n", o->serve);
+  return(err);
+}
+
+/* Make the map or tiles of batch job j with ctx */
+
+static void runjob(planet_ctx *ctx, job *j)
+{
+  char *line, msg[256];
+  options o;
+  FILE *f;
+
+  if ((line = strdup(j->line)) == 0) { fail(j, "Out of memory"); return; }
+  if (prepare(ctx, &o, line, msg) != 0) fail(j, msg);
+  else if (o.serve || o.batch || ctx->view == 'f' || o.nout > 1)
+    fail(j, "-pf, several -o, --serve and --batch can not be used here");
+  else if (o.tiledir != 0) {
+    if (planet_tiles(ctx, o.tiledir, o.zmin, o.zmax) != 0) {
+      sprintf(msg, "Could not write the tiles to %.200s", o.tiledir);
+      fail(j, msg);
+    }
+  }
+  else if (o.frames > 0) {
+    if (frames(ctx, &o) != 0) fail(j, "Could not write the frames");
+  }
+  else if (!o.do_file || o.filename[0] == 0)
+    fail(j, "No output file (-o)");
+  else {
+    if (strchr(o.filename, '.') == 0)
+      strcat(o.filename, file_ext(ctx->file_type));
+    if ((f = fopen(o.filename, "wb")) == 0) {
+      sprintf(msg, "Could not open output file %.200s", o.filename);
+      fail(j, msg);
+    } else if (planet_setup(ctx) != 0) {
+      fclose(f);
+      fail(j, "Out of memory");
+    } else {
+      planet_stream(ctx, f);
+      if (fclose(f) != 0) {
+	sprintf(msg, "Could not write %.200s", o.filename);
+	fail(j, msg);
+      } else
+	sidecars(ctx, o.filename);
+    }
+  }
+  free(line);
+}
+
+static void *batchworker(void *arg)
+{
+  planet_ctx *ctx;
+  job *j;
+  double t0;
+
+  if ((ctx = planet_new()) == 0) return(arg);
+  for (;;) {
+    pthread_mutex_lock(&server.lock);
+    j = server.nextjob < server.njobs ? &server.jobs[server.nextjob++] : 0;
+    pthread_mutex_unlock(&server.lock);
+    if (j == 0) break;
+    t0 = now();
+    runjob(ctx, j);
+    j->secs = now()-t0;
+    j->state = DONE;
+  }
+  planet_free(ctx);
+  return(arg);
+}
+
+int batch(planet_ctx *ctx, options *o)
+{
+  char line[MAXLINE], *p;
+  pthread_t *threads;
+  job *j;
+  colours *c;
+  FILE *in;
+  double t0 = now(), secs = 0.0;
+  int i, k, n = 0, failed = 0, lineno = 0, ok = 1;
+
+  if ((in = fopen(o->batch, "r")) == 0) {
+    perror(o->batch);
+    return(-1);
+  }
+  while (fgets(line, MAXLINE, in) != 0) {
+    lineno++;
+    if (strchr(line, '\n') == 0 && !feof(in)) {
+      fprintf(stderr, "%s:%d: line too long\n", o->batch, lineno);
+      ok = 0;
+      break;
+    }
+    line[strcspn(line, "\r\n")] = 0;
+    p = line + strspn(line, " \t");
+    if (*p == 0 || *p == '#') continue;
+    if (server.njobs == n) {
+      n = n ? 2*n : 64;
+      if ((j = (job*)realloc(server.jobs, n*sizeof(job))) == 0) {
+	fprintf(stderr, "Out of memory\n");
+	ok = 0;
+	break;
+      }
+      server.jobs = j;
+    }
+    j = &server.jobs[server.njobs];
+    memset(j, 0, sizeof(job));
+    if ((j->line = strdup(p)) == 0) {
+      fprintf(stderr, "Out of memory\n");
+      ok = 0;
+      break;
+    }
+    server.njobs++;
+  }
+  fclose(in);
+  if (!ok) {
+    for (i = 0; i < server.njobs; i++) free(server.jobs[i].line);
+    free(server.jobs);
+    return(-1);
+  }
+
+  server.defaults = ctx;
+  server.opts = *o;
+  server.nworkers = ctx->nthreads;
+  if (server.nworkers < 1) server.nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (server.nworkers < 1) server.nworkers = 1;
+  if (server.nworkers > server.njobs) server.nworkers = server.njobs;
+  pthread_mutex_init(&server.lock, NULL);
+
+  threads = (pthread_t*)calloc(server.nworkers+1, sizeof(pthread_t));
+  for (k = 1; threads != 0 && k < server.nworkers; k++)
+    if (pthread_create(&threads[k], NULL, batchworker, NULL) != 0) break;
+  batchworker(NULL);
+  for (i = 1; threads != 0 && i < k; i++) pthread_join(threads[i], NULL);
+  free(threads);
+
+  for (i = 0; i < server.njobs; i++) {
+    j = &server.jobs[i];
+    if (j->state != DONE) fail(j, "Not run");
+    if (j->error) failed++;
+    secs += j->secs;
+    fprintf(stderr, "%8.2f s  %s%s%s\n", j->secs, j->line,
+	    j->error ? "\n          ERROR " : "", j->error ? j->result : "");
+    free(j->line);
+    free(j->result);
+  }
+  fprintf(stderr, "batch: %d jobs in %.1f s (%.0f ms per job), %d failed\n",
+	  server.njobs, now()-t0,
+	  server.njobs > 0 ? 1000.0*secs/server.njobs : 0.0, failed);
+  free(server.jobs);
+  while ((c = server.cols) != 0) {
+    server.cols = c->next;
+    free(c);
+  }
+  pthread_mutex_destroy(&server.lock);
+  return(failed > 0 ? -1 : 0);
+}
+
+#endif